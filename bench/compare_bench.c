@@ -0,0 +1,84 @@
+// Compare the single-pass replica comparator against the memcmp loop it
+// replaced in mirrorfs_read.
+//
+// usage: compare_bench [total_mib]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../mirrorfs.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int memcmp_loop(void *const bufs[], int count, size_t len)
+{
+    int differ = 0;
+    for (int i = 1; i < count; i++) {
+        differ |= memcmp(bufs[0], bufs[i], len) != 0;
+    }
+    return differ;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int counts[] = { 2, 3, 4, MAX_MNTPATHS };
+    static const size_t sizes[] = { 4096, 128 * 1024, 1024 * 1024 };
+    size_t total = (argc > 1 ? strtoul(argv[1], NULL, 0) : 4096) << 20;
+    void *bufs[MAX_MNTPATHS];
+
+    printf("# comparator: %s\n", compare_impl_name());
+    printf("replicas\tsize\tmemcmp_gbps\tcompare_gbps\tspeedup\n");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        for (int i = 0; i < MAX_MNTPATHS; i++) {
+            if (posix_memalign(&bufs[i], 4096, len) != 0) {
+                return 1;
+            }
+            memset(bufs[i], 0x5a, len);
+        }
+
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+            int count = counts[c];
+            size_t iters = total / (len * count) + 1;
+            volatile int sink = 0;
+            struct mismatch m;
+
+            double start = now();
+            for (size_t k = 0; k < iters; k++) {
+                sink |= memcmp_loop(bufs, count, len);
+            }
+            double t_memcmp = now() - start;
+
+            start = now();
+            for (size_t k = 0; k < iters; k++) {
+                sink |= compare_buffers(bufs, count, len, &m);
+            }
+            double t_compare = now() - start;
+
+            if (sink) {
+                fprintf(stderr, "unexpected mismatch\n");
+                return 1;
+            }
+
+            double bytes = (double)iters * len * count;
+            printf("%d\t%zu\t%.2f\t%.2f\t%.2f\n", count, len,
+                   bytes / t_memcmp / 1e9, bytes / t_compare / 1e9,
+                   t_memcmp / t_compare);
+        }
+
+        for (int i = 0; i < MAX_MNTPATHS; i++) {
+            free(bufs[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,413 @@
+// File system workloads for bench/run.sh.
+//
+// usage: fs_bench [-S mib] [-n ops] [-f files] [-e entries] dir workload...
+//        fs_bench -H
+//
+// Runs the named workloads one after another in dir and prints one
+// tab-separated line per workload: operations, bytes moved, elapsed time,
+// throughput and per-operation latency percentiles.  -H prints the column
+// names.  Every run issues the same operations in the same order, so results
+// are comparable across file systems and builds.
+//
+//   seqwrite     write a -S MiB file in 1 MiB requests
+//   seqread      read it back in 1 MiB requests
+//   randwrite4k  -n 4 KiB writes at random offsets of that file
+//   randread4k   -n 4 KiB reads at random offsets of that file
+//   create       create -f empty files in one directory
+//   stat         stat each of them
+//   unlink       remove each of them
+//   treestat     -n stats of files spread over a 16 level deep tree
+//   readdir      list a directory of -e entries, 10 times
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CHUNK (1024 * 1024)
+#define BLOCK 4096
+#define TREE_DEPTH 16
+#define TREE_FILES 8
+#define READDIR_PASSES 10
+
+static size_t file_mib = 256;
+static unsigned long op_count = 20000;
+static unsigned long file_count = 100000;
+static unsigned long entry_count = 10000;
+
+static char *buf;
+static uint64_t *lat;
+static unsigned long lat_count;
+static unsigned long lat_capacity;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+    fprintf(stderr, "fs_bench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+// Record the latency of an operation that started at start.
+static void sample(uint64_t start)
+{
+    uint64_t end = now_ns();
+
+    if (lat_count == lat_capacity) {
+        lat_capacity = lat_capacity ? 2 * lat_capacity : 65536;
+        lat = realloc(lat, lat_capacity * sizeof(*lat));
+        if (lat == NULL) {
+            die("realloc");
+        }
+    }
+    lat[lat_count++] = end - start;
+}
+
+// xorshift64 with a fixed seed, so random workloads repeat exactly.
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int open_seq(int flags)
+{
+    int fd = open("seq", flags, 0644);
+    if (fd == -1) {
+        die("seq");
+    }
+    return fd;
+}
+
+static uint64_t seqwrite(void)
+{
+    int fd = open_seq(O_WRONLY | O_CREAT | O_TRUNC);
+
+    for (size_t i = 0; i < file_mib; i++) {
+        uint64_t start = now_ns();
+        if (write(fd, buf, CHUNK) != CHUNK) {
+            die("write");
+        }
+        sample(start);
+    }
+    if (close(fd) != 0) {
+        die("close");
+    }
+    return (uint64_t)file_mib * CHUNK;
+}
+
+static uint64_t seqread(void)
+{
+    int fd = open_seq(O_RDONLY);
+    uint64_t bytes = 0;
+
+    for (;;) {
+        uint64_t start = now_ns();
+        ssize_t n = read(fd, buf, CHUNK);
+        if (n == -1) {
+            die("read");
+        }
+        if (n == 0) {
+            break;
+        }
+        sample(start);
+        bytes += n;
+    }
+    close(fd);
+    return bytes;
+}
+
+static uint64_t random_io(int write_io)
+{
+    int fd = open_seq(write_io ? O_WRONLY : O_RDONLY);
+    uint64_t blocks = (uint64_t)file_mib * CHUNK / BLOCK;
+
+    rng_state = 0x9e3779b97f4a7c15ull;
+    for (unsigned long i = 0; i < op_count; i++) {
+        off_t offset = (rng_next() % blocks) * BLOCK;
+        uint64_t start = now_ns();
+        ssize_t n = write_io ? pwrite(fd, buf, BLOCK, offset) : pread(fd, buf, BLOCK, offset);
+        if (n != BLOCK) {
+            die(write_io ? "pwrite" : "pread");
+        }
+        sample(start);
+    }
+    if (close(fd) != 0) {
+        die("close");
+    }
+    return (uint64_t)op_count * BLOCK;
+}
+
+static uint64_t randwrite4k(void)
+{
+    return random_io(1);
+}
+
+static uint64_t randread4k(void)
+{
+    return random_io(0);
+}
+
+static uint64_t create_files(void)
+{
+    char name[32];
+
+    if (mkdir("meta", 0755) != 0 && errno != EEXIST) {
+        die("meta");
+    }
+    for (unsigned long i = 0; i < file_count; i++) {
+        snprintf(name, sizeof(name), "meta/f%07lu", i);
+        uint64_t start = now_ns();
+        int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd == -1 || close(fd) != 0) {
+            die(name);
+        }
+        sample(start);
+    }
+    return 0;
+}
+
+static uint64_t stat_files(void)
+{
+    char name[32];
+    struct stat st;
+
+    for (unsigned long i = 0; i < file_count; i++) {
+        snprintf(name, sizeof(name), "meta/f%07lu", i);
+        uint64_t start = now_ns();
+        if (stat(name, &st) != 0) {
+            die(name);
+        }
+        sample(start);
+    }
+    return 0;
+}
+
+static uint64_t unlink_files(void)
+{
+    char name[32];
+
+    for (unsigned long i = 0; i < file_count; i++) {
+        snprintf(name, sizeof(name), "meta/f%07lu", i);
+        uint64_t start = now_ns();
+        if (unlink(name) != 0) {
+            die(name);
+        }
+        sample(start);
+    }
+    if (rmdir("meta") != 0) {
+        die("meta");
+    }
+    return 0;
+}
+
+// Path of file f at depth d of the tree: tree/d/d/.../fN.
+static void tree_path(char *path, int depth, int f)
+{
+    char *p = path + sprintf(path, "tree");
+    for (int d = 0; d < depth; d++) {
+        p += sprintf(p, "/d");
+    }
+    if (f >= 0) {
+        sprintf(p, "/f%d", f);
+    }
+}
+
+static uint64_t treestat(void)
+{
+    char path[4 * TREE_DEPTH + 32];
+    struct stat st;
+
+    // Building the tree is not timed.
+    for (int d = 0; d <= TREE_DEPTH; d++) {
+        tree_path(path, d, -1);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            die(path);
+        }
+        for (int f = 0; f < TREE_FILES; f++) {
+            tree_path(path, d, f);
+            int fd = open(path, O_WRONLY | O_CREAT, 0644);
+            if (fd == -1) {
+                die(path);
+            }
+            close(fd);
+        }
+    }
+
+    for (unsigned long i = 0; i < op_count; i++) {
+        unsigned long n = i % ((TREE_DEPTH + 1) * TREE_FILES);
+        tree_path(path, n / TREE_FILES, n % TREE_FILES);
+        uint64_t start = now_ns();
+        if (stat(path, &st) != 0) {
+            die(path);
+        }
+        sample(start);
+    }
+    return 0;
+}
+
+static uint64_t readdir_list(void)
+{
+    char name[32];
+
+    if (mkdir("list", 0755) != 0 && errno != EEXIST) {
+        die("list");
+    }
+    for (unsigned long i = 0; i < entry_count; i++) {
+        snprintf(name, sizeof(name), "list/e%07lu", i);
+        int fd = open(name, O_WRONLY | O_CREAT, 0644);
+        if (fd == -1) {
+            die(name);
+        }
+        close(fd);
+    }
+
+    for (int pass = 0; pass < READDIR_PASSES; pass++) {
+        unsigned long seen = 0;
+        uint64_t start = now_ns();
+        DIR *d = opendir("list");
+        if (d == NULL) {
+            die("list");
+        }
+        errno = 0;
+        while (readdir(d) != NULL) {
+            seen++;
+        }
+        if (errno != 0) {
+            die("readdir");
+        }
+        closedir(d);
+        sample(start);
+        if (seen != entry_count + 2) {
+            fprintf(stderr, "fs_bench: listed %lu entries, expected %lu\n", seen,
+                    entry_count + 2);
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    uint64_t (*run)(void);
+} workloads[] = {
+    { "seqwrite", seqwrite },
+    { "seqread", seqread },
+    { "randwrite4k", randwrite4k },
+    { "randread4k", randread4k },
+    { "create", create_files },
+    { "stat", stat_files },
+    { "unlink", unlink_files },
+    { "treestat", treestat },
+    { "readdir", readdir_list },
+};
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(double p)
+{
+    return lat_count ? lat[(size_t)(p * (lat_count - 1))] / 1e3 : 0.0;
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s [-S mib] [-n ops] [-f files] [-e entries] dir workload...\n"
+                    "       %s -H\n", progname, progname);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "HS:n:f:e:")) != -1) {
+        switch (opt) {
+            case 'H':
+                printf("workload\tops\tbytes\tseconds\tops_per_sec\tmib_per_sec\t"
+                       "p50_us\tp90_us\tp99_us\tmax_us\n");
+                return 0;
+            case 'S':
+                file_mib = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                op_count = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                file_count = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                entry_count = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || file_mib == 0) {
+        usage(argv[0]);
+    }
+    if (chdir(argv[optind]) != 0) {
+        die(argv[optind]);
+    }
+
+    buf = malloc(CHUNK);
+    if (buf == NULL) {
+        die("malloc");
+    }
+    for (size_t i = 0; i < CHUNK; i++) {
+        buf[i] = i * 31 + 7;
+    }
+
+    for (int a = optind + 1; a < argc; a++) {
+        size_t w = 0;
+        while (w < sizeof(workloads) / sizeof(workloads[0]) &&
+               strcmp(workloads[w].name, argv[a]) != 0) {
+            w++;
+        }
+        if (w == sizeof(workloads) / sizeof(workloads[0])) {
+            fprintf(stderr, "fs_bench: unknown workload %s\n", argv[a]);
+            return 2;
+        }
+
+        lat_count = 0;
+        uint64_t bytes = workloads[w].run();
+
+        // Throughput counts only the timed operations, not untimed setup.
+        uint64_t busy = 0;
+        for (unsigned long i = 0; i < lat_count; i++) {
+            busy += lat[i];
+        }
+        double seconds = busy / 1e9;
+        qsort(lat, lat_count, sizeof(*lat), u64_cmp);
+
+        printf("%s\t%lu\t%llu\t%.3f\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+               workloads[w].name, lat_count, (unsigned long long)bytes, seconds,
+               seconds > 0 ? lat_count / seconds : 0.0,
+               seconds > 0 ? bytes / seconds / (1 << 20) : 0.0,
+               percentile_us(0.50), percentile_us(0.90), percentile_us(0.99),
+               lat_count ? lat[lat_count - 1] / 1e3 : 0.0);
+        fflush(stdout);
+    }
+    return 0;
+}
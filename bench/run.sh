@@ -0,0 +1,73 @@
+#!/bin/bash
+
+# Runs bench/fs_bench in a plain directory and then through mirrorfs with
+# each of BENCH_REPLICAS mirrors, all on tmpfs, and prints one tab-separated
+# table of the results on stdout.  Extra mirrorfs options come from
+# MIRRORFS_OPTS, as in test.sh.  For mirrorfs the last column is the number
+# of read and write requests it served per GiB moved, taken from its stats
+# file, which shows what -o max_write and the like buy.
+
+which fusermount3 > /dev/null
+
+set -e
+
+replicas=${BENCH_REPLICAS:-1 2 3 9}
+workloads=${BENCH_WORKLOADS:-seqwrite seqread randwrite4k randread4k create stat unlink treestat readdir}
+bench_opts="-S ${BENCH_MIB:-256} -n ${BENCH_OPS:-20000} -f ${BENCH_FILES:-100000} -e ${BENCH_ENTRIES:-10000}"
+
+work=$(mktemp -d "${BENCH_DIR:-/dev/shm}/mirrorfs-bench.XXXXXX")
+mirrorfs_pid=
+cleanup() {
+    if [ -n "$mirrorfs_pid" ]; then
+        fusermount3 -q -u "$work/mnt" || true
+        wait $mirrorfs_pid || true
+    fi
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+echo "# $(uname -sr), $(nproc) cpus, MIRRORFS_OPTS=$MIRRORFS_OPTS"
+if [ "$(stat -f -c %T "$work")" != tmpfs ]; then
+    echo "# warning: $work is not on tmpfs"
+fi
+printf 'target\treplicas\t'
+bench/fs_bench -H | sed 's/$/\treq_per_gib/'
+
+# Read and write requests served so far by the mirrorfs mounted on $1.
+requests() {
+    awk '$1 == "read" || $1 == "write" { n += $2 } END { print n + 0 }' "$1/.mirrorfs/stats"
+}
+
+mkdir "$work/plain"
+bench/fs_bench $bench_opts "$work/plain" $workloads | sed 's/^/plain\t0\t/; s/$/\t-/'
+rm -rf "$work/plain"
+
+for n in $replicas; do
+    paths=
+    for i in $(seq $n); do
+        mkdir "$work/m$i"
+        paths="$paths $work/m$i"
+    done
+    mkdir "$work/mnt"
+
+    ./mirrorfs -f $MIRRORFS_OPTS $paths "$work/mnt" 2> /dev/null &
+    mirrorfs_pid=$!
+    for i in $(seq 30); do
+        mountpoint -q "$work/mnt" && break
+        sleep 1
+    done
+    mountpoint -q "$work/mnt"
+
+    for w in $workloads; do
+        before=$(requests "$work/mnt")
+        line=$(bench/fs_bench $bench_opts "$work/mnt" $w)
+        after=$(requests "$work/mnt")
+        echo "$line" | awk -F '\t' -v OFS='\t' -v n=$n -v r=$((after - before)) \
+            '{ print "mirrorfs", n, $0, ($3 > 0 ? sprintf("%.0f", r * 1073741824 / $3) : "-") }'
+    done
+
+    fusermount3 -u "$work/mnt"
+    wait $mirrorfs_pid
+    mirrorfs_pid=
+    rm -rf "$work"/m* "$work/mnt"
+done
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mirrorfs.h"
+
+#define BUFPOOL_ALIGN 4096
+
+// Per-thread scratch space holding one buffer per replica.  Arenas are linked
+// into a global list so their counters can be summed for reporting; threads
+// only ever write their own counters.
+struct bufpool_arena {
+    char *base;
+    size_t size;                  // bytes per replica
+    atomic_ulong hits;            // requests served from the existing arena
+    atomic_ulong grows;           // (re)allocations of the arena
+    struct bufpool_arena *prev;
+    struct bufpool_arena *next;
+};
+
+static size_t default_size = 128 * 1024;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static __thread struct bufpool_arena *thread_arena;
+
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bufpool_arena *arenas;
+static unsigned long retired_hits;
+static unsigned long retired_grows;
+static atomic_ulong bytes_held;
+
+static void arena_free(void *arg)
+{
+    struct bufpool_arena *arena = arg;
+
+    pthread_mutex_lock(&arenas_lock);
+    if (arena->prev != NULL) {
+        arena->prev->next = arena->next;
+    } else {
+        arenas = arena->next;
+    }
+    if (arena->next != NULL) {
+        arena->next->prev = arena->prev;
+    }
+    retired_hits += atomic_load_explicit(&arena->hits, memory_order_relaxed);
+    retired_grows += atomic_load_explicit(&arena->grows, memory_order_relaxed);
+    pthread_mutex_unlock(&arenas_lock);
+
+    atomic_fetch_sub(&bytes_held, arena->size * mntpath_count);
+    free(arena->base);
+    free(arena);
+}
+
+static void arena_key_create(void)
+{
+    pthread_key_create(&arena_key, arena_free);
+}
+
+static struct bufpool_arena *arena_create(void)
+{
+    struct bufpool_arena *arena = calloc(1, sizeof(*arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    pthread_once(&arena_once, arena_key_create);
+    pthread_setspecific(arena_key, arena);
+
+    pthread_mutex_lock(&arenas_lock);
+    arena->next = arenas;
+    if (arenas != NULL) {
+        arenas->prev = arena;
+    }
+    arenas = arena;
+    pthread_mutex_unlock(&arenas_lock);
+
+    return arena;
+}
+
+static void counter_inc(atomic_ulong *counter)
+{
+    // Only the owning thread writes, so a relaxed load/store pair suffices.
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+void bufpool_init(size_t size)
+{
+    if (size != 0) {
+        default_size = size;
+    }
+}
+
+int bufpool_get(size_t size, void *bufs[MAX_MNTPATHS])
+{
+    struct bufpool_arena *arena = thread_arena;
+
+    if (arena == NULL) {
+        arena = arena_create();
+        if (arena == NULL) {
+            return -1;
+        }
+        thread_arena = arena;
+    }
+
+    if (size > arena->size) {
+        size_t new_size = arena->size ? arena->size : default_size;
+        while (new_size < size) {
+            new_size *= 2;
+        }
+        new_size = (new_size + BUFPOOL_ALIGN - 1) & ~(size_t)(BUFPOOL_ALIGN - 1);
+
+        void *base;
+        if (posix_memalign(&base, BUFPOOL_ALIGN, new_size * mntpath_count) != 0) {
+            return -1;
+        }
+        free(arena->base);
+        atomic_fetch_add(&bytes_held, (new_size - arena->size) * mntpath_count);
+        arena->base = base;
+        arena->size = new_size;
+        counter_inc(&arena->grows);
+    } else {
+        counter_inc(&arena->hits);
+    }
+
+    for (int i = 0; i < mntpath_count; i++) {
+        bufs[i] = arena->base + i * arena->size;
+    }
+    return 0;
+}
+
+void bufpool_report(FILE *f)
+{
+    unsigned long hits;
+    unsigned long grows;
+    unsigned threads = 0;
+
+    pthread_mutex_lock(&arenas_lock);
+    hits = retired_hits;
+    grows = retired_grows;
+    for (struct bufpool_arena *arena = arenas; arena != NULL; arena = arena->next) {
+        hits += atomic_load_explicit(&arena->hits, memory_order_relaxed);
+        grows += atomic_load_explicit(&arena->grows, memory_order_relaxed);
+        threads++;
+    }
+    pthread_mutex_unlock(&arenas_lock);
+
+    fprintf(f, "bufpool: %u arenas, %lu bytes held, %lu reuses, %lu allocations\n",
+            threads, atomic_load(&bytes_held), hits, grows);
+}
@@ -0,0 +1,284 @@
+#define FUSE_USE_VERSION 312
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_common.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mirrorfs.h"
+
+// Write coalescing.  With -o write_coalesce=N every handle open for writing
+// gets a buffer of N bytes.  Writes that continue the buffered range are
+// copied into it and answered at once; the buffer goes to the replicas as a
+// single write, and is compared there, when it fills up, when a write does
+// not continue it, when a read overlaps it, before truncate, fallocate,
+// copy_file_range and lseek, and on flush, fsync and release.
+// A failed or diverging buffer write cannot fail the writes it holds, so its
+// error is kept and returned by the next flush or fsync of the handle.
+//
+// Buffers are registered by the primary's device and inode, as sync.c groups
+// syncs, and every buffer of a file is written before its attributes are
+// returned, so the size seen by stat and O_APPEND writers through other
+// handles includes buffered data.  Reads through other handles only see it
+// once the buffer is written.
+
+#define COALESCE_BUCKETS 64
+
+struct write_buffer {
+    pthread_mutex_t lock;
+    char *data;               // options.write_coalesce bytes, allocated on first use
+    size_t len;
+    off_t offset;             // file offset of data[0]
+    int error;                // errno of a buffer write not yet reported
+    struct mirror_handle *h;
+    dev_t dev;                // primary's device and inode, if registered
+    ino_t ino;
+    int registered;
+    struct write_buffer *next;
+};
+
+// Buffers are added and removed under the write lock and written out by
+// file under the read lock.
+static pthread_rwlock_t buckets_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct write_buffer *buckets[COALESCE_BUCKETS];
+static atomic_uint buffers_registered;
+
+static atomic_ulong writes_buffered;
+static atomic_ulong bytes_buffered;
+static atomic_ulong buffer_writes;
+
+void coalesce_open(struct mirror_handle *h, int flags)
+{
+    h->wb = NULL;
+    if (options.write_coalesce == 0 || (flags & O_ACCMODE) == O_RDONLY) {
+        return;
+    }
+
+    // Without a buffer the handle simply writes through.
+    struct write_buffer *wb = calloc(1, sizeof(*wb));
+    if (wb == NULL) {
+        return;
+    }
+    pthread_mutex_init(&wb->lock, NULL);
+    wb->h = h;
+    h->wb = wb;
+
+    // A buffer that cannot be found by file is still written on the
+    // handle's own operations.
+    struct stat st;
+    if (fstat(h->fds[0], &st) == -1) {
+        return;
+    }
+    wb->dev = st.st_dev;
+    wb->ino = st.st_ino;
+    wb->registered = 1;
+    pthread_rwlock_wrlock(&buckets_lock);
+    wb->next = buckets[wb->ino % COALESCE_BUCKETS];
+    buckets[wb->ino % COALESCE_BUCKETS] = wb;
+    atomic_fetch_add_explicit(&buffers_registered, 1, memory_order_relaxed);
+    pthread_rwlock_unlock(&buckets_lock);
+}
+
+// Write the buffered range to every replica.  Called with wb->lock held.
+static void buffer_write(struct mirror_handle *h)
+{
+    struct write_buffer *wb = h->wb;
+    size_t done = 0;
+
+    while (done < wb->len) {
+        int res = mirror_write(h->fds, wb->data + done, wb->len - done, wb->offset + done);
+        if (res <= 0) {
+            if (wb->error == 0) {
+                wb->error = res < 0 ? -res : EIO;
+            }
+            break;
+        }
+        done += res;
+    }
+    if (wb->len > 0) {
+        atomic_fetch_add_explicit(&buffer_writes, 1, memory_order_relaxed);
+    }
+    wb->len = 0;
+}
+
+// Make room for size bytes at offset, writing out the buffer if they do not
+// continue it.  Returns where to copy them, or NULL if they are too large to
+// be buffered.  Called with wb->lock held.
+static char *buffer_reserve(struct mirror_handle *h, size_t size, off_t offset)
+{
+    struct write_buffer *wb = h->wb;
+
+    if (wb->len > 0 && (offset != wb->offset + (off_t)wb->len ||
+                        wb->len + size > options.write_coalesce)) {
+        buffer_write(h);
+    }
+    if (size >= options.write_coalesce) {
+        return NULL;
+    }
+    if (wb->data == NULL) {
+        wb->data = malloc(options.write_coalesce);
+        if (wb->data == NULL) {
+            return NULL;
+        }
+    }
+    if (wb->len == 0) {
+        wb->offset = offset;
+    }
+    return wb->data + wb->len;
+}
+
+static void buffer_added(struct mirror_handle *h, size_t size)
+{
+    struct write_buffer *wb = h->wb;
+
+    wb->len += size;
+    atomic_fetch_add_explicit(&writes_buffered, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bytes_buffered, size, memory_order_relaxed);
+    if (wb->len == options.write_coalesce) {
+        buffer_write(h);
+    }
+}
+
+int coalesce_write(struct mirror_handle *h, const char *buf, size_t size, off_t offset)
+{
+    struct write_buffer *wb = h->wb;
+
+    pthread_mutex_lock(&wb->lock);
+    char *dst = buffer_reserve(h, size, offset);
+    if (dst == NULL) {
+        pthread_mutex_unlock(&wb->lock);
+        return mirror_write(h->fds, buf, size, offset);
+    }
+    memcpy(dst, buf, size);
+    buffer_added(h, size);
+    pthread_mutex_unlock(&wb->lock);
+    return size;
+}
+
+int coalesce_write_buf(struct mirror_handle *h, struct fuse_bufvec *buf, off_t offset)
+{
+    struct write_buffer *wb = h->wb;
+    size_t size = fuse_buf_size(buf);
+
+    pthread_mutex_lock(&wb->lock);
+    char *dst = buffer_reserve(h, size, offset);
+    if (dst == NULL) {
+        pthread_mutex_unlock(&wb->lock);
+        return mirror_write_buf(h->fds, buf, offset);
+    }
+    struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+    bv.buf[0].mem = dst;
+    ssize_t n = fuse_buf_copy(&bv, buf, 0);
+    if (n > 0) {
+        buffer_added(h, n);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return n;
+}
+
+void coalesce_read(struct mirror_handle *h, size_t size, off_t offset)
+{
+    struct write_buffer *wb = h->wb;
+
+    if (wb == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&wb->lock);
+    if (wb->len > 0 && offset < wb->offset + (off_t)wb->len &&
+        wb->offset < offset + (off_t)size) {
+        buffer_write(h);
+    }
+    pthread_mutex_unlock(&wb->lock);
+}
+
+void coalesce_writeout(struct mirror_handle *h)
+{
+    struct write_buffer *wb = h->wb;
+
+    if (wb == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&wb->lock);
+    buffer_write(h);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+int coalesce_writeout_file(dev_t dev, ino_t ino)
+{
+    int written = 0;
+
+    if (atomic_load_explicit(&buffers_registered, memory_order_relaxed) == 0) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&buckets_lock);
+    for (struct write_buffer *wb = buckets[ino % COALESCE_BUCKETS]; wb != NULL; wb = wb->next) {
+        if (wb->dev != dev || wb->ino != ino) {
+            continue;
+        }
+        pthread_mutex_lock(&wb->lock);
+        if (wb->len > 0) {
+            buffer_write(wb->h);
+            written = 1;
+        }
+        pthread_mutex_unlock(&wb->lock);
+    }
+    pthread_rwlock_unlock(&buckets_lock);
+    return written;
+}
+
+int coalesce_flush(struct mirror_handle *h)
+{
+    struct write_buffer *wb = h->wb;
+
+    if (wb == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&wb->lock);
+    buffer_write(h);
+    int err = wb->error;
+    wb->error = 0;
+    pthread_mutex_unlock(&wb->lock);
+    return -err;
+}
+
+int coalesce_release(struct mirror_handle *h)
+{
+    struct write_buffer *wb = h->wb;
+
+    if (wb == NULL) {
+        return 0;
+    }
+    if (wb->registered) {
+        pthread_rwlock_wrlock(&buckets_lock);
+        struct write_buffer **link = &buckets[wb->ino % COALESCE_BUCKETS];
+        while (*link != wb) {
+            link = &(*link)->next;
+        }
+        *link = wb->next;
+        atomic_fetch_sub_explicit(&buffers_registered, 1, memory_order_relaxed);
+        pthread_rwlock_unlock(&buckets_lock);
+    }
+    int res = coalesce_flush(h);
+    h->wb = NULL;
+    pthread_mutex_destroy(&wb->lock);
+    free(wb->data);
+    free(wb);
+    return res;
+}
+
+void coalesce_report(FILE *f)
+{
+    if (options.write_coalesce == 0) {
+        return;
+    }
+    fprintf(f, "coalesce: %lu writes (%lu bytes) buffered into %lu replica writes\n",
+            atomic_load(&writes_buffered), atomic_load(&bytes_buffered),
+            atomic_load(&buffer_writes));
+}
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mirrorfs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+typedef int (*compare_fn)(const unsigned char *const bufs[], int count,
+                          size_t len, struct mismatch *m);
+
+// Find the first offset at or after start where any replica differs from the
+// primary, and the length of that replica's differing run.  The vector loops
+// only detect that some block differs and leave the details to this.
+static int compare_locate(const unsigned char *const bufs[], int count,
+                          size_t start, size_t len, struct mismatch *m)
+{
+    for (size_t off = start; off < len; off++) {
+        for (int i = 1; i < count; i++) {
+            if (bufs[i][off] != bufs[0][off]) {
+                size_t end = off + 1;
+                while (end < len && bufs[i][end] != bufs[0][end]) {
+                    end++;
+                }
+                m->replica = i;
+                m->offset = off;
+                m->length = end - off;
+                return 1;
+            }
+        }
+    }
+    m->replica = -1;
+    m->offset = 0;
+    m->length = 0;
+    return 0;
+}
+
+static int compare_generic(const unsigned char *const bufs[], int count,
+                           size_t len, struct mismatch *m)
+{
+    size_t off = 0;
+
+    for (; off + sizeof(uint64_t) <= len; off += sizeof(uint64_t)) {
+        uint64_t p;
+        uint64_t diff = 0;
+        memcpy(&p, bufs[0] + off, sizeof(p));
+        for (int i = 1; i < count; i++) {
+            uint64_t r;
+            memcpy(&r, bufs[i] + off, sizeof(r));
+            diff |= p ^ r;
+        }
+        if (diff != 0) {
+            break;
+        }
+    }
+    return compare_locate(bufs, count, off, len, m);
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Each block of the primary is loaded once and compared against the same
+// block of every replica, so memory is streamed in a single pass.
+
+__attribute__((target("sse2")))
+static int compare_sse2(const unsigned char *const bufs[], int count,
+                        size_t len, struct mismatch *m)
+{
+    size_t off = 0;
+
+    for (; off + 32 <= len; off += 32) {
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(bufs[0] + off));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(bufs[0] + off + 16));
+        __m128i eq = _mm_set1_epi8(-1);
+        for (int i = 1; i < count; i++) {
+            __m128i r0 = _mm_loadu_si128((const __m128i *)(bufs[i] + off));
+            __m128i r1 = _mm_loadu_si128((const __m128i *)(bufs[i] + off + 16));
+            eq = _mm_and_si128(eq, _mm_and_si128(_mm_cmpeq_epi8(p0, r0),
+                                                 _mm_cmpeq_epi8(p1, r1)));
+        }
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            break;
+        }
+    }
+    return compare_locate(bufs, count, off, len, m);
+}
+
+__attribute__((target("avx2")))
+static int compare_avx2(const unsigned char *const bufs[], int count,
+                        size_t len, struct mismatch *m)
+{
+    size_t off = 0;
+
+    for (; off + 128 <= len; off += 128) {
+        const __m256i *p = (const __m256i *)(bufs[0] + off);
+        __m256i p0 = _mm256_loadu_si256(p);
+        __m256i p1 = _mm256_loadu_si256(p + 1);
+        __m256i p2 = _mm256_loadu_si256(p + 2);
+        __m256i p3 = _mm256_loadu_si256(p + 3);
+        __m256i diff = _mm256_setzero_si256();
+        for (int i = 1; i < count; i++) {
+            const __m256i *r = (const __m256i *)(bufs[i] + off);
+            __m256i d0 = _mm256_xor_si256(p0, _mm256_loadu_si256(r));
+            __m256i d1 = _mm256_xor_si256(p1, _mm256_loadu_si256(r + 1));
+            __m256i d2 = _mm256_xor_si256(p2, _mm256_loadu_si256(r + 2));
+            __m256i d3 = _mm256_xor_si256(p3, _mm256_loadu_si256(r + 3));
+            diff = _mm256_or_si256(diff, _mm256_or_si256(_mm256_or_si256(d0, d1),
+                                                         _mm256_or_si256(d2, d3)));
+        }
+        if (!_mm256_testz_si256(diff, diff)) {
+            break;
+        }
+    }
+    return compare_locate(bufs, count, off, len, m);
+}
+
+#endif
+
+static compare_fn compare_select(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return compare_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return compare_sse2;
+    }
+#endif
+    return compare_generic;
+}
+
+static compare_fn compare_impl;
+
+static compare_fn compare_get(void)
+{
+    compare_fn fn = __atomic_load_n(&compare_impl, __ATOMIC_RELAXED);
+
+    if (fn == NULL) {
+        fn = compare_select();
+        __atomic_store_n(&compare_impl, fn, __ATOMIC_RELAXED);
+    }
+    return fn;
+}
+
+int compare_buffers(void *const bufs[], int count, size_t len, struct mismatch *m)
+{
+    const unsigned char *const *b = (const unsigned char *const *)bufs;
+
+    // With a single replica there is nothing to share between passes and
+    // libc's memcmp is at least as fast as the kernels above.
+    if (count == 2) {
+        size_t start = memcmp(b[0], b[1], len) == 0 ? len : 0;
+        return compare_locate(b, count, start, len, m);
+    }
+    return compare_get()(b, count, len, m);
+}
+
+const char *compare_impl_name(void)
+{
+    compare_fn fn = compare_get();
+
+#ifdef HAVE_X86_SIMD
+    if (fn == compare_avx2) {
+        return "avx2";
+    }
+    if (fn == compare_sse2) {
+        return "sse2";
+    }
+#endif
+    return fn == compare_generic ? "generic" : "unknown";
+}
+
+void report_mismatch(const char *func, void *const bufs[], size_t len,
+                     off_t base, const struct mismatch *m)
+{
+    const unsigned char *p = bufs[0];
+    const unsigned char *r = bufs[m->replica];
+    size_t shown = m->length < 16 ? m->length : 16;
+
+    fprintf(stderr, "%s: replica %d differs at offset %lld, %zu of %zu bytes\n",
+            func, m->replica, (long long)(base + m->offset), m->length, len);
+    fprintf(stderr, "%s:   replica 0:", func);
+    for (size_t i = 0; i < shown; i++) {
+        fprintf(stderr, " %02x", p[m->offset + i]);
+    }
+    fprintf(stderr, "\n%s:   replica %d:", func, m->replica);
+    for (size_t i = 0; i < shown; i++) {
+        fprintf(stderr, " %02x", r[m->offset + i]);
+    }
+    fprintf(stderr, "\n");
+}
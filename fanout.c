@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "mirrorfs.h"
+
+// Lives on the stack of the thread that issued the call.  The last task to
+// finish posts done so the issuer can return.
+struct fanout_batch {
+    atomic_int pending;
+    sem_t done;
+    struct fanout_task tasks[MAX_MNTPATHS];
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct fanout_task *queue_head;
+static struct fanout_task *queue_tail;
+static int queue_stopping;
+
+static pthread_t *workers;
+static unsigned worker_count;
+
+// Operations given a NULL path act on the descriptor itself.  Those that
+// accept AT_EMPTY_PATH (or an empty path) use it; the others go through the
+// descriptor's /proc/self/fd link, which also works for O_PATH descriptors.
+static const char *mirror_call_path(const struct mirror_call *call, int i,
+                                    int *dirfd, int *flags, char *procpath)
+{
+    *dirfd = call->fds[i];
+    *flags = call->flags;
+    if (call->path != NULL) {
+        return call->path;
+    }
+
+    switch (call->op) {
+        case MIRROR_STATX:
+        case MIRROR_FCHOWNAT:
+            *flags |= AT_EMPTY_PATH;
+            return "";
+        case MIRROR_READLINKAT:
+            return "";
+        case MIRROR_OPENAT:
+            *flags &= ~O_NOFOLLOW;
+            break;
+        case MIRROR_LINKAT:
+            // linkat() does not follow the magic link by default.
+            *flags |= AT_SYMLINK_FOLLOW;
+            break;
+        default:
+            *flags &= ~AT_SYMLINK_NOFOLLOW;
+            break;
+    }
+    sprintf(procpath, "/proc/self/fd/%d", call->fds[i]);
+    *dirfd = AT_FDCWD;
+    return procpath;
+}
+
+static const char *const op_names[MIRROR_OP_COUNT] = {
+    [MIRROR_STATX] = "statx",
+    [MIRROR_FACCESSAT] = "faccessat",
+    [MIRROR_READLINKAT] = "readlinkat",
+    [MIRROR_MKDIRAT] = "mkdirat",
+    [MIRROR_UNLINKAT] = "unlinkat",
+    [MIRROR_SYMLINKAT] = "symlinkat",
+    [MIRROR_RENAMEAT] = "renameat",
+    [MIRROR_LINKAT] = "linkat",
+    [MIRROR_FCHMODAT] = "fchmodat",
+    [MIRROR_FCHOWNAT] = "fchownat",
+    [MIRROR_UTIMENSAT] = "utimensat",
+    [MIRROR_OPENAT] = "openat",
+    [MIRROR_PREAD] = "pread",
+    [MIRROR_PWRITE] = "pwrite",
+    [MIRROR_CLOSE] = "close",
+    [MIRROR_GETDENTS] = "getdents64",
+    [MIRROR_SPLICE] = "splice",
+    [MIRROR_FSYNC] = "fsync",
+    [MIRROR_FLUSH] = "flush",
+    [MIRROR_TRUNCATE] = "truncate",
+    [MIRROR_FTRUNCATE] = "ftruncate",
+    [MIRROR_FALLOCATE] = "fallocate",
+    [MIRROR_COPY_FILE_RANGE] = "copy_file_range",
+    [MIRROR_LSEEK] = "lseek",
+    [MIRROR_GETXATTR] = "getxattr",
+    [MIRROR_SETXATTR] = "setxattr",
+    [MIRROR_LISTXATTR] = "listxattr",
+    [MIRROR_REMOVEXATTR] = "removexattr",
+};
+
+const char *mirror_op_name(enum mirror_op op)
+{
+    return op < MIRROR_OP_COUNT ? op_names[op] : "unknown";
+}
+
+// Move size bytes from a pipe into fd at offset, retrying short splices.
+static ssize_t mirror_splice(int pipefd, int fd, size_t size, off_t offset)
+{
+    loff_t off = offset;
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = splice(pipefd, NULL, fd, &off, size - done, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return done > 0 ? (ssize_t)done : n;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// There are no *at() variants of the xattr calls, so a path relative to a
+// directory descriptor is resolved through the directory's /proc/self/fd
+// link.  Like the other path operations they do not follow a final symlink;
+// the magic link of a descriptor itself has to be followed.
+static ssize_t mirror_xattr(const struct mirror_call *call, int i, int dirfd,
+                            const char *path)
+{
+    char buf[PATH_MAX];
+    int follow = dirfd == AT_FDCWD;
+
+    if (!follow) {
+        int len = snprintf(buf, sizeof(buf), "/proc/self/fd/%d/%s", dirfd, path);
+        if (len < 0 || (size_t)len >= sizeof(buf)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        path = buf;
+    }
+
+    switch (call->op) {
+        case MIRROR_GETXATTR:
+            return follow ? getxattr(path, call->path2, call->bufs[i], call->size)
+                          : lgetxattr(path, call->path2, call->bufs[i], call->size);
+        case MIRROR_SETXATTR:
+            return follow ? setxattr(path, call->path2, call->wbuf, call->size, call->flags)
+                          : lsetxattr(path, call->path2, call->wbuf, call->size, call->flags);
+        case MIRROR_LISTXATTR:
+            return follow ? listxattr(path, call->bufs[i], call->size)
+                          : llistxattr(path, call->bufs[i], call->size);
+        case MIRROR_REMOVEXATTR:
+            return follow ? removexattr(path, call->path2)
+                          : lremovexattr(path, call->path2);
+        default:
+            errno = ENOSYS;
+            return -1;
+    }
+}
+
+uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void mirror_call_exec(struct mirror_call *call, int i)
+{
+    ssize_t res;
+    char procpath[32];
+    int dirfd;
+    int flags;
+    const char *path = mirror_call_path(call, i, &dirfd, &flags, procpath);
+    uint64_t start = monotonic_ns();
+
+    errno = 0;
+    switch (call->op) {
+        case MIRROR_STATX:
+            memset(&call->stxs[i], 0, sizeof(struct statx));
+            if (i == 0) {
+                res = statx(dirfd, path, flags, call->mask | STATX_BASIC_STATS, &call->stxs[i]);
+            } else {
+                res = statx(dirfd, path, flags | call->flags2, call->mask, &call->stxs[i]);
+            }
+            break;
+        case MIRROR_FACCESSAT:
+            res = faccessat(dirfd, path, call->mode, flags);
+            break;
+        case MIRROR_READLINKAT:
+            res = readlinkat(dirfd, path, call->bufs[i], call->size);
+            break;
+        case MIRROR_MKDIRAT:
+            res = mkdirat(call->fds[i], call->path, call->mode);
+            break;
+        case MIRROR_UNLINKAT:
+            res = unlinkat(call->fds[i], call->path, call->flags);
+            break;
+        case MIRROR_SYMLINKAT:
+            res = symlinkat(call->path2, call->fds[i], call->path);
+            break;
+        case MIRROR_RENAMEAT:
+            res = renameat(call->fds[i], call->path, call->fds2[i], call->path2);
+            break;
+        case MIRROR_LINKAT:
+            res = linkat(dirfd, path, call->fds2[i], call->path2, flags);
+            break;
+        case MIRROR_FCHMODAT:
+            res = fchmodat(dirfd, path, call->mode, flags);
+            break;
+        case MIRROR_FCHOWNAT:
+            res = fchownat(dirfd, path, call->uid, call->gid, flags);
+            break;
+        case MIRROR_UTIMENSAT:
+            res = utimensat(dirfd, path, call->ts, flags);
+            break;
+        case MIRROR_OPENAT:
+            res = openat(dirfd, path, flags, call->mode);
+            if (call->newfds != NULL) {
+                call->newfds[i] = res;
+            }
+            break;
+        case MIRROR_PREAD:
+            res = pread(call->fds[i], call->bufs[i], call->size, call->offset);
+            break;
+        case MIRROR_PWRITE:
+            res = pwrite(call->fds[i], call->wbuf, call->size, call->offset);
+            break;
+        case MIRROR_CLOSE:
+            res = close(call->fds[i]);
+            break;
+        case MIRROR_GETDENTS:
+            res = getdents64(call->fds[i], call->bufs[i], call->size);
+            break;
+        case MIRROR_SPLICE:
+            res = mirror_splice(call->pipes[i], call->fds[i], call->size, call->offset);
+            break;
+        case MIRROR_FSYNC:
+            res = call->flags ? fdatasync(call->fds[i]) : fsync(call->fds[i]);
+            break;
+        case MIRROR_FLUSH:
+            // Like close(), reports errors of writes the file system deferred.
+            res = dup(call->fds[i]);
+            if (res != -1) {
+                res = close(res);
+            }
+            break;
+        case MIRROR_TRUNCATE:
+            // There is no truncateat(); truncate() itself would need the
+            // file opened for writing anyway.
+            res = openat(dirfd, path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            if (res != -1) {
+                int fd = res;
+                res = ftruncate(fd, call->offset);
+                int saved = errno;
+                close(fd);
+                errno = saved;
+            }
+            break;
+        case MIRROR_FTRUNCATE:
+            res = ftruncate(call->fds[i], call->offset);
+            break;
+        case MIRROR_FALLOCATE:
+            res = fallocate(call->fds[i], call->flags, call->offset, call->size);
+            break;
+        case MIRROR_COPY_FILE_RANGE: {
+            loff_t off_in = call->offset;
+            loff_t off_out = call->offset2;
+            res = copy_file_range(call->fds[i], &off_in, call->fds2[i], &off_out,
+                                  call->size, call->flags);
+            break;
+        }
+        case MIRROR_LSEEK:
+            res = lseek(call->fds[i], call->offset, call->flags);
+            break;
+        case MIRROR_GETXATTR:
+        case MIRROR_SETXATTR:
+        case MIRROR_LISTXATTR:
+        case MIRROR_REMOVEXATTR:
+            res = mirror_xattr(call, i, dirfd, path);
+            break;
+        default:
+            res = -1;
+            errno = ENOSYS;
+            break;
+    }
+    call->res[i] = res;
+    call->errnos[i] = errno;
+    call->nsecs[i] = monotonic_ns() - start;
+    stats_exec(call, i);
+}
+
+static void fanout_task_done(void *arg, int replica)
+{
+    struct fanout_batch *batch = arg;
+
+    (void) replica;
+    if (atomic_fetch_sub_explicit(&batch->pending, 1, memory_order_acq_rel) == 1) {
+        sem_post(&batch->done);
+    }
+}
+
+// Append the chain of count tasks from first to last to the queue.
+static void fanout_append(struct fanout_task *first, struct fanout_task *last, int count)
+{
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail != NULL) {
+        queue_tail->next = first;
+    } else {
+        queue_head = first;
+    }
+    queue_tail = last;
+    if (count > 1) {
+        pthread_cond_broadcast(&queue_cond);
+    } else {
+        pthread_cond_signal(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+int fanout_queue(struct fanout_task *task)
+{
+    if (worker_count == 0) {
+        return -ENOSYS;
+    }
+    task->next = NULL;
+    fanout_append(task, task, 1);
+    return 0;
+}
+
+static void *fanout_worker(void *arg)
+{
+    (void) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL && !queue_stopping) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        if (queue_head == NULL) {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        struct fanout_task *task = queue_head;
+        queue_head = task->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        mirror_call_exec(task->call, task->replica);
+        task->done(task->arg, task->replica);
+    }
+}
+
+static void mirror_call_run_serial(struct mirror_call *call)
+{
+    for (int i = 0; i < mntpath_count; i++) {
+        mirror_call_exec(call, i);
+    }
+}
+
+void mirror_call_run(struct mirror_call *call)
+{
+    // Calls that need every replica's answer now must not overtake the
+    // background replicas.
+    if (shadow_enabled()) {
+        shadow_drain();
+    }
+    if (options.uring && mirror_call_run_uring(call) == 0) {
+        stats_call(call);
+        journal_call(call);
+        return;
+    }
+    if (worker_count == 0 || mntpath_count == 1) {
+        mirror_call_run_serial(call);
+        stats_call(call);
+        journal_call(call);
+        return;
+    }
+
+    struct fanout_batch batch;
+    atomic_init(&batch.pending, mntpath_count);
+    sem_init(&batch.done, 0, 0);
+
+    // Queue every replica except the primary, which this thread runs itself
+    // while the workers handle the rest.
+    for (int i = 1; i < mntpath_count; i++) {
+        batch.tasks[i].call = call;
+        batch.tasks[i].replica = i;
+        batch.tasks[i].done = fanout_task_done;
+        batch.tasks[i].arg = &batch;
+        batch.tasks[i].next = (i + 1 < mntpath_count) ? &batch.tasks[i + 1] : NULL;
+    }
+    fanout_append(&batch.tasks[1], &batch.tasks[mntpath_count - 1], mntpath_count - 1);
+
+    mirror_call_exec(call, 0);
+    fanout_task_done(&batch, 0);
+
+    while (sem_wait(&batch.done) == -1 && errno == EINTR) {
+    }
+    sem_destroy(&batch.done);
+    stats_call(call);
+    journal_call(call);
+}
+
+// Workers must be started after fuse has daemonized, since threads do not
+// survive the fork.
+int fanout_start(void)
+{
+    if (options.serial || mntpath_count < 2) {
+        return 0;
+    }
+
+    unsigned count = options.fanout_threads;
+    if (count == 0) {
+        count = 4 * (mntpath_count - 1);
+    }
+
+    workers = calloc(count, sizeof(pthread_t));
+    if (workers == NULL) {
+        return -ENOMEM;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        int err = pthread_create(&workers[i], NULL, fanout_worker, NULL);
+        if (err != 0) {
+            fprintf(stderr, "fanout: could not start worker %u: %s\n", i, strerror(err));
+            worker_count = i;
+            fanout_stop();
+            return -err;
+        }
+    }
+    worker_count = count;
+    return 0;
+}
+
+void fanout_stop(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    queue_stopping = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (unsigned i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mirrorfs.h"
+
+// Handles live in fixed-size chunks that are never moved or freed, so
+// looking one up is two loads with no locking.  Only open and release, which
+// allocate and recycle slots, take handles_lock.
+#define HANDLE_CHUNK_SHIFT 10
+#define HANDLE_CHUNK_SIZE (1 << HANDLE_CHUNK_SHIFT)
+#define HANDLE_CHUNKS 4096  // up to 4M open handles
+
+static struct mirror_handle *_Atomic chunks[HANDLE_CHUNKS];
+
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *free_list;      // recycled handle numbers, used as a stack
+static size_t free_count;
+static size_t free_capacity;
+static uint64_t handles_allocated; // slots handed out from the chunks so far
+
+struct mirror_handle *handle_get(uint64_t fh)
+{
+    struct mirror_handle *chunk =
+        atomic_load_explicit(&chunks[fh >> HANDLE_CHUNK_SHIFT], memory_order_acquire);
+    return &chunk[fh & (HANDLE_CHUNK_SIZE - 1)];
+}
+
+int handle_alloc(uint64_t *fh)
+{
+    pthread_mutex_lock(&handles_lock);
+
+    if (free_count > 0) {
+        *fh = free_list[--free_count];
+        pthread_mutex_unlock(&handles_lock);
+        return 0;
+    }
+
+    uint64_t next = handles_allocated;
+    size_t chunk = next >> HANDLE_CHUNK_SHIFT;
+    if (chunk >= HANDLE_CHUNKS) {
+        pthread_mutex_unlock(&handles_lock);
+        return -EMFILE;
+    }
+    if (atomic_load_explicit(&chunks[chunk], memory_order_relaxed) == NULL) {
+        struct mirror_handle *handles = calloc(HANDLE_CHUNK_SIZE, sizeof(*handles));
+        if (handles == NULL) {
+            pthread_mutex_unlock(&handles_lock);
+            return -ENOMEM;
+        }
+        atomic_store_explicit(&chunks[chunk], handles, memory_order_release);
+    }
+    handles_allocated++;
+    *fh = next;
+
+    pthread_mutex_unlock(&handles_lock);
+    return 0;
+}
+
+int handle_open(uint64_t *fh, const int fds[MAX_MNTPATHS])
+{
+    int res = handle_alloc(fh);
+    if (res != 0) {
+        for (int i = 0; i < mntpath_count; i++) {
+            close(fds[i]);
+        }
+        return res;
+    }
+
+    struct mirror_handle *h = handle_get(*fh);
+    for (int i = 0; i < mntpath_count; i++) {
+        h->fds[i] = fds[i];
+    }
+    h->read_bytes = 0;
+    return 0;
+}
+
+void handle_free(uint64_t fh)
+{
+    pthread_mutex_lock(&handles_lock);
+    if (free_count == free_capacity) {
+        size_t capacity = free_capacity ? 2 * free_capacity : HANDLE_CHUNK_SIZE;
+        uint64_t *list = realloc(free_list, capacity * sizeof(*list));
+        if (list == NULL) {
+            // Leak the slot rather than fail the release.
+            pthread_mutex_unlock(&handles_lock);
+            return;
+        }
+        free_list = list;
+        free_capacity = capacity;
+    }
+    free_list[free_count++] = fh;
+    pthread_mutex_unlock(&handles_lock);
+}
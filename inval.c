@@ -0,0 +1,138 @@
+#define FUSE_USE_VERSION 312
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mirrorfs.h"
+
+// Kernel cache invalidation for the path-based front end.  The high-level
+// library gives every name its own node, so a mutation through one hard link
+// leaves the cached attributes of the others stale.  Notifications must not
+// be sent from the request that caused them, since the kernel may still hold
+// the directory locks the invalidation needs, so they are queued to a thread
+// of their own.  The inode-based front end shares one node between all names
+// of an inode, and the kernel keeps that node's cache current by itself.
+
+struct inval_request {
+    struct inval_request *next;
+    char path[];
+};
+
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static struct inval_request *inval_head;
+static struct inval_request *inval_tail;
+static int inval_stopping;
+static int inval_running;
+static pthread_t inval_thread;
+
+static struct fuse *inval_fuse;
+
+static void inval_send(const struct inval_request *r)
+{
+    int res = fuse_invalidate_path(inval_fuse, r->path);
+
+    // -ENOENT only means the kernel had nothing cached.
+    if (res != 0 && res != -ENOENT) {
+        LOG_FUSE_OPERATION("%s: %s", r->path, strerror(-res));
+    }
+}
+
+static void *inval_worker(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&inval_lock);
+    for (;;) {
+        while (inval_head == NULL && !inval_stopping) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+        }
+        if (inval_head == NULL) {
+            break;
+        }
+        struct inval_request *r = inval_head;
+        inval_head = r->next;
+        if (inval_head == NULL) {
+            inval_tail = NULL;
+        }
+        pthread_mutex_unlock(&inval_lock);
+
+        inval_send(r);
+        free(r);
+
+        pthread_mutex_lock(&inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+    return NULL;
+}
+
+void inval_path(const char *path)
+{
+    if (!inval_running) {
+        return;
+    }
+
+    size_t len = strlen(path) + 1;
+    struct inval_request *r = malloc(sizeof(*r) + len);
+    if (r == NULL) {
+        // Nothing to do but let the cached state time out.
+        return;
+    }
+    r->next = NULL;
+    memcpy(r->path, path, len);
+
+    pthread_mutex_lock(&inval_lock);
+    if (inval_tail != NULL) {
+        inval_tail->next = r;
+    } else {
+        inval_head = r;
+    }
+    inval_tail = r;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+static int caching_enabled(void)
+{
+    return options.entry_timeout > 0 || options.attr_timeout > 0 ||
+           options.negative_timeout > 0 || options.keep_cache ||
+           options.writeback_cache;
+}
+
+// Only needed when the kernel caches anything.  Like the fan-out workers the
+// thread must be started after fuse has daemonized.
+int inval_start(struct fuse *fuse)
+{
+    if (!caching_enabled()) {
+        return 0;
+    }
+
+    inval_fuse = fuse;
+    int err = pthread_create(&inval_thread, NULL, inval_worker, NULL);
+    if (err != 0) {
+        return -err;
+    }
+    inval_running = 1;
+    return 0;
+}
+
+void inval_stop(void)
+{
+    if (!inval_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&inval_lock);
+    inval_stopping = 1;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+
+    pthread_join(inval_thread, NULL);
+    inval_running = 0;
+}
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mirrorfs.h"
+
+// Binary journal of replica calls and divergences.  Every thread appends
+// fixed-layout records to a ring of its own, with no locking: the thread is
+// the ring's only producer and the flusher its only consumer.  A full ring
+// drops records rather than stall the file system, and the flusher notes how
+// many were lost.  Records of one thread stay in order in the file, and a
+// divergence always follows the call it was found in.
+
+#define JOURNAL_RING_SIZE (1 << 20)
+#define JOURNAL_FLUSH_MS 100
+
+struct journal_ring {
+    char *buf;
+    _Atomic size_t head;      // advanced by the owning thread
+    _Atomic size_t tail;      // advanced by the flusher
+    atomic_ulong dropped;
+    atomic_int dead;          // the owning thread exited
+    struct journal_ring *next;
+};
+
+enum divergence_policy divergence_policy = DIVERGENCE_ABORT;
+int journal_enabled;
+
+static int journal_fd = -1;
+static atomic_ullong journal_seq;
+static unsigned long journal_lost;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct journal_ring *rings;
+
+// Serializes consumers: the flusher and threads flushing before abort().
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_stopping;
+static int flusher_running;
+static pthread_t flusher_thread;
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread struct journal_ring *thread_ring;
+static __thread uint32_t thread_id;
+static __thread uint64_t thread_seq;
+static __thread int thread_diverged;
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ring_release(void *arg)
+{
+    struct journal_ring *r = arg;
+    atomic_store_explicit(&r->dead, 1, memory_order_release);
+}
+
+static void ring_key_create(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static struct journal_ring *ring_get(void)
+{
+    struct journal_ring *r = thread_ring;
+
+    if (r == NULL) {
+        r = calloc(1, sizeof(*r));
+        if (r == NULL) {
+            return NULL;
+        }
+        r->buf = malloc(JOURNAL_RING_SIZE);
+        if (r->buf == NULL) {
+            free(r);
+            return NULL;
+        }
+        pthread_once(&ring_once, ring_key_create);
+        pthread_setspecific(ring_key, r);
+        thread_ring = r;
+        thread_id = gettid();
+
+        pthread_mutex_lock(&rings_lock);
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock(&rings_lock);
+    }
+    return r;
+}
+
+// Append one record gathered from parts.  The size in rec's header must be
+// the total, padding included.
+static void ring_append(struct journal_record *rec, const void *const parts[],
+                        const size_t lens[], int count)
+{
+    struct journal_ring *r = ring_get();
+    if (r == NULL) {
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (JOURNAL_RING_SIZE - (head - tail) < rec->size) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    size_t pos = head;
+    size_t written = 0;
+    for (int p = 0; p <= count; p++) {
+        const char *src = p < count ? parts[p] : NULL;
+        size_t len = p < count ? lens[p] : rec->size - written;
+        for (size_t done = 0; done < len; ) {
+            size_t at = pos & (JOURNAL_RING_SIZE - 1);
+            size_t n = len - done;
+            if (n > JOURNAL_RING_SIZE - at) {
+                n = JOURNAL_RING_SIZE - at;
+            }
+            if (src != NULL) {
+                memcpy(r->buf + at, src + done, n);
+            } else {
+                memset(r->buf + at, 0, n);
+            }
+            done += n;
+            pos += n;
+        }
+        written += len;
+    }
+    atomic_store_explicit(&r->head, head + rec->size, memory_order_release);
+
+    if (head + rec->size - tail > JOURNAL_RING_SIZE / 2) {
+        pthread_cond_signal(&flusher_cond);
+    }
+}
+
+static void write_all(const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(journal_fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Nothing sensible to do but lose the rest of the journal.
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void ring_flush(struct journal_ring *r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    while (tail != head) {
+        size_t at = tail & (JOURNAL_RING_SIZE - 1);
+        size_t n = head - tail;
+        if (n > JOURNAL_RING_SIZE - at) {
+            n = JOURNAL_RING_SIZE - at;
+        }
+        write_all(r->buf + at, n);
+        tail += n;
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+    unsigned long dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        struct journal_record rec = {
+            .type = JOURNAL_DROPPED,
+            .size = sizeof(rec),
+            .seq = dropped,
+            .time = realtime_ns(),
+        };
+        write_all(&rec, sizeof(rec));
+        journal_lost += dropped;
+    }
+}
+
+// Write out every ring and free those whose threads have exited.
+static void journal_flush(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&rings_lock);
+    struct journal_ring **link = &rings;
+    while (*link != NULL) {
+        struct journal_ring *r = *link;
+        int dead = atomic_load_explicit(&r->dead, memory_order_acquire);
+        ring_flush(r);
+        if (dead) {
+            *link = r->next;
+            free(r->buf);
+            free(r);
+        } else {
+            link = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void *journal_flusher(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flusher_cond, &flusher_lock, &deadline);
+        pthread_mutex_unlock(&flusher_lock);
+
+        journal_flush();
+
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+static uint16_t string_len(const char *s)
+{
+    if (s == NULL) {
+        return 0;
+    }
+    size_t len = strnlen(s, JOURNAL_STRING_MAX - 1);
+    return len + 1;
+}
+
+static size_t padded(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+void journal_call(const struct mirror_call *call)
+{
+    if (!journal_enabled) {
+        return;
+    }
+    thread_seq = atomic_fetch_add_explicit(&journal_seq, 1, memory_order_relaxed) + 1;
+
+    struct journal_call_record rec = {
+        .hdr = {
+            .type = JOURNAL_CALL,
+            .seq = thread_seq,
+            .time = realtime_ns(),
+        },
+        .op = call->op,
+        .replicas = mntpath_count,
+        .flags = call->flags,
+        .mode = call->mode,
+        .path_len = string_len(call->path),
+        .path2_len = string_len(call->path2),
+        .size = call->size,
+        .offset = call->offset,
+    };
+    struct journal_result results[MAX_MNTPATHS];
+    for (int i = 0; i < mntpath_count; i++) {
+        results[i].res = call->res[i];
+        results[i].err = call->errnos[i];
+        results[i].reserved = 0;
+        results[i].nsecs = call->nsecs[i];
+    }
+
+    // Strings are truncated without their NUL, so each gets one of its own.
+    const void *parts[] = { &rec, results, call->path, "", call->path2, "" };
+    size_t lens[] = {
+        sizeof(rec),
+        mntpath_count * sizeof(results[0]),
+        rec.path_len ? rec.path_len - 1 : 0, rec.path_len ? 1 : 0,
+        rec.path2_len ? rec.path2_len - 1 : 0, rec.path2_len ? 1 : 0,
+    };
+
+    if (ring_get() == NULL) {
+        return;
+    }
+    rec.hdr.thread = thread_id;
+    rec.hdr.size = padded(sizeof(rec) + lens[1] + rec.path_len + rec.path2_len);
+    ring_append(&rec.hdr, parts, lens, 6);
+}
+
+static void journal_divergence(const char *func, const struct divergence *d)
+{
+    struct journal_divergence_record rec = {
+        .hdr = {
+            .type = JOURNAL_DIVERGENCE,
+            .seq = thread_seq,
+            .time = realtime_ns(),
+        },
+        .replica = d->replica,
+        .func_len = string_len(func),
+        .what_len = string_len(d->what),
+        .name_len = string_len(d->name),
+        .primary = d->primary,
+        .value = d->value,
+        .offset = d->offset,
+        .length = d->length,
+    };
+    // Strings are truncated without their NUL, so each gets one of its own.
+    const void *parts[] = { &rec, func, "", d->what, "", d->name, "" };
+    size_t lens[] = {
+        sizeof(rec),
+        rec.func_len ? rec.func_len - 1 : 0, rec.func_len ? 1 : 0,
+        rec.what_len ? rec.what_len - 1 : 0, rec.what_len ? 1 : 0,
+        rec.name_len ? rec.name_len - 1 : 0, rec.name_len ? 1 : 0,
+    };
+
+    if (ring_get() == NULL) {
+        return;
+    }
+    rec.hdr.thread = thread_id;
+    rec.hdr.size = padded(sizeof(rec) + rec.func_len + rec.what_len + rec.name_len);
+    ring_append(&rec.hdr, parts, lens, 7);
+}
+
+void divergence(const char *func, const struct divergence *d)
+{
+    if (journal_enabled) {
+        journal_divergence(func, d);
+    }
+
+    switch (divergence_policy) {
+        case DIVERGENCE_ABORT:
+            if (journal_enabled) {
+                journal_flush();
+            }
+            log_flush();
+            abort();
+        case DIVERGENCE_EIO:
+            thread_diverged = 1;
+            break;
+        case DIVERGENCE_LOG:
+            break;
+    }
+}
+
+int divergence_take(void)
+{
+    int diverged = thread_diverged;
+    thread_diverged = 0;
+    return diverged;
+}
+
+// Opened before fuse daemonizes and changes to the root directory, so that
+// relative paths work.
+int journal_open(const char *path)
+{
+    journal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (journal_fd == -1) {
+        return -errno;
+    }
+
+    size_t names_size = 0;
+    for (int op = 0; op < MIRROR_OP_COUNT; op++) {
+        names_size += strlen(mirror_op_name(op)) + 1;
+    }
+    struct journal_file_header header = {
+        .magic = JOURNAL_MAGIC,
+        .version = JOURNAL_VERSION,
+        .op_count = MIRROR_OP_COUNT,
+        .names_size = names_size,
+    };
+    write_all(&header, sizeof(header));
+    for (int op = 0; op < MIRROR_OP_COUNT; op++) {
+        const char *name = mirror_op_name(op);
+        write_all(name, strlen(name) + 1);
+    }
+    return 0;
+}
+
+// Like the other background threads the flusher must be started after fuse
+// has daemonized.
+int journal_start(void)
+{
+    if (journal_fd == -1) {
+        return 0;
+    }
+
+    int err = pthread_create(&flusher_thread, NULL, journal_flusher, NULL);
+    if (err != 0) {
+        return -err;
+    }
+    flusher_running = 1;
+    journal_enabled = 1;
+    return 0;
+}
+
+void journal_stop(void)
+{
+    if (!flusher_running) {
+        return;
+    }
+
+    journal_enabled = 0;
+    pthread_mutex_lock(&flusher_lock);
+    flusher_stopping = 1;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher_thread, NULL);
+    flusher_running = 0;
+
+    journal_flush();
+    if (journal_lost > 0) {
+        fprintf(stderr, "journal: %lu records lost to full buffers\n", journal_lost);
+    }
+    close(journal_fd);
+    journal_fd = -1;
+}
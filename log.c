@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mirrorfs.h"
+
+// Operation log.  LOG_FUSE_OPERATION does not format anything: it copies its
+// format string pointer, raw argument values and string arguments into a
+// ring of the calling thread's own, with no locking, and a background thread
+// formats the records and writes them to stderr.  Like the journal, a full
+// ring drops records rather than stall the file system.  Lines of one thread
+// stay in order; lines of different threads may be interleaved differently
+// than the requests were.
+
+#define LOG_RING_SIZE (1 << 18)
+#define LOG_FLUSH_MS 50
+#define LOG_STRING_MAX 4096
+
+struct log_ring {
+    char *buf;
+    _Atomic size_t head;      // advanced by the owning thread
+    _Atomic size_t tail;      // advanced by the writer
+    atomic_ulong dropped;
+    atomic_int dead;          // the owning thread exited
+    struct log_ring *next;
+};
+
+// Followed by the string arguments, each with its NUL, padded to 8 bytes.
+// The value of a string argument is its length including the NUL, or 0 for
+// a NULL pointer.
+struct log_record {
+    uint32_t size;
+    uint8_t count;
+    uint8_t kinds[LOG_MAX_ARGS];
+    const char *func;
+    const char *fmt;
+    uint64_t args[LOG_MAX_ARGS];
+};
+
+int log_level;
+
+static unsigned long log_lost;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings;
+
+// Serializes consumers: the writer and threads flushing before abort().
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int writer_stopping;
+static int writer_running;
+static pthread_t writer_thread;
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread struct log_ring *thread_ring;
+
+static void ring_release(void *arg)
+{
+    struct log_ring *r = arg;
+    atomic_store_explicit(&r->dead, 1, memory_order_release);
+}
+
+static void ring_key_create(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static struct log_ring *ring_get(void)
+{
+    struct log_ring *r = thread_ring;
+
+    if (r == NULL) {
+        r = calloc(1, sizeof(*r));
+        if (r == NULL) {
+            return NULL;
+        }
+        r->buf = malloc(LOG_RING_SIZE);
+        if (r->buf == NULL) {
+            free(r);
+            return NULL;
+        }
+        pthread_once(&ring_once, ring_key_create);
+        pthread_setspecific(ring_key, r);
+        thread_ring = r;
+
+        pthread_mutex_lock(&rings_lock);
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock(&rings_lock);
+    }
+    return r;
+}
+
+static void ring_put(struct log_ring *r, size_t pos, const void *src, size_t len)
+{
+    size_t at = pos & (LOG_RING_SIZE - 1);
+    size_t n = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+
+    memcpy(r->buf + at, src, n);
+    memcpy(r->buf, (const char *)src + n, len - n);
+}
+
+static void ring_take(const struct log_ring *r, size_t pos, void *dst, size_t len)
+{
+    size_t at = pos & (LOG_RING_SIZE - 1);
+    size_t n = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+
+    memcpy(dst, r->buf + at, n);
+    memcpy((char *)dst + n, r->buf, len - n);
+}
+
+void log_record(const char *func, const char *fmt, int count,
+                const unsigned char *kinds, const uint64_t *args)
+{
+    struct log_record rec = {
+        .size = sizeof(rec),
+        .count = count,
+        .func = func,
+        .fmt = fmt,
+    };
+    const char *strings[LOG_MAX_ARGS];
+
+    for (int a = 0; a < count; a++) {
+        rec.kinds[a] = kinds[a];
+        rec.args[a] = args[a];
+        if (kinds[a] == LOG_ARG_STRING) {
+            strings[a] = (const char *)(uintptr_t)args[a];
+            rec.args[a] = strings[a] != NULL ? strnlen(strings[a], LOG_STRING_MAX - 1) + 1 : 0;
+            rec.size += rec.args[a];
+        }
+    }
+    rec.size = (rec.size + 7) & ~7u;
+
+    struct log_ring *r = ring_get();
+    if (r == NULL) {
+        return;
+    }
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < rec.size) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    // Strings are truncated without their NUL, so each gets one of its own.
+    size_t pos = head;
+    ring_put(r, pos, &rec, sizeof(rec));
+    pos += sizeof(rec);
+    for (int a = 0; a < count; a++) {
+        if (kinds[a] == LOG_ARG_STRING && rec.args[a] > 0) {
+            ring_put(r, pos, strings[a], rec.args[a] - 1);
+            ring_put(r, pos + rec.args[a] - 1, "", 1);
+            pos += rec.args[a];
+        }
+    }
+    atomic_store_explicit(&r->head, head + rec.size, memory_order_release);
+
+    if (head + rec.size - tail > LOG_RING_SIZE / 2) {
+        pthread_cond_signal(&writer_cond);
+    }
+}
+
+// Print one argument as the conversion spec, which ends in its conversion
+// character, asks for.  Length modifiers say how much of the recorded value
+// is significant; the rest was added by widening it to 64 bits.
+static void format_arg(FILE *out, const char *spec, size_t spec_len, int kind,
+                       uint64_t value, const char *string)
+{
+    char conv = spec[spec_len - 1];
+    char f[32] = "%";
+    size_t f_len = 1;
+    int longs = 0;
+    int shorts = 0;
+
+    // Copy flags, width and precision, and count the length modifiers.
+    for (size_t i = 0; i < spec_len - 1 && f_len < sizeof(f) - 4; i++) {
+        switch (spec[i]) {
+            case 'l': case 'z': case 'j': case 't': case 'L': case 'q':
+                longs++;
+                break;
+            case 'h':
+                shorts++;
+                break;
+            default:
+                f[f_len++] = spec[i];
+                break;
+        }
+    }
+
+    if (conv == 's') {
+        if (kind != LOG_ARG_STRING) {
+            fputs("?", out);
+            return;
+        }
+        f[f_len++] = 's';
+        f[f_len] = '\0';
+        fprintf(out, f, string != NULL ? string : "(null)");
+        return;
+    }
+    if (kind == LOG_ARG_STRING) {
+        fputs("?", out);
+        return;
+    }
+
+    switch (conv) {
+        case 'd':
+        case 'i':
+            if (longs == 0) {
+                value = shorts == 2 ? (int64_t)(signed char)value :
+                        shorts == 1 ? (int64_t)(short)value : (int64_t)(int)value;
+            }
+            memcpy(f + f_len, "lld", 4);
+            fprintf(out, f, (long long)value);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            if (longs == 0) {
+                value = shorts == 2 ? (unsigned char)value :
+                        shorts == 1 ? (unsigned short)value : (unsigned)value;
+            }
+            f[f_len++] = 'l';
+            f[f_len++] = 'l';
+            f[f_len++] = conv;
+            f[f_len] = '\0';
+            fprintf(out, f, (unsigned long long)value);
+            break;
+        case 'c':
+            memcpy(f + f_len, "c", 2);
+            fprintf(out, f, (int)value);
+            break;
+        case 'p':
+            memcpy(f + f_len, "p", 2);
+            fprintf(out, f, (void *)(uintptr_t)value);
+            break;
+        default:
+            // Floating point and the rest are not recorded.
+            fputs("?", out);
+            break;
+    }
+}
+
+static void format_record(FILE *out, const struct log_record *rec, const char *strings)
+{
+    const char *string[LOG_MAX_ARGS];
+    int a = 0;
+
+    for (int i = 0; i < rec->count; i++) {
+        string[i] = NULL;
+        if (rec->kinds[i] == LOG_ARG_STRING && rec->args[i] > 0) {
+            string[i] = strings;
+            strings += rec->args[i];
+        }
+    }
+
+    fprintf(out, "%s: ", rec->func);
+    for (const char *p = rec->fmt; *p != '\0'; p++) {
+        if (*p != '%') {
+            fputc(*p, out);
+            continue;
+        }
+        if (p[1] == '%') {
+            fputc('%', out);
+            p++;
+            continue;
+        }
+        size_t len = strcspn(p + 1, "diouxXcspeEfFgGaAn") + 2;
+        if (p[len - 1] == '\0') {
+            fputs(p, out);
+            break;
+        }
+        if (a < rec->count) {
+            format_arg(out, p + 1, len - 1, rec->kinds[a], rec->args[a], string[a]);
+            a++;
+        }
+        p += len - 1;
+    }
+    fputc('\n', out);
+}
+
+static void ring_flush(struct log_ring *r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    char strings[LOG_MAX_ARGS * LOG_STRING_MAX + 8];
+
+    while (tail != head) {
+        struct log_record rec;
+        ring_take(r, tail, &rec, sizeof(rec));
+        ring_take(r, tail + sizeof(rec), strings, rec.size - sizeof(rec));
+        format_record(stderr, &rec, strings);
+        tail += rec.size;
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+    unsigned long dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        fprintf(stderr, "log: %lu lines dropped\n", dropped);
+        log_lost += dropped;
+    }
+}
+
+// Write out every ring and free those whose threads have exited.
+void log_flush(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&rings_lock);
+    struct log_ring **link = &rings;
+    while (*link != NULL) {
+        struct log_ring *r = *link;
+        int dead = atomic_load_explicit(&r->dead, memory_order_acquire);
+        ring_flush(r);
+        if (dead) {
+            *link = r->next;
+            free(r->buf);
+            free(r);
+        } else {
+            link = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fflush(stderr);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void *log_writer(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&writer_lock);
+    while (!writer_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline);
+        pthread_mutex_unlock(&writer_lock);
+
+        log_flush();
+
+        pthread_mutex_lock(&writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+    return NULL;
+}
+
+int log_parse_level(const char *name)
+{
+    if (strcmp(name, "none") == 0) {
+        return LOG_LEVEL_NONE;
+    } else if (strcmp(name, "operations") == 0) {
+        return LOG_LEVEL_OPERATIONS;
+    } else if (strcmp(name, "debug") == 0) {
+        return LOG_LEVEL_DEBUG;
+    }
+    return -1;
+}
+
+// Like the other background threads the writer must be started after fuse
+// has daemonized.
+int log_start(void)
+{
+    if (log_level == LOG_LEVEL_NONE) {
+        return 0;
+    }
+
+    int err = pthread_create(&writer_thread, NULL, log_writer, NULL);
+    if (err != 0) {
+        return -err;
+    }
+    writer_running = 1;
+    return 0;
+}
+
+void log_stop(void)
+{
+    if (writer_running) {
+        pthread_mutex_lock(&writer_lock);
+        writer_stopping = 1;
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_lock);
+        pthread_join(writer_thread, NULL);
+        writer_running = 0;
+    }
+
+    log_flush();
+    if (log_lost > 0) {
+        fprintf(stderr, "log: %lu lines lost to full buffers\n", log_lost);
+    }
+}
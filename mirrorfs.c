@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 31
+#define FUSE_USE_VERSION 312
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -13,6 +13,7 @@
 
 #include <assert.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,48 +22,15 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stddef.h>
 #include <sys/time.h>
 
-#define QUOTE(str) #str
-#define EXPAND_AND_QUOTE(str) QUOTE(str)
-
-#define ABORT_IF_NOT_EQUAL(x, y) \
-    do { \
-        long _x = (x); \
-        long _y = (y); \
-        if (_x != _y) { \
-            fprintf(stderr, "%s: %s %ld != %ld\n", __func__, EXPAND_AND_QUOTE(x), _x, _y); \
-            if (abort_on_difference) { \
-                abort(); \
-            } \
-        } \
-    } while (0)
-
-#define ABORT_IF_INCONSISTENT_FD(fd1, fd2) \
-    do { \
-        if (((fd1) == -1) ^ ((fd2) == -1)) { \
-            fprintf(stderr, "%s: %d != %d\n", __func__, (fd1), (fd2)); \
-            abort(); \
-        } \
-    } while (0)
-
-#define LOG_FUSE_OPERATION(fmt, ...) \
-    do { \
-        if (log_operations) { \
-            fprintf(stderr, "%s: " fmt "\n", __func__, ##__VA_ARGS__); \
-        } \
-    } while (0)
-
-// TODO: add flags to configure these
-static int abort_on_difference = 1;
-static int log_operations = 1;
-
-#define MAX_MNTPATHS 10  // Maximum number of mount paths
+#include "mirrorfs.h"
 
 static const char *mntpaths[MAX_MNTPATHS] = {NULL};
-static int mntfds[MAX_MNTPATHS] = {-1};
-static int mntpath_count = 0;
-static int mirror_fds[1024];  // TODO: hardcoded limit
+int mntfds[MAX_MNTPATHS] = {-1};
+int mntpath_count = 0;
+struct mirrorfs_options options;
 
 // FUSE delivers paths with a leading slash.  Remove them when possible and
 // return dot otherwise.
@@ -74,148 +42,141 @@ static const char *safe_path(const char *path)
     return path + 1;
 }
 
+// Every request pays for the fan-out and, for reads, the comparison, so ask
+// for large ones.  libfuse derives max_pages from max_write, and the kernel
+// caps both by its own limit (1 MiB by default) and readahead by what it
+// offered; reads grow with max_pages unless -o max_read caps them.
+void mirrorfs_conn_init(struct fuse_conn_info *conn)
+{
+    if (options.max_write > 0) {
+        conn->max_write = options.max_write;
+    }
+    if (options.max_readahead > 0 && options.max_readahead < conn->max_readahead) {
+        conn->max_readahead = options.max_readahead;
+    }
+    conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+
+    // Replica read buffers come from per-thread arenas sized for the largest
+    // read the kernel may send.
+    size_t max_read = conn->max_write;
+    if (conn->max_read > 0 && conn->max_read < max_read) {
+        max_read = conn->max_read;
+    }
+    bufpool_init(max_read);
+
+    // Have write data delivered in a pipe so write_buf can splice it, and
+    // let unverified reads be spliced to the kernel.
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE);
+}
+
 static void *mirrorfs_init(struct fuse_conn_info *conn,
                            struct fuse_config *cfg)
 {
     cfg->use_ino = 1;
 
-    /* Pick up changes from lower filesystem right away. This is
-       also necessary for better hardlink support. When the kernel
-       calls the unlink() handler, it does not know the inode of
-       the to-be-removed entry and can therefore not invalidate
+    /* By default pick up changes from lower filesystem right away.
+       This is also necessary for better hardlink support. When the
+       kernel calls the unlink() handler, it does not know the inode
+       of the to-be-removed entry and can therefore not invalidate
        the cache of the associated inode - resulting in an
        incorrect st_nlink value being reported for any remaining
-       hardlinks to this inode. */
-    cfg->entry_timeout = 0;
-    cfg->attr_timeout = 0;
-    cfg->negative_timeout = 0;
+       hardlinks to this inode.  Read-mostly trees can trade that
+       for fewer verified round trips through the timeout options. */
+    cfg->entry_timeout = options.entry_timeout;
+    cfg->attr_timeout = options.attr_timeout;
+    cfg->negative_timeout = options.negative_timeout;
+    // keep_cache is decided per open; see open_keep_cache().
+    cfg->kernel_cache = 0;
+    if (options.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+
+    mirrorfs_conn_init(conn);
+
+    int res = log_start();
+    if (res != 0) {
+        fprintf(stderr, "Could not start logging: %s\n", strerror(-res));
+        log_level = LOG_LEVEL_NONE;
+    }
+    res = fanout_start();
+    if (res != 0) {
+        fprintf(stderr, "Could not start fan-out workers, running serially: %s\n",
+                strerror(-res));
+    }
+    res = journal_start();
+    if (res != 0) {
+        fprintf(stderr, "Could not start the journal: %s\n", strerror(-res));
+    }
+    res = shadow_start();
+    if (res != 0) {
+        fprintf(stderr, "Could not start shadow replicas, verifying synchronously: %s\n",
+                strerror(-res));
+    }
+    res = inval_start(fuse_get_context()->fuse);
+    if (res != 0) {
+        fprintf(stderr, "Could not start cache invalidation: %s\n", strerror(-res));
+    }
 
     return NULL;
 }
 
+static void mirrorfs_destroy(void *private_data)
+{
+    inval_stop();
+    shadow_stop();
+    fanout_stop();
+    bufpool_report(stderr);
+    sample_report(stderr);
+    coalesce_report(stderr);
+    sync_report(stderr);
+    xattr_report(stderr);
+    shadow_report(stderr);
+    journal_stop();
+    log_stop();
+}
+
 static int mirrorfs_getattr(const char *path, struct stat *stbuf,
                             struct fuse_file_info *fi)
 {
     LOG_FUSE_OPERATION("%s", path);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-    struct stat stbufs[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        memset(&stbufs[i], 0, sizeof(struct stat));
-        errno = 0;
-        res[i] = fstatat(mntfds[i], safe_path(path), &stbufs[i], AT_SYMLINK_NOFOLLOW);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    // Compare stat structs
-    for (int i = 1; i < mntpath_count; i++) {
-        if (memcmp(&stbufs[0], &stbufs[i], sizeof(struct stat)) != 0) {
-            ABORT_IF_NOT_EQUAL(stbufs[0].st_mode, stbufs[i].st_mode);
-            ABORT_IF_NOT_EQUAL(stbufs[0].st_nlink, stbufs[i].st_nlink);
-            ABORT_IF_NOT_EQUAL(stbufs[0].st_uid, stbufs[i].st_uid);
-            ABORT_IF_NOT_EQUAL(stbufs[0].st_gid, stbufs[i].st_gid);
-            if(!S_ISDIR(stbufs[0].st_mode)){
-                ABORT_IF_NOT_EQUAL(stbufs[0].st_size, stbufs[i].st_size);
-            }
-            // TODO: compare other fields?
-            // TODO: compare st_ino?
-            // TODO: compare st_dev?
-            // TODO: compare st_rdev?
-            // TODO: compare st_blksize?
-            // TODO: compare st_blocks?
-            // TODO: compare st_atime?
-            // TODO: compare st_mtime?
-            // TODO: compare st_ctime?
-        }
+    // fstat() and lseek(SEEK_END) must see writes still in the buffer, or
+    // the kernel shrinks the file back to the mirrors' size.
+    if (fi != NULL) {
+        coalesce_writeout(handle_get(fi->fh));
     }
-
-    // Copy the result to the output buffer
-    memcpy(stbuf, &stbufs[0], sizeof(struct stat));
-
-    return 0;
+    return mirror_getattr(mntfds, safe_path(path), stbuf);
 }
 
 static int mirrorfs_access(const char *path, int mask)
 {
     LOG_FUSE_OPERATION("%s 0x%x", path, mask);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = faccessat(mntfds[i], safe_path(path), mask, 0);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return mirror_access(mntfds, safe_path(path), mask);
 }
 
 static int mirrorfs_readlink(const char *path, char *buf, size_t size)
 {
     LOG_FUSE_OPERATION("%s %zu", path, size);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-    char *bufs[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        bufs[i] = malloc(size);
-        errno = 0;
-        res[i] = readlinkat(mntfds[i], safe_path(path), bufs[i], size - 1);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-        if (res[0] != -1 && memcmp(bufs[0], bufs[i], res[0]) != 0) {
-            abort();
-        }
-    }
-
-    if (res[0] == -1) {
-        for (int i = 0; i < mntpath_count; i++) {
-            free(bufs[i]);
-        }
-        return -errnos[0];
-    }
+    return mirror_readlink(mntfds, safe_path(path), buf, size);
+}
 
-    memcpy(buf, bufs[0], res[0]);
-    buf[res[0]] = '\0';
+static int mirrorfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%s", path);
 
-    for (int i = 0; i < mntpath_count; i++) {
-        free(bufs[i]);
+    struct mirror_dir *d;
+    int res = mirror_opendir(mntfds, safe_path(path), &d);
+    if (res != 0) {
+        return res;
     }
 
+    fi->fh = (uintptr_t)d;
     return 0;
 }
 
-// TODO: incomplete; compare against dir2fd.  how to handle different directory
-// orders?
 static int mirrorfs_readdir(const char *path, void *buf,
                             fuse_fill_dir_t filler, off_t offset,
                             struct fuse_file_info *fi,
@@ -223,50 +184,41 @@ static int mirrorfs_readdir(const char *path, void *buf,
 {
     LOG_FUSE_OPERATION("%s %ld 0x%x", path, offset, flags);
 
-    struct dirent *de;
-    DIR *dps[MAX_MNTPATHS];
-    int dirfds[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        dirfds[i] = openat(mntfds[i], safe_path(path), O_DIRECTORY);
-        if (dirfds[i] == -1) {
-            for (int j = 0; j < i; j++) {
-                close(dirfds[j]);
-            }
-            return -errno;
-        }
-        dps[i] = fdopendir(dirfds[i]);
-        if (dps[i] == NULL) {
-            for (int j = 0; j <= i; j++) {
-                close(dirfds[j]);
-            }
-            return -errno;
-        }
+    struct mirror_dir *d = (struct mirror_dir *)(uintptr_t)fi->fh;
+    int res = mirror_dir_seek(d, offset);
+    if (res != 0) {
+        return res;
     }
 
-    while ((de = readdir(dps[0])) != NULL) {
+    for (size_t i = offset; i < d->count; i++) {
+        const struct mirror_dirent *de = &d->entries[i];
+        const char *name = d->names + de->name;
+        enum fuse_fill_dir_flags fill = 0;
         struct stat st;
-        memset(&st, 0, sizeof(st));
-        st.st_ino = de->d_ino;
-        st.st_mode = de->d_type << 12;
-        if (filler(buf, de->d_name, &st, 0, 0)) {
-            break;
+
+        // With readdirplus the kernel caches the attributes instead of
+        // asking for each entry in turn.  Entries that vanished since
+        // opendir are still listed, just without them.
+        if ((flags & FUSE_READDIR_PLUS) && strcmp(name, ".") != 0 &&
+            strcmp(name, "..") != 0 && mirror_getattr(d->fds, name, &st) == 0) {
+            fill = FUSE_FILL_DIR_PLUS;
+        } else {
+            memset(&st, 0, sizeof(st));
+            st.st_ino = de->ino;
+            st.st_mode = de->type << 12;
         }
-        
-        // Check if the same entry exists in all directories
-        for (int i = 1; i < mntpath_count; i++) {
-            struct dirent *de_i = readdir(dps[i]);
-            if (de_i == NULL || strcmp(de->d_name, de_i->d_name) != 0) {
-                fprintf(stderr, "Inconsistent directory entry: %s\n", de->d_name);
-                abort();
-            }
+        if (filler(buf, name, &st, i + 1, fill)) {
+            break;
         }
     }
+    return 0;
+}
 
-    for (int i = 0; i < mntpath_count; i++) {
-        closedir(dps[i]);
-        close(dirfds[i]);
-    }
+static int mirrorfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%s", path);
+
+    mirror_releasedir((struct mirror_dir *)(uintptr_t)fi->fh);
     return 0;
 }
 
@@ -274,104 +226,28 @@ static int mirrorfs_mkdir(const char *path, mode_t mode)
 {
     LOG_FUSE_OPERATION("%s 0x%x", path, mode);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = mkdirat(mntfds[i], safe_path(path), mode);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return mirror_mkdir(mntfds, safe_path(path), mode);
 }
 
 static int mirrorfs_unlink(const char *path)
 {
     LOG_FUSE_OPERATION("%s", path);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = unlinkat(mntfds[i], safe_path(path), 0);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return mirror_unlink(mntfds, safe_path(path));
 }
 
 static int mirrorfs_rmdir(const char *path)
 {
     LOG_FUSE_OPERATION("%s", path);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = unlinkat(mntfds[i], safe_path(path), AT_REMOVEDIR);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return mirror_rmdir(mntfds, safe_path(path));
 }
 
 static int mirrorfs_symlink(const char *from, const char *to)
 {
     LOG_FUSE_OPERATION("%s %s", from, to);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = symlinkat(from, mntfds[i], safe_path(to));
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return mirror_symlink(from, mntfds, safe_path(to));
 }
 
 static int mirrorfs_rename(const char *from, const char *to,
@@ -383,52 +259,21 @@ static int mirrorfs_rename(const char *from, const char *to,
         return -EINVAL;
     }
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = renameat(mntfds[i], safe_path(from), mntfds[i], safe_path(to));
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return mirror_rename(mntfds, safe_path(from), mntfds, safe_path(to));
 }
 
 static int mirrorfs_link(const char *from, const char *to)
 {
     LOG_FUSE_OPERATION("%s %s", from, to);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = linkat(mntfds[i], safe_path(from), mntfds[i], safe_path(to), 0);
-        errnos[i] = errno;
-    }
+    int res = mirror_link(mntfds, safe_path(from), mntfds, safe_path(to));
 
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
+    // The new name gets its own node, so the one for from still holds the
+    // old link count.
+    if (res == 0) {
+        inval_path(from);
     }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return res;
 }
 
 static int mirrorfs_chmod(const char *path, mode_t mode,
@@ -436,26 +281,7 @@ static int mirrorfs_chmod(const char *path, mode_t mode,
 {
     LOG_FUSE_OPERATION("%s 0x%x", path, mode);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = fchmodat(mntfds[i], safe_path(path), mode, 0);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return mirror_chmod(mntfds, safe_path(path), mode);
 }
 
 static int mirrorfs_chown(const char *path, uid_t uid, gid_t gid,
@@ -463,45 +289,21 @@ static int mirrorfs_chown(const char *path, uid_t uid, gid_t gid,
 {
     LOG_FUSE_OPERATION("%s %d %d", path, uid, gid);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = fchownat(mntfds[i], safe_path(path), uid, gid, 0);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
-
-    return 0;
+    return mirror_chown(mntfds, safe_path(path), uid, gid);
 }
 
-// TODO: not implemented: call open and ftruncate whe fi is NULL?
-// TODO: not implemented: call open and ftruncate when fi is NULL?
 static int mirrorfs_truncate(const char *path, off_t size,
                              struct fuse_file_info *fi)
 {
-    int res;
+    LOG_FUSE_OPERATION("%s %lld", path, (long long)size);
 
     if (fi != NULL) {
-        res = ftruncate(fi->fh, size);
-    } else {
-        res = truncate(path, size);
-    }
-    if (res == -1) {
-        return -errno;
+        struct mirror_handle *h = handle_get(fi->fh);
+        coalesce_writeout(h);
+        return mirror_ftruncate(h->fds, size);
     }
 
-    return 0;
+    return mirror_truncate(mntfds, safe_path(path), size);
 }
 
 static int mirrorfs_utimens(const char *path, const struct timespec ts[2],
@@ -509,26 +311,19 @@ static int mirrorfs_utimens(const char *path, const struct timespec ts[2],
 {
     LOG_FUSE_OPERATION("%s", path);
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = utimensat(mntfds[i], safe_path(path), ts, AT_SYMLINK_NOFOLLOW);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
+    return mirror_utimens(mntfds, safe_path(path), ts);
+}
 
-    if (res[0] == -1) {
-        return -errnos[0];
-    }
+// Every name of a file has a node of its own here, and only link() has the
+// other names invalidated, so pages cached through one name could outlive
+// writes through another.  Files with more than one link are not kept
+// cached.
+static void open_keep_cache(struct fuse_file_info *fi)
+{
+    struct stat st;
 
-    return 0;
+    fi->keep_cache = options.keep_cache &&
+                     fstat(handle_get(fi->fh)->fds[0], &st) == 0 && st.st_nlink == 1;
 }
 
 static int mirrorfs_create(const char *path, mode_t mode,
@@ -536,68 +331,22 @@ static int mirrorfs_create(const char *path, mode_t mode,
 {
     LOG_FUSE_OPERATION("%s %o 0x%x", path, mode, fi->flags);
 
-    int fds[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        fds[i] = openat(mntfds[i], safe_path(path), fi->flags, mode);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_INCONSISTENT_FD(fds[0], fds[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (fds[0] == -1) {
-        return -errnos[0];
+    int res = mirror_open(mntfds, safe_path(path), fi->flags, mode, &fi->fh);
+    if (res == 0) {
+        open_keep_cache(fi);
     }
-
-    fi->fh = fds[0];
-    for (int i = 1; i < mntpath_count; i++) {
-        assert(mirror_fds[fi->fh * (MAX_MNTPATHS - 1) + i - 1] == -1);
-        mirror_fds[fi->fh * (MAX_MNTPATHS - 1) + i - 1] = fds[i];
-    }
-    return 0;
+    return res;
 }
 
 static int mirrorfs_open(const char *path, struct fuse_file_info *fi)
 {
     LOG_FUSE_OPERATION("%s", path);
 
-    int fds[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
-
-    for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        fds[i] = openat(mntfds[i], safe_path(path), fi->flags);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_INCONSISTENT_FD(fds[0], fds[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
-
-    if (fds[0] == -1) {
-        return -errnos[0];
+    int res = mirror_open(mntfds, safe_path(path), fi->flags, 0, &fi->fh);
+    if (res == 0) {
+        open_keep_cache(fi);
     }
-
-    fi->fh = fds[0];
-    for (int i = 1; i < mntpath_count; i++) {
-        if (fi->fh * (MAX_MNTPATHS - 1) + i - 1 >= 1024) {
-            LOG_FUSE_OPERATION("Error: file descriptor index out of bounds");
-            for (int j = 0; j < mntpath_count; j++) {
-                close(fds[j]);
-            }
-            return -EMFILE;
-        }
-        mirror_fds[fi->fh * (MAX_MNTPATHS - 1) + i - 1] = fds[i];
-    }
-    return 0;
+    return res;
 }
 
 static int mirrorfs_read(const char *path, char *buf, size_t size,
@@ -605,131 +354,158 @@ static int mirrorfs_read(const char *path, char *buf, size_t size,
 {
     LOG_FUSE_OPERATION("%s %zu %ld %p", path, size, offset, fi);
 
-    int fds[MAX_MNTPATHS];
+    int tmpfds[MAX_MNTPATHS];
 
-    if (fi == NULL) {
-        for (int i = 0; i < mntpath_count; i++) {
-            fds[i] = openat(mntfds[i], safe_path(path), O_RDONLY);
-            if (fds[i] == -1) {
-                for (int j = 0; j < i; j++) {
-                    close(fds[j]);
-                }
-                return -errno;
+    if (fi != NULL) {
+        struct mirror_handle *h = handle_get(fi->fh);
+        coalesce_read(h, size, offset);
+        return mirror_read(h->fds, buf, size, offset);
+    }
+
+    for (int i = 0; i < mntpath_count; i++) {
+        tmpfds[i] = openat(mntfds[i], safe_path(path), O_RDONLY);
+        if (tmpfds[i] == -1) {
+            for (int j = 0; j < i; j++) {
+                close(tmpfds[j]);
             }
-        }
-    } else {
-        fds[0] = fi->fh;
-        for (int i = 1; i < mntpath_count; i++) {
-            fds[i] = mirror_fds[fi->fh * (MAX_MNTPATHS - 1) + i - 1];
+            return -errno;
         }
     }
 
-    char *bufs[MAX_MNTPATHS];
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
+    int result = mirror_read(tmpfds, buf, size, offset);
 
+    // Queued replicas may still read through the temporary descriptors.
+    shadow_drain();
     for (int i = 0; i < mntpath_count; i++) {
-        bufs[i] = (i == 0) ? buf : malloc(size);
-        errno = 0;
-        res[i] = pread(fds[i], bufs[i], size, offset);
-        errnos[i] = errno;
-    }
-
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-        if (res[0] != -1 && memcmp(bufs[0], bufs[i], res[0]) != 0) {
-            abort();
-        }
+        close(tmpfds[i]);
     }
 
-    int result = (res[0] == -1) ? -errnos[0] : res[0];
+    return result;
+}
+
+static int mirrorfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                             size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%s %zu %ld %p", path, size, offset, fi);
 
-    for (int i = 1; i < mntpath_count; i++) {
-        free(bufs[i]);
+    struct fuse_bufvec *bv = malloc(sizeof(*bv));
+    if (bv == NULL) {
+        return -ENOMEM;
     }
+    *bv = FUSE_BUFVEC_INIT(size);
 
-    if (fi == NULL) {
-        for (int i = 0; i < mntpath_count; i++) {
-            close(fds[i]);
-        }
+    // Reads that sampling skips are spliced straight from the primary.
+    if (fi != NULL && !sample_read(handle_get(fi->fh), size)) {
+        coalesce_read(handle_get(fi->fh), size, offset);
+        bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bv->buf[0].fd = handle_get(fi->fh)->fds[0];
+        bv->buf[0].pos = offset;
+        *bufp = bv;
+        return 0;
     }
 
-    return result;
+    char *mem = malloc(size);
+    if (mem == NULL) {
+        free(bv);
+        return -ENOMEM;
+    }
+    int res = mirrorfs_read(path, mem, size, offset, fi);
+    if (res < 0) {
+        free(mem);
+        free(bv);
+        return res;
+    }
+    bv->buf[0].mem = mem;
+    bv->buf[0].size = res;
+    *bufp = bv;
+    return 0;
 }
 
 static int mirrorfs_write(const char *path, const char *buf, size_t size,
                           off_t offset, struct fuse_file_info *fi)
 {
-    LOG_FUSE_OPERATION("%s %lu %ld", path, size, offset);
+    LOG_FUSE_OPERATION("%s %zu %ld", path, size, offset);
 
-    int fds[MAX_MNTPATHS];
+    int tmpfds[MAX_MNTPATHS];
 
-    LOG_FUSE_OPERATION("%s %zu %ld", path, size, offset);
+    if (fi != NULL) {
+        LOG_FUSE_DEBUG("fi is not NULL, using existing file handles %s", path);
+        struct mirror_handle *h = handle_get(fi->fh);
+        int result = h->wb != NULL ? coalesce_write(h, buf, size, offset) :
+                                     mirror_write(h->fds, buf, size, offset);
+        LOG_FUSE_DEBUG("returning %d", result);
+        return result;
+    }
 
-    if (fi == NULL) {
-        LOG_FUSE_OPERATION("fi is NULL, opening files %s", path);
-        for (int i = 0; i < mntpath_count; i++) {
-            fds[i] = openat(mntfds[i], safe_path(path), O_WRONLY);
-            if (fds[i] == -1) {
-                LOG_FUSE_OPERATION("Failed to open file %d: %s", i, strerror(errno));
-                for (int j = 0; j < i; j++) {
-                    close(fds[j]);
-                }
-                return -errno;
+    LOG_FUSE_DEBUG("fi is NULL, opening files %s", path);
+    for (int i = 0; i < mntpath_count; i++) {
+        tmpfds[i] = openat(mntfds[i], safe_path(path), O_WRONLY);
+        if (tmpfds[i] == -1) {
+            LOG_FUSE_DEBUG("Failed to open file %d: %s", i, strerror(errno));
+            for (int j = 0; j < i; j++) {
+                close(tmpfds[j]);
             }
-        }
-    } else {
-        LOG_FUSE_OPERATION("fi is not NULL, using existing file handles %s", path);
-        fds[0] = fi->fh;
-        for (int i = 1; i < mntpath_count; i++) {
-            fds[i] = mirror_fds[fi->fh * (MAX_MNTPATHS - 1) + i - 1];
+            return -errno;
         }
     }
 
-    int res[MAX_MNTPATHS];
-    int errnos[MAX_MNTPATHS];
+    int result = mirror_write(tmpfds, buf, size, offset);
 
+    shadow_drain();
     for (int i = 0; i < mntpath_count; i++) {
-        errno = 0;
-        res[i] = pwrite(fds[i], buf, size, offset);
-        errnos[i] = errno;
-        LOG_FUSE_OPERATION("pwrite to file %d returned %d, errno=%d", i, res[i], errnos[i]);
+        close(tmpfds[i]);
     }
 
-    // Compare results
-    for (int i = 1; i < mntpath_count; i++) {
-        ABORT_IF_NOT_EQUAL(res[0], res[i]);
-        ABORT_IF_NOT_EQUAL(errnos[0], errnos[i]);
-    }
+    LOG_FUSE_DEBUG("returning %d", result);
+    return result;
+}
 
-    int result = (res[0] == -1) ? -errnos[0] : res[0];
+static int mirrorfs_write_buf(const char *path, struct fuse_bufvec *buf,
+                              off_t offset, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%s %zu %ld", path, fuse_buf_size(buf), offset);
 
-    if (fi == NULL) {
-        for (int i = 0; i < mntpath_count; i++) {
-            close(fds[i]);
+    if (fi != NULL) {
+        struct mirror_handle *h = handle_get(fi->fh);
+        if (h->wb != NULL) {
+            return coalesce_write_buf(h, buf, offset);
         }
+        return mirror_write_buf(h->fds, buf, offset);
     }
 
-    LOG_FUSE_OPERATION("returning %d", result);
-    return result;
+    // Without a handle fall back to write(), which opens the file itself.
+    size_t size = fuse_buf_size(buf);
+    char *mem = malloc(size);
+    if (mem == NULL) {
+        return -ENOMEM;
+    }
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = mem;
+    ssize_t res = fuse_buf_copy(&dst, buf, 0);
+    if (res >= 0) {
+        res = mirrorfs_write(path, mem, res, offset, NULL);
+    }
+    free(mem);
+    return res;
+}
+
+// Called on every close of a descriptor, and the only chance to report an
+// error to close().
+static int mirrorfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%s", path);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    int res = coalesce_flush(h);
+    int flushed = mirror_flush(h->fds);
+    return res != 0 ? res : flushed;
 }
 
 static int mirrorfs_release(const char *path, struct fuse_file_info *fi)
 {
     LOG_FUSE_OPERATION("%s", path);
 
-    for (int i = 1; i < mntpath_count; i++) {
-        int index = fi->fh * (MAX_MNTPATHS - 1) + i - 1;
-        if (index < 1024 && mirror_fds[index] != -1) {
-            close(mirror_fds[index]);
-            mirror_fds[index] = -1;
-        }
-    }
-    // Must close fi->fh after mirror_fds since mirror_fds uses fi->fh as a key.
-    close(fi->fh);
-    return 0;
+    return mirror_release(fi->fh);
 }
 
 static int mirrorfs_fsync(const char *path, int isdatasync,
@@ -737,15 +513,97 @@ static int mirrorfs_fsync(const char *path, int isdatasync,
 {
     LOG_FUSE_OPERATION("%s %d", path, isdatasync);
 
-    return 0;
+    if (fi == NULL) {
+        return 0;
+    }
+    struct mirror_handle *h = handle_get(fi->fh);
+    int res = coalesce_flush(h);
+    int synced = mirror_fsync(h->fds, isdatasync);
+    return res != 0 ? res : synced;
+}
+
+static int mirrorfs_fsyncdir(const char *path, int isdatasync,
+                             struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%s %d", path, isdatasync);
+
+    return mirror_fsyncdir((struct mirror_dir *)(uintptr_t)fi->fh, isdatasync);
+}
+
+static int mirrorfs_fallocate(const char *path, int mode, off_t offset,
+                              off_t length, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%s 0x%x %lld %lld", path, mode, (long long)offset, (long long)length);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    coalesce_writeout(h);
+    return mirror_fallocate(h->fds, mode, offset, length);
+}
+
+static ssize_t mirrorfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                                        off_t offset_in, const char *path_out,
+                                        struct fuse_file_info *fi_out, off_t offset_out,
+                                        size_t size, int flags)
+{
+    LOG_FUSE_OPERATION("%s %lld %s %lld %zu", path_in, (long long)offset_in,
+                       path_out, (long long)offset_out, size);
+
+    struct mirror_handle *in = handle_get(fi_in->fh);
+    struct mirror_handle *out = handle_get(fi_out->fh);
+    coalesce_writeout(in);
+    coalesce_writeout(out);
+    return mirror_copy_file_range(in->fds, offset_in, out->fds, offset_out, size, flags);
+}
+
+static off_t mirrorfs_lseek(const char *path, off_t off, int whence,
+                            struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%s %lld %d", path, (long long)off, whence);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    coalesce_writeout(h);
+    return mirror_lseek(h->fds, off, whence);
+}
+
+static int mirrorfs_setxattr(const char *path, const char *name, const char *value,
+                             size_t size, int flags)
+{
+    LOG_FUSE_OPERATION("%s %s %zu 0x%x", path, name, size, flags);
+
+    return mirror_setxattr(mntfds, safe_path(path), name, value, size, flags);
+}
+
+static int mirrorfs_getxattr(const char *path, const char *name, char *value,
+                             size_t size)
+{
+    LOG_FUSE_OPERATION("%s %s %zu", path, name, size);
+
+    return mirror_getxattr(mntfds, safe_path(path), name, value, size);
+}
+
+static int mirrorfs_listxattr(const char *path, char *list, size_t size)
+{
+    LOG_FUSE_OPERATION("%s %zu", path, size);
+
+    return mirror_listxattr(mntfds, safe_path(path), list, size);
+}
+
+static int mirrorfs_removexattr(const char *path, const char *name)
+{
+    LOG_FUSE_OPERATION("%s %s", path, name);
+
+    return mirror_removexattr(mntfds, safe_path(path), name);
 }
 
 static const struct fuse_operations mirrorfs_oper = {
     .init = mirrorfs_init,
+    .destroy = mirrorfs_destroy,
     .getattr = mirrorfs_getattr,
     .access = mirrorfs_access,
     .readlink = mirrorfs_readlink,
+    .opendir = mirrorfs_opendir,
     .readdir = mirrorfs_readdir,
+    .releasedir = mirrorfs_releasedir,
     .mkdir = mirrorfs_mkdir,
     .symlink = mirrorfs_symlink,
     .unlink = mirrorfs_unlink,
@@ -754,14 +612,25 @@ static const struct fuse_operations mirrorfs_oper = {
     .link = mirrorfs_link,
     .chmod = mirrorfs_chmod,
     .chown = mirrorfs_chown,
-    //.truncate = mirrorfs_truncate,
+    .truncate = mirrorfs_truncate,
     .utimens = mirrorfs_utimens,
     .open = mirrorfs_open,
     .create = mirrorfs_create,
     .read = mirrorfs_read,
+    .read_buf = mirrorfs_read_buf,
     .write = mirrorfs_write,
+    .write_buf = mirrorfs_write_buf,
     .release = mirrorfs_release,
+    .flush = mirrorfs_flush,
     .fsync = mirrorfs_fsync,
+    .fsyncdir = mirrorfs_fsyncdir,
+    .fallocate = mirrorfs_fallocate,
+    .copy_file_range = mirrorfs_copy_file_range,
+    .lseek = mirrorfs_lseek,
+    .setxattr = mirrorfs_setxattr,
+    .getxattr = mirrorfs_getxattr,
+    .listxattr = mirrorfs_listxattr,
+    .removexattr = mirrorfs_removexattr,
 };
 
 static void show_help(const char *progname);
@@ -775,6 +644,8 @@ static int mirrorfs_opt_proc(void *data, const char *arg, int key,
     switch (key) {
         case 'h':
             show_help(outargs->argv[0]);
+            fuse_cmdline_help();
+            fuse_lib_help(outargs);
             fuse_opt_free_args(outargs);
             exit(0);
         case FUSE_OPT_KEY_NONOPT:
@@ -787,7 +658,37 @@ static int mirrorfs_opt_proc(void *data, const char *arg, int key,
     return 1;
 }
 
+#define MIRRORFS_OPT(t, p, v) { t, offsetof(struct mirrorfs_options, p), v }
+
 static struct fuse_opt mirrorfs_opts[] = {
+    MIRRORFS_OPT("serial", serial, 1),
+    MIRRORFS_OPT("fanout_threads=%u", fanout_threads, 0),
+    MIRRORFS_OPT("uring", uring, 1),
+    MIRRORFS_OPT("lowlevel", lowlevel, 1),
+    MIRRORFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    MIRRORFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    MIRRORFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    MIRRORFS_OPT("keep_cache", keep_cache, 1),
+    MIRRORFS_OPT("writeback_cache", writeback_cache, 1),
+    MIRRORFS_OPT("verify_probability=%lf", verify_probability, 0),
+    MIRRORFS_OPT("verify_every=%u", verify_every, 0),
+    MIRRORFS_OPT("verify_bytes=%lu", verify_bytes, 0),
+    MIRRORFS_OPT("async", async, 1),
+    MIRRORFS_OPT("async_depth=%u", async_depth, 0),
+    MIRRORFS_OPT("quorum", quorum, -1),
+    MIRRORFS_OPT("quorum=%d", quorum, 0),
+    MIRRORFS_OPT("journal=%s", journal, 0),
+    MIRRORFS_OPT("on_divergence=%s", on_divergence, 0),
+    MIRRORFS_OPT("trace=%s", trace, 0),
+    MIRRORFS_OPT("log_level=%s", log_level, 0),
+    MIRRORFS_OPT("write_coalesce", write_coalesce, 128 * 1024),
+    MIRRORFS_OPT("write_coalesce=%u", write_coalesce, 0),
+    MIRRORFS_OPT("fsync_window=%u", fsync_window, 0),
+    MIRRORFS_OPT("max_write=%u", max_write, 0),
+    MIRRORFS_OPT("max_readahead=%u", max_readahead, 0),
+    MIRRORFS_OPT("verify_stat=%s", verify_stat, 0),
+    MIRRORFS_OPT("stat_dont_sync", stat_dont_sync, 1),
+    MIRRORFS_OPT("no_xattr_cache", no_xattr_cache, 1),
     FUSE_OPT_KEY("-h", 'h'),
     FUSE_OPT_KEY("--help", 'h'),
     FUSE_OPT_END
@@ -795,31 +696,85 @@ static struct fuse_opt mirrorfs_opts[] = {
 
 static void show_help(const char *progname)
 {
-    printf("usage: %s <mntpath1> <mntpath2> [<mntpath3> ...] <mountpoint> [options]\n\n", progname);
+    printf("usage: %s <mntpath1> [<mntpath2> ...] <mountpoint> [options]\n\n", progname);
     printf("File-system specific options:\n"
-           "    <mntpathN>             Path to mirror (at least 2 required)\n"
+           "    <mntpathN>             Path to mirror (at least 1 required)\n"
            "    <mountpoint>           Where to mount the mirrored file system\n\n");
-    printf("general options:\n");
-    printf("    -o opt,[opt...]        mount options\n");
+    printf("mirrorfs options:\n");
+    printf("    -o serial              issue replica calls one at a time\n");
+    printf("    -o fanout_threads=N    replica worker threads (default: 4 per mirror)\n");
+    printf("    -o uring               batch replica calls through io_uring\n");
+    printf("    -o lowlevel            serve inodes backed by cached O_PATH descriptors\n");
+    printf("    -o entry_timeout=T     cache names for T seconds (default: 0)\n");
+    printf("    -o attr_timeout=T      cache attributes for T seconds (default: 0);\n"
+           "                           other names of a hard link may go stale\n");
+    printf("    -o negative_timeout=T  cache missing names for T seconds (default: 0)\n");
+    printf("    -o keep_cache          keep contents of files with one link cached across opens\n");
+    printf("    -o writeback_cache     let the kernel buffer writes\n");
+    printf("    -o verify_probability=P  compare reads with probability P\n");
+    printf("    -o verify_every=N      compare every Nth read\n");
+    printf("    -o verify_bytes=N      compare the first N bytes read per open file\n");
+    printf("    -o async               answer from the first mirror, verify the rest in the background\n");
+    printf("    -o async_depth=N       calls a mirror may fall behind by (default: 256)\n");
+    printf("    -o quorum[=K]          answer once K mirrors return the same data (default: a majority)\n");
+    printf("    -o journal=FILE        record operations and divergences in FILE\n");
+    printf("    -o on_divergence=P     abort, log or eio (default: abort)\n");
+    printf("    -o trace=FILE          record every request in FILE for mirrorfs_replay\n");
+    printf("    -o write_coalesce[=N]  buffer contiguous writes per handle, N bytes\n"
+           "                           at a time (default: 131072)\n");
+    printf("    -o fsync_window=USEC   wait USEC for more fsyncs of a file to merge\n");
+    printf("    -o max_write=N         largest write request, in bytes (default: 1048576)\n");
+    printf("    -o max_readahead=N     readahead, in bytes (default: the kernel's)\n");
+    printf("    -o verify_stat=F,...   attributes compared between mirrors, out of mode,\n"
+           "                           nlink, uid, gid, size, blocks, blksize, ino, dev,\n"
+           "                           rdev, atime, mtime, ctime and btime\n"
+           "                           (default: mode,nlink,uid,gid,size)\n");
+    printf("    -o stat_dont_sync      let mirrors other than the first answer stats\n"
+           "                           from their caches\n");
+    printf("    -o no_xattr_cache      ask every mirror for capabilities and ACLs\n"
+           "                           even where none were found before\n");
+    printf("    -o log_level=L         none, operations or debug (default: operations\n"
+           "                           in the foreground, none otherwise)\n");
     printf("    -h   --help            print help\n");
 }
 
 int main(int argc, char *argv[])
 {
-    memset(mirror_fds, -1, sizeof(mirror_fds));
     umask(0);
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_loop_config *config;
+    struct fuse *fuse;
+    int res;
 
-    int res = fuse_opt_parse(&args, NULL, mirrorfs_opts, mirrorfs_opt_proc);
-
-    fuse_opt_free_args(&args);
+    options.max_write = 1024 * 1024;
 
-    if (res != 0 || mntpath_count < 3) {
+    // Mirrored paths are consumed here; everything else, including -f, -d,
+    // -s and libfuse's -o options, is handed on to libfuse.
+    if (fuse_opt_parse(&args, &options, mirrorfs_opts, mirrorfs_opt_proc) != 0 ||
+        mntpath_count < 2) {
         show_help(argv[0]);
+        fuse_opt_free_args(&args);
         return 1;
     }
-    
+
+    if (options.on_divergence == NULL || strcmp(options.on_divergence, "abort") == 0) {
+        divergence_policy = DIVERGENCE_ABORT;
+    } else if (strcmp(options.on_divergence, "log") == 0) {
+        divergence_policy = DIVERGENCE_LOG;
+    } else if (strcmp(options.on_divergence, "eio") == 0) {
+        divergence_policy = DIVERGENCE_EIO;
+    } else {
+        fprintf(stderr, "Unknown on_divergence policy: %s\n", options.on_divergence);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    if (stat_compare_init(options.verify_stat) != 0) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
     // The last path is the mount point, so we don't open it
     for (int i = 0; i < mntpath_count - 1; i++) {
         mntfds[i] = open(mntpaths[i], O_DIRECTORY);
@@ -828,15 +783,104 @@ int main(int argc, char *argv[])
             return 1;
         }
     }
-    
+
     // Adjust mntpath_count to exclude the mount point
     mntpath_count--;
-    
-    // Set up FUSE arguments
-    char *fuse_argv[3];
-    fuse_argv[0] = argv[0];
-    fuse_argv[1] = (char *)mntpaths[mntpath_count];  // Mount point
-    fuse_argv[2] = NULL;
-    
-    return fuse_main(2, fuse_argv, &mirrorfs_oper, NULL);
+
+    if (options.journal != NULL && (res = journal_open(options.journal)) != 0) {
+        fprintf(stderr, "Could not open journal %s: %s\n", options.journal, strerror(-res));
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    if (options.trace != NULL && (res = trace_open_file(options.trace)) != 0) {
+        fprintf(stderr, "Could not open trace %s: %s\n", options.trace, strerror(-res));
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
+    if (fuse_opt_add_arg(&args, mntpaths[mntpath_count]) != 0 ||
+        fuse_parse_cmdline(&args, &opts) != 0) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    if (options.log_level == NULL) {
+        log_level = opts.foreground ? LOG_LEVEL_OPERATIONS : LOG_LEVEL_NONE;
+    } else if ((log_level = log_parse_level(options.log_level)) == -1) {
+        fprintf(stderr, "Unknown log level: %s\n", options.log_level);
+        res = 1;
+        goto out_free;
+    }
+    if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        res = 0;
+        goto out_free;
+    }
+
+    // Handlers only share the handle table, the fan-out queue and read-only
+    // configuration, so requests on different files run in parallel.
+    config = NULL;
+    if (!opts.singlethread) {
+        config = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+        fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+        fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+    }
+
+    res = 1;
+    // Cached inode descriptors are closed on forget, whatever is still
+    // queued against them.
+    if (options.lowlevel && (options.async || options.quorum)) {
+        fprintf(stderr, "-o async and -o quorum are not supported with -o lowlevel\n");
+        goto out_config;
+    }
+    if (options.lowlevel && options.trace != NULL) {
+        fprintf(stderr, "-o trace is not supported with -o lowlevel\n");
+        goto out_config;
+    }
+    if (options.lowlevel) {
+        res = mirrorfs_ll_main(&args, &opts, config);
+        goto out_config;
+    }
+
+    const struct fuse_operations *oper = statsfile_wrap(&mirrorfs_oper);
+    if (options.trace != NULL) {
+        oper = trace_wrap(oper);
+    }
+    fuse = fuse_new(&args, oper, sizeof(*oper), NULL);
+    if (fuse == NULL) {
+        goto out_config;
+    }
+    if (fuse_mount(fuse, opts.mountpoint) != 0) {
+        goto out_destroy;
+    }
+    if (fuse_daemonize(opts.foreground) != 0) {
+        goto out_unmount;
+    }
+    if (fuse_set_signal_handlers(fuse_get_session(fuse)) != 0) {
+        goto out_unmount;
+    }
+
+    if (config == NULL) {
+        res = fuse_loop(fuse);
+    } else {
+        res = fuse_loop_mt(fuse, config);
+    }
+    if (res != 0) {
+        res = 1;
+    }
+
+    fuse_remove_signal_handlers(fuse_get_session(fuse));
+out_unmount:
+    fuse_unmount(fuse);
+out_destroy:
+    fuse_destroy(fuse);
+out_config:
+    if (config != NULL) {
+        fuse_loop_cfg_destroy(config);
+    }
+out_free:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return res;
 }
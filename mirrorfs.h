@@ -0,0 +1,621 @@
+#ifndef MIRRORFS_H
+#define MIRRORFS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define MAX_MNTPATHS 10  // Maximum number of mount paths
+
+#define QUOTE(str) #str
+#define EXPAND_AND_QUOTE(str) QUOTE(str)
+
+// Consistency checks.  A failed check is printed, recorded in the journal
+// and then handled according to -o on_divergence; see journal.c.  i is the
+// index of the replica compared against the primary.
+
+#define CHECK_EQUAL(i, x, y) \
+    do { \
+        long _x = (x); \
+        long _y = (y); \
+        if (_x != _y) { \
+            fprintf(stderr, "%s: %s %ld != %ld\n", __func__, EXPAND_AND_QUOTE(y), _x, _y); \
+            struct divergence _d = { \
+                .replica = (i), .what = EXPAND_AND_QUOTE(y), \
+                .primary = _x, .value = _y, \
+            }; \
+            divergence(__func__, &_d); \
+        } \
+    } while (0)
+
+#define CHECK_CONSISTENT_FD(i, fd1, fd2) \
+    do { \
+        long _fd1 = (fd1); \
+        long _fd2 = (fd2); \
+        if ((_fd1 == -1) ^ (_fd2 == -1)) { \
+            fprintf(stderr, "%s: %ld != %ld\n", __func__, _fd1, _fd2); \
+            struct divergence _d = { \
+                .replica = (i), .what = "descriptor", \
+                .primary = _fd1, .value = _fd2, \
+            }; \
+            divergence(__func__, &_d); \
+        } \
+    } while (0)
+
+#define CHECK_BUFFERS(bufs, len, base) \
+    do { \
+        struct mismatch _m; \
+        uint64_t _start = monotonic_ns(); \
+        int _differ = compare_buffers((bufs), mntpath_count, (len), &_m); \
+        stats_compare((len), monotonic_ns() - _start); \
+        if (_differ) { \
+            report_mismatch(__func__, (bufs), (len), (base), &_m); \
+            struct divergence _d = { \
+                .replica = _m.replica, .what = "data", \
+                .primary = ((unsigned char *)(bufs)[0])[_m.offset], \
+                .value = ((unsigned char *)(bufs)[_m.replica])[_m.offset], \
+                .offset = (base) + _m.offset, .length = _m.length, \
+            }; \
+            divergence(__func__, &_d); \
+        } \
+    } while (0)
+
+// Operation logging, see log.c.  Arguments are recorded as raw values and
+// formatted later by a background thread, so the format is limited to
+// integers, characters, pointers and strings.  The unreachable call to
+// log_check_format keeps the compiler's format checking.
+
+enum log_level {
+    LOG_LEVEL_NONE,
+    LOG_LEVEL_OPERATIONS,     // one line per request
+    LOG_LEVEL_DEBUG,          // and the steps and replica results within
+};
+
+#define LOG_MAX_ARGS 6
+
+enum log_arg_kind {
+    LOG_ARG_VALUE,
+    LOG_ARG_STRING,
+};
+
+#define LOG_ARG_KIND(x) _Generic((x), char *: LOG_ARG_STRING, const char *: LOG_ARG_STRING, \
+                                 default: LOG_ARG_VALUE)
+#define LOG_ARG_VALUE(x) ((uint64_t)(x))
+
+#define LOG_NARGS(...) LOG_NARGS_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(a1, a2, a3, a4, a5, a6, n, ...) n
+#define LOG_MAP(m, ...) LOG_MAP_N(LOG_NARGS(__VA_ARGS__), m, __VA_ARGS__)
+#define LOG_MAP_N(n, m, ...) LOG_MAP_N_(n, m, __VA_ARGS__)
+#define LOG_MAP_N_(n, m, ...) LOG_MAP_##n(m, __VA_ARGS__)
+#define LOG_MAP_1(m, a) m(a)
+#define LOG_MAP_2(m, a, ...) m(a), LOG_MAP_1(m, __VA_ARGS__)
+#define LOG_MAP_3(m, a, ...) m(a), LOG_MAP_2(m, __VA_ARGS__)
+#define LOG_MAP_4(m, a, ...) m(a), LOG_MAP_3(m, __VA_ARGS__)
+#define LOG_MAP_5(m, a, ...) m(a), LOG_MAP_4(m, __VA_ARGS__)
+#define LOG_MAP_6(m, a, ...) m(a), LOG_MAP_5(m, __VA_ARGS__)
+
+#define LOG_AT(level, fmt, ...) \
+    do { \
+        if (log_level >= (level)) { \
+            const unsigned char _kinds[] = { LOG_MAP(LOG_ARG_KIND, __VA_ARGS__) }; \
+            const uint64_t _args[] = { LOG_MAP(LOG_ARG_VALUE, __VA_ARGS__) }; \
+            log_record(__func__, fmt, sizeof(_kinds), _kinds, _args); \
+        } \
+        if (0) { \
+            log_check_format(fmt, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_FUSE_OPERATION(fmt, ...) LOG_AT(LOG_LEVEL_OPERATIONS, fmt, __VA_ARGS__)
+#define LOG_FUSE_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, __VA_ARGS__)
+
+extern int log_level;
+
+static inline void __attribute__((format(printf, 1, 2))) log_check_format(const char *fmt, ...)
+{
+}
+
+void log_record(const char *func, const char *fmt, int count,
+                const unsigned char *kinds, const uint64_t *args);
+int log_parse_level(const char *name);
+int log_start(void);
+void log_flush(void);
+void log_stop(void);
+
+extern int mntfds[MAX_MNTPATHS];
+extern int mntpath_count;
+
+struct mirrorfs_options {
+    int serial;               // run replica calls one after another
+    unsigned fanout_threads;  // size of the fan-out worker pool
+    int uring;                // submit replica calls as one io_uring batch
+    int lowlevel;             // serve the inode-based low-level API
+    double entry_timeout;     // seconds the kernel may cache names
+    double attr_timeout;      // seconds the kernel may cache attributes
+    double negative_timeout;  // seconds the kernel may cache missing names
+    int keep_cache;           // keep the page cache across opens
+    int writeback_cache;      // let the kernel buffer writes
+    double verify_probability;  // verify reads with this probability
+    unsigned verify_every;      // verify every Nth read
+    unsigned long verify_bytes; // verify the first N bytes read per open file
+    int async;                // verify replicas in the background
+    unsigned async_depth;     // calls each replica may fall behind by
+    int quorum;               // replicas that must agree, -1 for a majority
+    char *journal;            // binary journal file
+    char *on_divergence;      // abort, log or eio
+    char *trace;              // request trace file
+    char *log_level;          // none, operations or debug
+    unsigned write_coalesce;  // per-handle write buffer size, 0 for none
+    unsigned fsync_window;    // microseconds a group sync waits for company
+    unsigned max_write;       // largest write request to ask the kernel for
+    unsigned max_readahead;   // readahead to ask for, 0 for the kernel's
+    char *verify_stat;        // attributes compared between replicas
+    int stat_dont_sync;       // replicas may answer stats from their caches
+    int no_xattr_cache;       // always ask every replica for security xattrs
+};
+
+extern struct mirrorfs_options options;
+
+// Request sizes and capabilities negotiated by both front ends.
+struct fuse_conn_info;
+void mirrorfs_conn_init(struct fuse_conn_info *conn);
+
+// Replica operations that can be fanned out by the executor.  Each one maps
+// to a single system call issued against every replica.
+enum mirror_op {
+    MIRROR_STATX,             // the primary also fetches STATX_BASIC_STATS
+    MIRROR_FACCESSAT,
+    MIRROR_READLINKAT,
+    MIRROR_MKDIRAT,
+    MIRROR_UNLINKAT,
+    MIRROR_SYMLINKAT,
+    MIRROR_RENAMEAT,
+    MIRROR_LINKAT,
+    MIRROR_FCHMODAT,
+    MIRROR_FCHOWNAT,
+    MIRROR_UTIMENSAT,
+    MIRROR_OPENAT,
+    MIRROR_PREAD,
+    MIRROR_PWRITE,
+    MIRROR_CLOSE,
+    MIRROR_GETDENTS,
+    MIRROR_SPLICE,
+    MIRROR_FSYNC,             // fdatasync when flags is nonzero
+    MIRROR_FLUSH,             // close a duplicate of the descriptor
+    MIRROR_TRUNCATE,          // open for writing and ftruncate
+    MIRROR_FTRUNCATE,
+    MIRROR_FALLOCATE,         // mode in flags
+    MIRROR_COPY_FILE_RANGE,   // from fds at offset to fds2 at offset2
+    MIRROR_LSEEK,             // whence in flags
+    MIRROR_GETXATTR,          // attribute name in path2
+    MIRROR_SETXATTR,          // value in wbuf
+    MIRROR_LISTXATTR,
+    MIRROR_REMOVEXATTR,
+    MIRROR_OP_COUNT,
+};
+
+// Arguments and per-replica results of one replica operation.  Path
+// operations resolve path relative to fds[i], or act on fds[i] itself, which
+// may be an O_PATH descriptor, when path is NULL.  Descriptor operations act
+// on fds[i] directly.
+struct mirror_call {
+    enum mirror_op op;
+    const int *fds;
+    const char *path;
+    const int *fds2;            // second directory for renameat/linkat
+    const char *path2;          // second path for renameat/linkat/symlinkat,
+                                // or the attribute name for xattr calls
+    int flags;
+    int flags2;                 // further flags for replicas other than the primary
+    unsigned mask;              // statx fields wanted
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    const struct timespec *ts;
+    size_t size;
+    off_t offset;
+    off_t offset2;              // destination offset for copy_file_range
+    const void *wbuf;           // source buffer shared by all replicas
+    const int *pipes;           // per-replica source pipes for splice
+    void *bufs[MAX_MNTPATHS];   // per-replica destination buffers
+    struct statx *stxs;         // per-replica statx results
+    int *newfds;                // where openat stores each replica's descriptor
+    uint64_t fh;                // handle the call belongs to, for completions
+
+    ssize_t res[MAX_MNTPATHS];
+    int errnos[MAX_MNTPATHS];
+    uint64_t nsecs[MAX_MNTPATHS];   // per-replica latency
+};
+
+// Issue call on every replica and wait until all of them have completed.
+void mirror_call_run(struct mirror_call *call);
+const char *mirror_op_name(enum mirror_op op);
+uint64_t monotonic_ns(void);
+
+// Issue call on replica i alone, in the calling thread.
+void mirror_call_exec(struct mirror_call *call, int i);
+
+// Submit call to all replicas through the calling thread's io_uring.  Returns
+// -ENOSYS when io_uring or the operation is not supported, in which case the
+// call has not been issued.
+int mirror_call_run_uring(struct mirror_call *call);
+
+// One replica's share of a call for the worker pool.  A worker runs call on
+// replica and then calls done(arg, replica); the task is not touched after.
+struct fanout_task {
+    struct mirror_call *call;
+    int replica;
+    void (*done)(void *arg, int replica);
+    void *arg;
+    struct fanout_task *next;
+};
+
+// Hand task to the worker pool.  Returns -ENOSYS, without queueing it, when
+// there is no pool.
+int fanout_queue(struct fanout_task *task);
+int fanout_start(void);
+void fanout_stop(void);
+
+// Request handlers timed for the stats file.
+enum stats_handler {
+    STATS_LOOKUP,
+    STATS_GETATTR,
+    STATS_SETATTR,
+    STATS_ACCESS,
+    STATS_READLINK,
+    STATS_OPENDIR,
+    STATS_READDIR,
+    STATS_RELEASEDIR,
+    STATS_MKDIR,
+    STATS_UNLINK,
+    STATS_RMDIR,
+    STATS_SYMLINK,
+    STATS_RENAME,
+    STATS_LINK,
+    STATS_CHMOD,
+    STATS_CHOWN,
+    STATS_TRUNCATE,
+    STATS_UTIMENS,
+    STATS_CREATE,
+    STATS_OPEN,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_FLUSH,
+    STATS_RELEASE,
+    STATS_FSYNC,
+    STATS_FSYNCDIR,
+    STATS_FALLOCATE,
+    STATS_COPY_FILE_RANGE,
+    STATS_LSEEK,
+    STATS_SETXATTR,
+    STATS_GETXATTR,
+    STATS_LISTXATTR,
+    STATS_REMOVEXATTR,
+    STATS_HANDLER_COUNT,
+};
+
+// Per-thread latency histograms and counters; see stats.c.
+void stats_handler(enum stats_handler handler, uint64_t nsecs);
+// Count replica i's part of call once it has completed.
+void stats_exec(const struct mirror_call *call, int i);
+// Count the slowest replica of a call that ran on every replica.
+void stats_call(const struct mirror_call *call);
+void stats_straggler(enum mirror_op op, int replica);
+void stats_compare(size_t len, uint64_t nsecs);
+void stats_report(FILE *f);
+
+// Checks a finished call's per-replica results.
+typedef void (*mirror_verify_fn)(struct mirror_call *call);
+
+// Background replicas; see shadow.c.  mirror_call_shadow() issues call and
+// has verify check it, either right away or, in async mode, once the other
+// replicas have caught up, while the caller only sees the primary's result.
+// With a quorum the caller first waits for enough replicas to agree.
+// shadow_submit() queues a call that already ran on the primary.  Descriptor
+// arrays are not copied and must stay valid until the call is verified;
+// shadow_drain() waits for everything submitted so far.
+int shadow_enabled(void);
+void mirror_call_shadow(struct mirror_call *call, mirror_verify_fn verify);
+void shadow_submit(struct mirror_call *call, mirror_verify_fn verify);
+// Keep calls on the same file in the primary's order on every replica, from
+// before running call on the primary until shadow_submit() has returned.
+struct shadow_order {
+    int stripes[2];
+    int count;
+    int shared;
+};
+void shadow_order_begin(const struct mirror_call *call, struct shadow_order *order);
+void shadow_order_end(struct shadow_order *order);
+void shadow_drain(void);
+int shadow_start(void);
+void shadow_stop(void);
+void shadow_report(FILE *f);
+
+// State behind one open file.  fi->fh holds the handle number.
+struct mirror_handle {
+    int fds[MAX_MNTPATHS];
+    uint64_t read_bytes;      // bytes read through the handle, for sampling
+    struct write_buffer *wb;  // coalesced writes, or NULL to write through
+};
+
+// Reserve a handle number; the handle's contents are left to the caller.
+int handle_alloc(uint64_t *fh);
+// Allocate a handle owning the replica descriptors in fds, closing them if
+// no handle is available.
+int handle_open(uint64_t *fh, const int fds[MAX_MNTPATHS]);
+void handle_free(uint64_t fh);
+// Look up an allocated handle.  Lock-free; the pointer stays valid until the
+// handle is freed.
+struct mirror_handle *handle_get(uint64_t fh);
+
+// Decide whether a read of size bytes through h is compared against every
+// replica or served from the primary alone, and count the decision.
+int sample_read(struct mirror_handle *h, size_t size);
+void sample_report(FILE *f);
+
+// Write coalescing; see coalesce.c.  Handles opened for writing get a
+// buffer when -o write_coalesce is set.
+struct fuse_bufvec;
+void coalesce_open(struct mirror_handle *h, int flags);
+// Buffer a write through a handle with a buffer, or write it through.
+int coalesce_write(struct mirror_handle *h, const char *buf, size_t size, off_t offset);
+int coalesce_write_buf(struct mirror_handle *h, struct fuse_bufvec *buf, off_t offset);
+// Write out buffered data that a read of size bytes at offset would see.
+void coalesce_read(struct mirror_handle *h, size_t size, off_t offset);
+// Write out the buffer ahead of an operation that has to see its data,
+// keeping its error for the next flush.
+void coalesce_writeout(struct mirror_handle *h);
+// Write out every buffer of the file with the primary's dev and ino, ahead of
+// returning its attributes.  Returns nonzero if any held data.
+int coalesce_writeout_file(dev_t dev, ino_t ino);
+// Write out the buffer and return the first error since the last flush.
+int coalesce_flush(struct mirror_handle *h);
+// Flush and free the buffer.
+int coalesce_release(struct mirror_handle *h);
+void coalesce_report(FILE *f);
+
+// Set the initial per-replica size of the thread-local scratch arenas.
+void bufpool_init(size_t size);
+// Point bufs[i] at the calling thread's scratch buffer for replica i, each
+// at least size bytes.  The buffers stay valid until the thread's next
+// bufpool_get().  Returns -1 if the arena could not be grown.
+int bufpool_get(size_t size, void *bufs[MAX_MNTPATHS]);
+void bufpool_report(FILE *f);
+
+struct mismatch {
+    int replica;      // first replica differing from the primary, -1 if none
+    size_t offset;    // first differing byte
+    size_t length;    // length of the differing run starting at offset
+};
+
+// Compare bufs[1..count-1] against bufs[0] over len bytes in a single pass.
+// Returns 1 and fills m when any buffer differs, 0 otherwise.
+int compare_buffers(void *const bufs[], int count, size_t len, struct mismatch *m);
+const char *compare_impl_name(void);
+// Print where the first differing run between the primary and a replica
+// lies, relative to base, along with the leading bytes of both.
+void report_mismatch(const char *func, void *const bufs[], size_t len,
+                     off_t base, const struct mismatch *m);
+
+// Verified replica operations shared by both front ends; see ops.c.  fds
+// holds the per-replica directory (or, with a NULL path, object) descriptors.
+// Run a call that only returns success or failure.
+int mirror_simple(struct mirror_call *call);
+// Set the attributes getattr compares from a comma-separated list of field
+// names, or the defaults for NULL.  Returns -1 for an unknown field.
+int stat_compare_init(const char *fields);
+// The statx fields the compared attributes need.
+extern unsigned stat_mask;
+// Compare every replica's attributes against the primary's, reporting name,
+// or the caller when NULL, with each difference.  Returns their number.
+int compare_stats(const struct statx *stxs, const char *name);
+// Whether the compared attributes of a and b agree, without reporting.
+int stats_agree(const struct statx *a, const struct statx *b);
+int mirror_getattr(const int *fds, const char *path, struct stat *stbuf);
+int mirror_access(const int *fds, const char *path, int mask);
+int mirror_readlink(const int *fds, const char *path, char *buf, size_t size);
+int mirror_mkdir(const int *fds, const char *path, mode_t mode);
+int mirror_unlink(const int *fds, const char *path);
+int mirror_rmdir(const int *fds, const char *path);
+int mirror_symlink(const char *from, const int *fds, const char *to);
+int mirror_rename(const int *fds, const char *from, const int *tofds, const char *to);
+int mirror_link(const int *fds, const char *from, const int *tofds, const char *to);
+int mirror_chmod(const int *fds, const char *path, mode_t mode);
+int mirror_chown(const int *fds, const char *path, uid_t uid, gid_t gid);
+int mirror_utimens(const int *fds, const char *path, const struct timespec ts[2]);
+// Open path on every replica, storing the new descriptors in newfds.
+int mirror_openat(const int *fds, const char *path, int flags, mode_t mode,
+                  int newfds[MAX_MNTPATHS]);
+int mirror_open(const int *fds, const char *path, int flags, mode_t mode,
+                uint64_t *fh);
+int mirror_read(const int *fds, char *buf, size_t size, off_t offset);
+int mirror_write(const int *fds, const char *buf, size_t size, off_t offset);
+int mirror_release(uint64_t fh);
+// Truncate path, or with a NULL path the objects in fds, which may be O_PATH
+// descriptors.  mirror_ftruncate() needs descriptors open for writing.
+int mirror_truncate(const int *fds, const char *path, off_t size);
+int mirror_ftruncate(const int *fds, off_t size);
+int mirror_fallocate(const int *fds, int mode, off_t offset, off_t length);
+// Copy within each replica; the data never passes through mirrorfs.
+ssize_t mirror_copy_file_range(const int *fds_in, off_t offset_in, const int *fds_out,
+                               off_t offset_out, size_t size, int flags);
+// Only meant for SEEK_DATA and SEEK_HOLE, whose answers are compared.
+off_t mirror_lseek(const int *fds, off_t offset, int whence);
+// Durability requests; see sync.c.  fsync requests for the same file are
+// merged into as few syncs as possible.
+int mirror_fsync(const int *fds, int datasync);
+int mirror_flush(const int *fds);
+void sync_report(FILE *f);
+// Extended attributes; see xattr.c.  Getting a value or the list of names
+// with a size of 0 returns the size needed.  Security attributes that every
+// replica lacks are remembered per object until they are set.
+ssize_t mirror_getxattr(const int *fds, const char *path, const char *name,
+                        char *value, size_t size);
+int mirror_setxattr(const int *fds, const char *path, const char *name,
+                    const char *value, size_t size, int flags);
+ssize_t mirror_listxattr(const int *fds, const char *path, char *list, size_t size);
+int mirror_removexattr(const int *fds, const char *path, const char *name);
+// Forget what is remembered about the object just created at path, which
+// may have inherited attributes and reused an inode number.
+void xattr_created(const int *fds, const char *path);
+void xattr_report(FILE *f);
+// Write a buffer handed over by libfuse, splicing it into every replica when
+// it arrived in a pipe; see splice.c.
+int mirror_write_buf(const int *fds, struct fuse_bufvec *buf, off_t offset);
+
+struct mirror_dirent {
+    size_t name;              // offset of the name in mirror_dir.names
+    ino_t ino;
+    unsigned char type;       // DT_* file type
+};
+
+// An open directory: the primary's entries sorted by name, verified against
+// every replica.  Entry i lives at offset i + 1.
+struct mirror_dir {
+    int fds[MAX_MNTPATHS];    // per-replica directory descriptors
+    struct mirror_dirent *entries;
+    size_t count;
+    char *names;
+    int served;               // entries were returned since the last load
+    int synced;               // syncs may still be queued for the replicas
+};
+
+// Open and read path on every replica and compare the listings regardless
+// of order.
+int mirror_opendir(const int *fds, const char *path, struct mirror_dir **dirp);
+// Prepare to serve entries from offset on.
+int mirror_dir_seek(struct mirror_dir *d, off_t offset);
+int mirror_fsyncdir(struct mirror_dir *d, int datasync);
+void mirror_releasedir(struct mirror_dir *d);
+
+// What to do once replicas are found to disagree.
+enum divergence_policy {
+    DIVERGENCE_ABORT,         // abort the file system, the default
+    DIVERGENCE_LOG,           // report it and carry on
+    DIVERGENCE_EIO,           // fail the operation with EIO
+};
+
+extern enum divergence_policy divergence_policy;
+
+// One difference between the primary and a replica.
+struct divergence {
+    int replica;
+    const char *what;         // compared expression, field or kind of data
+    const char *name;         // directory entry concerned, or NULL
+    long primary;             // the primary's value
+    long value;               // the replica's value
+    uint64_t offset;          // start of a differing byte range
+    uint64_t length;          // length of a differing byte range
+};
+
+// Record a divergence noticed by func and apply the divergence policy.
+void divergence(const char *func, const struct divergence *d);
+// Whether the calling thread noticed a divergence since the last call, for
+// operations to fail with EIO.  Always 0 unless the policy is eio.
+int divergence_take(void);
+
+// Binary operation journal; see journal.c.  Each thread appends records to
+// a ring of its own, and a background thread writes them to the file.
+extern int journal_enabled;
+int journal_open(const char *path);
+int journal_start(void);
+void journal_stop(void);
+// Record a finished call with every replica's result.
+void journal_call(const struct mirror_call *call);
+
+// Journal file format, read by tools/mirrorfs_journal.
+#define JOURNAL_MAGIC 0x4c4e524a    // "JRNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_STRING_MAX 1024     // longer strings are truncated
+
+// Starts the file, followed by op_count NUL-terminated operation names
+// taking names_size bytes, which call records index by op.
+struct journal_file_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t op_count;
+    uint32_t names_size;
+    uint32_t reserved;
+};
+
+enum journal_type {
+    JOURNAL_CALL = 1,
+    JOURNAL_DIVERGENCE = 2,
+    JOURNAL_DROPPED = 3,      // seq records lost to a full ring
+};
+
+// Every record starts with this.  Records are padded to 8 bytes.
+struct journal_record {
+    uint16_t type;
+    uint16_t size;            // whole record, padding included
+    uint32_t thread;
+    uint64_t seq;             // call number; divergences refer to their call
+    uint64_t time;            // CLOCK_REALTIME, in nanoseconds
+};
+
+struct journal_result {
+    int64_t res;
+    int32_t err;
+    uint32_t reserved;
+    uint64_t nsecs;
+};
+
+// Followed by replicas results, then path and path2, NUL-terminated.
+struct journal_call_record {
+    struct journal_record hdr;
+    uint16_t op;
+    uint16_t replicas;
+    int32_t flags;
+    uint32_t mode;
+    uint16_t path_len;        // including the NUL, 0 when absent
+    uint16_t path2_len;
+    uint64_t size;
+    int64_t offset;
+};
+
+// Followed by func, what and name, NUL-terminated.
+struct journal_divergence_record {
+    struct journal_record hdr;
+    int32_t replica;
+    uint16_t func_len;
+    uint16_t what_len;
+    uint16_t name_len;
+    uint16_t reserved[3];
+    int64_t primary;
+    int64_t value;
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct fuse;
+struct fuse_args;
+struct fuse_operations;
+struct fuse_lowlevel_ops;
+struct fuse_cmdline_opts;
+struct fuse_loop_config;
+
+// Deferred kernel cache invalidation; see inval.c.  The thread only runs when
+// one of the caching options is set.
+int inval_start(struct fuse *fuse);
+void inval_stop(void);
+void inval_path(const char *path);
+
+// Serve the reserved /.mirrorfs/stats file in front of either front end's
+// operations and time the others; see statsfile.c.
+const struct fuse_operations *statsfile_wrap(const struct fuse_operations *next);
+const struct fuse_lowlevel_ops *statsfile_ll_wrap(const struct fuse_lowlevel_ops *next);
+
+// Request tracing for the path-based front end; see trace.c.
+int trace_open_file(const char *path);
+// Operations that trace each request and hand it on to next.
+const struct fuse_operations *trace_wrap(const struct fuse_operations *next);
+
+// Mount and serve the low-level front end.  config is NULL for a
+// single-threaded loop.
+int mirrorfs_ll_main(struct fuse_args *args, struct fuse_cmdline_opts *opts,
+                     struct fuse_loop_config *config);
+
+#endif
@@ -0,0 +1,821 @@
+#define FUSE_USE_VERSION 312
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mirrorfs.h"
+
+// Inode-based front end.  Every inode the kernel knows about holds an O_PATH
+// descriptor per replica, opened when the inode was first looked up, so a
+// lookup resolves a single component relative to its parent and all other
+// operations act on the cached descriptors instead of walking the full path
+// again on every replica.  Verification goes through the same operations as
+// the path-based front end.
+
+struct ll_inode {
+    int fds[MAX_MNTPATHS];    // O_PATH descriptors, one per replica
+    dev_t dev;                // primary's identity, used as the table key
+    ino_t ino;
+    uint64_t nlookup;         // lookups not yet balanced by a forget
+    struct ll_inode *next;    // hash chain
+};
+
+static struct ll_inode root_inode;
+
+static pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ll_inode **inode_table;
+static size_t inode_buckets;
+static size_t inode_count;
+
+static struct ll_inode *ll_inode(fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID) {
+        return &root_inode;
+    }
+    return (struct ll_inode *)(uintptr_t)ino;
+}
+
+static void close_fds(const int fds[MAX_MNTPATHS])
+{
+    for (int i = 0; i < mntpath_count; i++) {
+        close(fds[i]);
+    }
+}
+
+static size_t inode_hash(dev_t dev, ino_t ino, size_t buckets)
+{
+    return (ino ^ (dev * 0x9e3779b97f4a7c15ULL)) & (buckets - 1);
+}
+
+// Double the table once chains get long.  Called with inode_lock held.
+static void inode_table_grow(void)
+{
+    size_t buckets = inode_buckets ? 2 * inode_buckets : 1024;
+    struct ll_inode **table = calloc(buckets, sizeof(*table));
+    if (table == NULL) {
+        // Keep using the smaller table; lookups just get slower.
+        return;
+    }
+
+    for (size_t b = 0; b < inode_buckets; b++) {
+        struct ll_inode *inode = inode_table[b];
+        while (inode != NULL) {
+            struct ll_inode *next = inode->next;
+            size_t h = inode_hash(inode->dev, inode->ino, buckets);
+            inode->next = table[h];
+            table[h] = inode;
+            inode = next;
+        }
+    }
+    free(inode_table);
+    inode_table = table;
+    inode_buckets = buckets;
+}
+
+// Return the inode for the object fds refer to with one more lookup
+// reference.  fds are owned by the inode afterwards, or closed if the object
+// already has one.
+static struct ll_inode *inode_get(const int fds[MAX_MNTPATHS], const struct stat *st)
+{
+    pthread_mutex_lock(&inode_lock);
+
+    if (inode_count >= inode_buckets) {
+        inode_table_grow();
+    }
+    if (inode_table == NULL) {
+        pthread_mutex_unlock(&inode_lock);
+        return NULL;
+    }
+
+    size_t h = inode_hash(st->st_dev, st->st_ino, inode_buckets);
+    struct ll_inode *inode;
+    for (inode = inode_table[h]; inode != NULL; inode = inode->next) {
+        if (inode->dev == st->st_dev && inode->ino == st->st_ino) {
+            inode->nlookup++;
+            pthread_mutex_unlock(&inode_lock);
+            close_fds(fds);
+            return inode;
+        }
+    }
+
+    inode = calloc(1, sizeof(*inode));
+    if (inode == NULL) {
+        pthread_mutex_unlock(&inode_lock);
+        return NULL;
+    }
+    memcpy(inode->fds, fds, sizeof(inode->fds));
+    inode->dev = st->st_dev;
+    inode->ino = st->st_ino;
+    inode->nlookup = 1;
+    inode->next = inode_table[h];
+    inode_table[h] = inode;
+    inode_count++;
+
+    pthread_mutex_unlock(&inode_lock);
+    return inode;
+}
+
+static void inode_forget(struct ll_inode *inode, uint64_t nlookup)
+{
+    if (inode == &root_inode) {
+        return;
+    }
+
+    pthread_mutex_lock(&inode_lock);
+    inode->nlookup -= nlookup;
+    if (inode->nlookup > 0) {
+        pthread_mutex_unlock(&inode_lock);
+        return;
+    }
+    struct ll_inode **p = &inode_table[inode_hash(inode->dev, inode->ino, inode_buckets)];
+    while (*p != inode) {
+        p = &(*p)->next;
+    }
+    *p = inode->next;
+    inode_count--;
+    pthread_mutex_unlock(&inode_lock);
+
+    close_fds(inode->fds);
+    free(inode);
+}
+
+// Resolve name in parent on every replica and fill e with its inode, taking a
+// lookup reference.
+static int ll_entry(struct ll_inode *parent, const char *name,
+                    struct fuse_entry_param *e)
+{
+    int fds[MAX_MNTPATHS];
+    int res;
+
+    memset(e, 0, sizeof(*e));
+
+    res = mirror_openat(parent->fds, name, O_PATH | O_NOFOLLOW, 0, fds);
+    if (res != 0) {
+        return res;
+    }
+    res = mirror_getattr(fds, NULL, &e->attr);
+    if (res != 0) {
+        close_fds(fds);
+        return res;
+    }
+
+    struct ll_inode *inode = inode_get(fds, &e->attr);
+    if (inode == NULL) {
+        close_fds(fds);
+        return -ENOMEM;
+    }
+
+    e->ino = (uintptr_t)inode;
+    e->attr_timeout = options.attr_timeout;
+    e->entry_timeout = options.entry_timeout;
+    return 0;
+}
+
+static void reply_entry(fuse_req_t req, struct ll_inode *parent, const char *name,
+                        int res)
+{
+    struct fuse_entry_param e;
+
+    if (res == 0) {
+        res = ll_entry(parent, name, &e);
+    }
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+static void mirrorfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    mirrorfs_conn_init(conn);
+    if (options.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+
+    int res = log_start();
+    if (res != 0) {
+        fprintf(stderr, "Could not start logging: %s\n", strerror(-res));
+        log_level = LOG_LEVEL_NONE;
+    }
+    res = fanout_start();
+    if (res != 0) {
+        fprintf(stderr, "Could not start fan-out workers, running serially: %s\n",
+                strerror(-res));
+    }
+    res = journal_start();
+    if (res != 0) {
+        fprintf(stderr, "Could not start the journal: %s\n", strerror(-res));
+    }
+}
+
+static void mirrorfs_ll_destroy(void *userdata)
+{
+    fanout_stop();
+    bufpool_report(stderr);
+    sample_report(stderr);
+    coalesce_report(stderr);
+    sync_report(stderr);
+    xattr_report(stderr);
+    journal_stop();
+    log_stop();
+}
+
+static void mirrorfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    LOG_FUSE_OPERATION("%lu %s", (unsigned long)parent, name);
+
+    struct fuse_entry_param e;
+    int res = ll_entry(ll_inode(parent), name, &e);
+
+    // A zero inode tells the kernel to cache the name as missing.
+    if (res == -ENOENT && options.negative_timeout > 0) {
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = options.negative_timeout;
+        res = 0;
+    }
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+static void mirrorfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    inode_forget(ll_inode(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+static void mirrorfs_ll_forget_multi(fuse_req_t req, size_t count,
+                                     struct fuse_forget_data *forgets)
+{
+    for (size_t i = 0; i < count; i++) {
+        inode_forget(ll_inode(forgets[i].ino), forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void mirrorfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                                struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu", (unsigned long)ino);
+
+    // As for the path-based front end, buffered writes count towards the size.
+    if (fi != NULL) {
+        coalesce_writeout(handle_get(fi->fh));
+    }
+    struct stat st;
+    int res = mirror_getattr(ll_inode(ino)->fds, NULL, &st);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_attr(req, &st, options.attr_timeout);
+}
+
+// Applied in the same order as the high-level library does for the
+// path-based front end.
+static void mirrorfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                                int to_set, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu 0x%x", (unsigned long)ino, to_set);
+
+    const int *fds = ll_inode(ino)->fds;
+    int res = 0;
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        res = mirror_chmod(fds, NULL, attr->st_mode);
+    }
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+        res = mirror_chown(fds, NULL, uid, gid);
+    }
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        if (fi != NULL) {
+            struct mirror_handle *h = handle_get(fi->fh);
+            coalesce_writeout(h);
+            res = mirror_ftruncate(h->fds, attr->st_size);
+        } else {
+            res = mirror_truncate(fds, NULL, attr->st_size);
+        }
+    }
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct timespec ts[2] = {
+            { .tv_nsec = UTIME_OMIT },
+            { .tv_nsec = UTIME_OMIT },
+        };
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+            ts[0].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_ATIME) {
+            ts[0] = attr->st_atim;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+            ts[1].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_MTIME) {
+            ts[1] = attr->st_mtim;
+        }
+        res = mirror_utimens(fds, NULL, ts);
+    }
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    mirrorfs_ll_getattr(req, ino, fi);
+}
+
+static void mirrorfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    LOG_FUSE_OPERATION("%lu", (unsigned long)ino);
+
+    char buf[PATH_MAX + 1];
+    int res = mirror_readlink(ll_inode(ino)->fds, NULL, buf, sizeof(buf));
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_readlink(req, buf);
+}
+
+static void mirrorfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                              mode_t mode)
+{
+    LOG_FUSE_OPERATION("%lu %s 0x%x", (unsigned long)parent, name, mode);
+
+    struct ll_inode *dir = ll_inode(parent);
+    reply_entry(req, dir, name, mirror_mkdir(dir->fds, name, mode));
+}
+
+static void mirrorfs_ll_symlink(fuse_req_t req, const char *link,
+                                fuse_ino_t parent, const char *name)
+{
+    LOG_FUSE_OPERATION("%s %lu %s", link, (unsigned long)parent, name);
+
+    struct ll_inode *dir = ll_inode(parent);
+    reply_entry(req, dir, name, mirror_symlink(link, dir->fds, name));
+}
+
+static void mirrorfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    LOG_FUSE_OPERATION("%lu %s", (unsigned long)parent, name);
+
+    fuse_reply_err(req, -mirror_unlink(ll_inode(parent)->fds, name));
+}
+
+static void mirrorfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    LOG_FUSE_OPERATION("%lu %s", (unsigned long)parent, name);
+
+    fuse_reply_err(req, -mirror_rmdir(ll_inode(parent)->fds, name));
+}
+
+static void mirrorfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                               fuse_ino_t newparent, const char *newname,
+                               unsigned int flags)
+{
+    LOG_FUSE_OPERATION("%lu %s %lu %s 0x%x", (unsigned long)parent, name,
+                       (unsigned long)newparent, newname, flags);
+
+    if (flags) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    fuse_reply_err(req, -mirror_rename(ll_inode(parent)->fds, name,
+                                       ll_inode(newparent)->fds, newname));
+}
+
+static void mirrorfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                             const char *newname)
+{
+    LOG_FUSE_OPERATION("%lu %lu %s", (unsigned long)ino, (unsigned long)newparent,
+                       newname);
+
+    struct ll_inode *dir = ll_inode(newparent);
+    reply_entry(req, dir, newname,
+                mirror_link(ll_inode(ino)->fds, NULL, dir->fds, newname));
+}
+
+static void mirrorfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    LOG_FUSE_OPERATION("%lu 0x%x", (unsigned long)ino, mask);
+
+    fuse_reply_err(req, -mirror_access(ll_inode(ino)->fds, NULL, mask));
+}
+
+static void mirrorfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                               mode_t mode, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu %s %o 0x%x", (unsigned long)parent, name, mode, fi->flags);
+
+    struct ll_inode *dir = ll_inode(parent);
+    struct fuse_entry_param e;
+
+    int res = mirror_open(dir->fds, name, fi->flags, mode, &fi->fh);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    res = ll_entry(dir, name, &e);
+    if (res != 0) {
+        mirror_release(fi->fh);
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_create(req, &e, fi);
+}
+
+static void mirrorfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu 0x%x", (unsigned long)ino, fi->flags);
+
+    int res = mirror_open(ll_inode(ino)->fds, NULL, fi->flags, 0, &fi->fh);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fi->keep_cache = options.keep_cache;
+    fuse_reply_open(req, fi);
+}
+
+static void mirrorfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t offset, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu %zu %ld", (unsigned long)ino, size, offset);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    coalesce_read(h, size, offset);
+
+    // Reads that sampling skips are spliced straight from the primary.
+    if (!sample_read(h, size)) {
+        struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+        bv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bv.buf[0].fd = h->fds[0];
+        bv.buf[0].pos = offset;
+        fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
+        return;
+    }
+
+    // The primary's data is needed in memory for the comparison anyway, so
+    // read it straight into the thread's scratch buffer and reply from
+    // there.  mirror_read() gets the same buffers for the other replicas.
+    void *bufs[MAX_MNTPATHS];
+    if (bufpool_get(size, bufs) != 0) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int res = mirror_read(h->fds, bufs[0], size, offset);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_buf(req, bufs[0], res);
+}
+
+static void mirrorfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                                  struct fuse_bufvec *buf, off_t offset,
+                                  struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu %zu %ld", (unsigned long)ino, fuse_buf_size(buf), offset);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    int res = h->wb != NULL ? coalesce_write_buf(h, buf, offset) :
+                              mirror_write_buf(h->fds, buf, offset);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_write(req, res);
+}
+
+static void mirrorfs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu", (unsigned long)ino);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    int res = coalesce_flush(h);
+    int flushed = mirror_flush(h->fds);
+    fuse_reply_err(req, -(res != 0 ? res : flushed));
+}
+
+static void mirrorfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                                struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu", (unsigned long)ino);
+
+    fuse_reply_err(req, -mirror_release(fi->fh));
+}
+
+static void mirrorfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                              struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu %d", (unsigned long)ino, datasync);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    int res = coalesce_flush(h);
+    int synced = mirror_fsync(h->fds, datasync);
+    fuse_reply_err(req, -(res != 0 ? res : synced));
+}
+
+static void mirrorfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                                 struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu %d", (unsigned long)ino, datasync);
+
+    fuse_reply_err(req, -mirror_fsyncdir((struct mirror_dir *)(uintptr_t)fi->fh, datasync));
+}
+
+static void mirrorfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                                  off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu 0x%x %lld %lld", (unsigned long)ino, mode,
+                       (long long)offset, (long long)length);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    coalesce_writeout(h);
+    fuse_reply_err(req, -mirror_fallocate(h->fds, mode, offset, length));
+}
+
+static void mirrorfs_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                                        struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+                                        off_t off_out, struct fuse_file_info *fi_out,
+                                        size_t len, int flags)
+{
+    LOG_FUSE_OPERATION("%lu %lld %lu %lld %zu", (unsigned long)ino_in, (long long)off_in,
+                       (unsigned long)ino_out, (long long)off_out, len);
+
+    struct mirror_handle *in = handle_get(fi_in->fh);
+    struct mirror_handle *out = handle_get(fi_out->fh);
+    coalesce_writeout(in);
+    coalesce_writeout(out);
+    ssize_t res = mirror_copy_file_range(in->fds, off_in, out->fds, off_out, len, flags);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_write(req, res);
+}
+
+static void mirrorfs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                              struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu %lld %d", (unsigned long)ino, (long long)off, whence);
+
+    struct mirror_handle *h = handle_get(fi->fh);
+    coalesce_writeout(h);
+    off_t res = mirror_lseek(h->fds, off, whence);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_lseek(req, res);
+}
+
+static void mirrorfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                                 const char *value, size_t size, int flags)
+{
+    LOG_FUSE_OPERATION("%lu %s %zu 0x%x", (unsigned long)ino, name, size, flags);
+
+    fuse_reply_err(req, -mirror_setxattr(ll_inode(ino)->fds, NULL, name, value, size, flags));
+}
+
+// A size of 0 asks for the size needed rather than the data.
+static void reply_xattr(fuse_req_t req, const char *buf, size_t size, ssize_t res)
+{
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, res);
+    } else {
+        fuse_reply_buf(req, buf, res);
+    }
+}
+
+static void mirrorfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                                 size_t size)
+{
+    LOG_FUSE_OPERATION("%lu %s %zu", (unsigned long)ino, name, size);
+
+    char *value = NULL;
+    if (size > 0 && (value = malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    reply_xattr(req, value, size, mirror_getxattr(ll_inode(ino)->fds, NULL, name, value, size));
+    free(value);
+}
+
+static void mirrorfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    LOG_FUSE_OPERATION("%lu %zu", (unsigned long)ino, size);
+
+    char *list = NULL;
+    if (size > 0 && (list = malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    reply_xattr(req, list, size, mirror_listxattr(ll_inode(ino)->fds, NULL, list, size));
+    free(list);
+}
+
+static void mirrorfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+    LOG_FUSE_OPERATION("%lu %s", (unsigned long)ino, name);
+
+    fuse_reply_err(req, -mirror_removexattr(ll_inode(ino)->fds, NULL, name));
+}
+
+static void mirrorfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                                struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu", (unsigned long)ino);
+
+    struct mirror_dir *d;
+    int res = mirror_opendir(ll_inode(ino)->fds, ".", &d);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->fh = (uintptr_t)d;
+    fuse_reply_open(req, fi);
+}
+
+// With plus set every entry other than . and .. is looked up as well, so the
+// kernel need not ask for each one in turn.
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi, int plus)
+{
+    struct mirror_dir *d = (struct mirror_dir *)(uintptr_t)fi->fh;
+    int res = mirror_dir_seek(d, offset);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t used = 0;
+
+    for (size_t i = offset; i < d->count; i++) {
+        const struct mirror_dirent *de = &d->entries[i];
+        const char *name = d->names + de->name;
+        size_t len;
+
+        if (plus) {
+            struct fuse_entry_param e;
+
+            // A zero inode lists the entry without attributes, as for those
+            // that vanished since opendir.
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+                ll_entry(ll_inode(ino), name, &e) != 0) {
+                memset(&e, 0, sizeof(e));
+                e.attr.st_ino = de->ino;
+                e.attr.st_mode = de->type << 12;
+            }
+            len = fuse_add_direntry_plus(req, buf + used, size - used, name, &e, i + 1);
+            if (len > size - used) {
+                if (e.ino != 0) {
+                    inode_forget(ll_inode(e.ino), 1);
+                }
+                break;
+            }
+        } else {
+            struct stat st;
+
+            memset(&st, 0, sizeof(st));
+            st.st_ino = de->ino;
+            st.st_mode = de->type << 12;
+            len = fuse_add_direntry(req, buf + used, size - used, name, &st, i + 1);
+            if (len > size - used) {
+                break;
+            }
+        }
+        used += len;
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void mirrorfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t offset, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu %zu %ld", (unsigned long)ino, size, offset);
+
+    ll_readdir(req, ino, size, offset, fi, 0);
+}
+
+static void mirrorfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                    off_t offset, struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu %zu %ld", (unsigned long)ino, size, offset);
+
+    ll_readdir(req, ino, size, offset, fi, 1);
+}
+
+static void mirrorfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                                   struct fuse_file_info *fi)
+{
+    LOG_FUSE_OPERATION("%lu", (unsigned long)ino);
+
+    mirror_releasedir((struct mirror_dir *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops mirrorfs_ll_oper = {
+    .init = mirrorfs_ll_init,
+    .destroy = mirrorfs_ll_destroy,
+    .lookup = mirrorfs_ll_lookup,
+    .forget = mirrorfs_ll_forget,
+    .forget_multi = mirrorfs_ll_forget_multi,
+    .getattr = mirrorfs_ll_getattr,
+    .setattr = mirrorfs_ll_setattr,
+    .readlink = mirrorfs_ll_readlink,
+    .mkdir = mirrorfs_ll_mkdir,
+    .symlink = mirrorfs_ll_symlink,
+    .unlink = mirrorfs_ll_unlink,
+    .rmdir = mirrorfs_ll_rmdir,
+    .rename = mirrorfs_ll_rename,
+    .link = mirrorfs_ll_link,
+    .access = mirrorfs_ll_access,
+    .create = mirrorfs_ll_create,
+    .open = mirrorfs_ll_open,
+    .read = mirrorfs_ll_read,
+    .write_buf = mirrorfs_ll_write_buf,
+    .release = mirrorfs_ll_release,
+    .flush = mirrorfs_ll_flush,
+    .fsync = mirrorfs_ll_fsync,
+    .fsyncdir = mirrorfs_ll_fsyncdir,
+    .fallocate = mirrorfs_ll_fallocate,
+    .copy_file_range = mirrorfs_ll_copy_file_range,
+    .lseek = mirrorfs_ll_lseek,
+    .setxattr = mirrorfs_ll_setxattr,
+    .getxattr = mirrorfs_ll_getxattr,
+    .listxattr = mirrorfs_ll_listxattr,
+    .removexattr = mirrorfs_ll_removexattr,
+    .opendir = mirrorfs_ll_opendir,
+    .readdir = mirrorfs_ll_readdir,
+    .readdirplus = mirrorfs_ll_readdirplus,
+    .releasedir = mirrorfs_ll_releasedir,
+};
+
+int mirrorfs_ll_main(struct fuse_args *args, struct fuse_cmdline_opts *opts,
+                     struct fuse_loop_config *config)
+{
+    struct fuse_session *se;
+    int res = 1;
+
+    // The mirrored directories themselves stand in for the root inode's
+    // O_PATH descriptors.
+    memcpy(root_inode.fds, mntfds, sizeof(root_inode.fds));
+
+    const struct fuse_lowlevel_ops *oper = statsfile_ll_wrap(&mirrorfs_ll_oper);
+    se = fuse_session_new(args, oper, sizeof(*oper), NULL);
+    if (se == NULL) {
+        return 1;
+    }
+    if (fuse_session_mount(se, opts->mountpoint) != 0) {
+        goto out_destroy;
+    }
+    if (fuse_daemonize(opts->foreground) != 0) {
+        goto out_unmount;
+    }
+    if (fuse_set_signal_handlers(se) != 0) {
+        goto out_unmount;
+    }
+
+    if (config == NULL) {
+        res = fuse_session_loop(se);
+    } else {
+        res = fuse_session_loop_mt(se, config);
+    }
+    if (res != 0) {
+        res = 1;
+    }
+
+    fuse_remove_signal_handlers(se);
+out_unmount:
+    fuse_session_unmount(se);
+out_destroy:
+    fuse_session_destroy(se);
+    return res;
+}
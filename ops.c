@@ -0,0 +1,657 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "mirrorfs.h"
+
+// Verified replica operations shared by the path-based and the inode-based
+// front ends.  Each one fans a single system call out to every replica,
+// checks that all of them agree and returns the primary's result or -errno.
+// The checks live in verify callbacks so that, in async mode, they can run
+// after the operation has already returned; see shadow.c.
+
+// Compare the result and errno of every replica against the primary.  Returns
+// nonzero when all results are identical.
+#define COMPARE_RESULTS(call) \
+    ({ \
+        int _agree = 1; \
+        for (int i = 1; i < mntpath_count; i++) { \
+            CHECK_EQUAL(i, (call).res[0], (call).res[i]); \
+            CHECK_EQUAL(i, (call).errnos[0], (call).errnos[i]); \
+            _agree &= (call).res[0] == (call).res[i]; \
+        } \
+        _agree; \
+    })
+
+static void verify_results(struct mirror_call *call)
+{
+    COMPARE_RESULTS(*call);
+}
+
+int mirror_simple(struct mirror_call *call)
+{
+    mirror_call_shadow(call, verify_results);
+
+    if (call->res[0] == -1) {
+        return -call->errnos[0];
+    }
+
+    return 0;
+}
+
+// Attribute comparison.  -o verify_stat names the fields compared between
+// replicas.  They are turned once into the statx mask the other replicas are
+// asked for and a byte mask over struct statx, so that comparing two results
+// is a single pass of XOR and AND; the fields are only looked at one by one
+// to report a difference.
+
+#define STAT_WORDS (sizeof(struct statx) / sizeof(uint64_t))
+
+typedef uint64_t __attribute__((may_alias)) stat_word;
+
+// Values wider than a long are split, so that each row can be reported.
+static const struct stat_field {
+    const char *name;
+    unsigned mask;            // statx field the value needs
+    size_t offset;
+    size_t size;
+    int dirs;                 // also compared for directories
+} stat_fields[] = {
+#define STAT_FIELD(name, mask, member, dirs) \
+    { name, mask, offsetof(struct statx, member), \
+      sizeof(((struct statx *)0)->member), dirs }
+    STAT_FIELD("mode", STATX_TYPE | STATX_MODE, stx_mode, 1),
+    STAT_FIELD("nlink", STATX_NLINK, stx_nlink, 1),
+    STAT_FIELD("uid", STATX_UID, stx_uid, 1),
+    STAT_FIELD("gid", STATX_GID, stx_gid, 1),
+    // Directory sizes depend on the file system.
+    STAT_FIELD("size", STATX_SIZE, stx_size, 0),
+    STAT_FIELD("blocks", STATX_BLOCKS, stx_blocks, 1),
+    STAT_FIELD("blksize", 0, stx_blksize, 1),
+    STAT_FIELD("ino", STATX_INO, stx_ino, 1),
+    STAT_FIELD("dev", 0, stx_dev_major, 1),
+    STAT_FIELD("dev", 0, stx_dev_minor, 1),
+    STAT_FIELD("rdev", 0, stx_rdev_major, 1),
+    STAT_FIELD("rdev", 0, stx_rdev_minor, 1),
+    STAT_FIELD("atime", STATX_ATIME, stx_atime.tv_sec, 1),
+    STAT_FIELD("atime", STATX_ATIME, stx_atime.tv_nsec, 1),
+    STAT_FIELD("mtime", STATX_MTIME, stx_mtime.tv_sec, 1),
+    STAT_FIELD("mtime", STATX_MTIME, stx_mtime.tv_nsec, 1),
+    STAT_FIELD("ctime", STATX_CTIME, stx_ctime.tv_sec, 1),
+    STAT_FIELD("ctime", STATX_CTIME, stx_ctime.tv_nsec, 1),
+    STAT_FIELD("btime", STATX_BTIME, stx_btime.tv_sec, 1),
+    STAT_FIELD("btime", STATX_BTIME, stx_btime.tv_nsec, 1),
+#undef STAT_FIELD
+};
+
+#define STAT_FIELD_COUNT (sizeof(stat_fields) / sizeof(stat_fields[0]))
+#define STAT_DEFAULT_FIELDS "mode,nlink,uid,gid,size"
+
+unsigned stat_mask;
+static int stat_selected[STAT_FIELD_COUNT];
+static stat_word stat_bytes[2][STAT_WORDS]; // compared bytes of files, directories
+
+int stat_compare_init(const char *fields)
+{
+    char *list = strdup(fields != NULL ? fields : STAT_DEFAULT_FIELDS);
+    char *save;
+
+    if (list == NULL) {
+        return -1;
+    }
+    stat_mask = 0;
+    memset(stat_selected, 0, sizeof(stat_selected));
+    memset(stat_bytes, 0, sizeof(stat_bytes));
+    for (char *name = strtok_r(list, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        int found = 0;
+        for (size_t f = 0; f < STAT_FIELD_COUNT; f++) {
+            const struct stat_field *sf = &stat_fields[f];
+            if (strcmp(name, sf->name) != 0) {
+                continue;
+            }
+            found = 1;
+            stat_mask |= sf->mask;
+            stat_selected[f] = 1;
+            memset((char *)stat_bytes[0] + sf->offset, 0xff, sf->size);
+            if (sf->dirs) {
+                memset((char *)stat_bytes[1] + sf->offset, 0xff, sf->size);
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown stat field: %s\n", name);
+            free(list);
+            return -1;
+        }
+    }
+    free(list);
+    return 0;
+}
+
+static long stat_value(const struct statx *stx, const struct stat_field *sf)
+{
+    uint64_t v = 0;
+    memcpy(&v, (const char *)stx + sf->offset, sf->size);
+    return v;
+}
+
+int compare_stats(const struct statx *stxs, const char *name)
+{
+    const stat_word *mask = stat_bytes[S_ISDIR(stxs[0].stx_mode)];
+    const stat_word *primary = (const stat_word *)&stxs[0];
+    int differences = 0;
+
+    for (int i = 1; i < mntpath_count; i++) {
+        const stat_word *replica = (const stat_word *)&stxs[i];
+        uint64_t differ = 0;
+
+        for (size_t w = 0; w < STAT_WORDS; w++) {
+            differ |= (primary[w] ^ replica[w]) & mask[w];
+        }
+        if (differ == 0) {
+            continue;
+        }
+        for (size_t f = 0; f < STAT_FIELD_COUNT; f++) {
+            const struct stat_field *sf = &stat_fields[f];
+            if (!stat_selected[f] || (!sf->dirs && S_ISDIR(stxs[0].stx_mode))) {
+                continue;
+            }
+            long x = stat_value(&stxs[0], sf);
+            long y = stat_value(&stxs[i], sf);
+            if (x != y) {
+                fprintf(stderr, "%s: %s %ld != %ld\n", name != NULL ? name : __func__,
+                        sf->name, x, y);
+                struct divergence d = {
+                    .replica = i, .what = sf->name, .name = name, .primary = x, .value = y,
+                };
+                divergence(__func__, &d);
+                differences++;
+            }
+        }
+    }
+    return differences;
+}
+
+int stats_agree(const struct statx *a, const struct statx *b)
+{
+    const stat_word *mask = stat_bytes[S_ISDIR(a->stx_mode)];
+    const stat_word *x = (const stat_word *)a;
+    const stat_word *y = (const stat_word *)b;
+    uint64_t differ = 0;
+
+    for (size_t w = 0; w < STAT_WORDS; w++) {
+        differ |= (x[w] ^ y[w]) & mask[w];
+    }
+    return differ == 0;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static void verify_getattr(struct mirror_call *call)
+{
+    if (COMPARE_RESULTS(*call) && call->res[0] != -1) {
+        compare_stats(call->stxs, NULL);
+    }
+}
+
+static int getattr_call(const int *fds, const char *path, struct stat *stbuf)
+{
+    struct statx stxs[MAX_MNTPATHS];
+    struct mirror_call call = {
+        .op = MIRROR_STATX,
+        .fds = fds,
+        .path = path,
+        .flags = AT_SYMLINK_NOFOLLOW,
+        .flags2 = options.stat_dont_sync ? AT_STATX_DONT_SYNC : 0,
+        .mask = stat_mask,
+        .stxs = stxs,
+    };
+    mirror_call_shadow(&call, verify_getattr);
+
+    if (call.res[0] == -1) {
+        return -call.errnos[0];
+    }
+
+    statx_to_stat(&stxs[0], stbuf);
+
+    return 0;
+}
+
+// Files are only known by inode once stated, so buffered writes to the file,
+// through any handle, are written out afterwards and the file stated again.
+int mirror_getattr(const int *fds, const char *path, struct stat *stbuf)
+{
+    int res = getattr_call(fds, path, stbuf);
+
+    if (res == 0 && S_ISREG(stbuf->st_mode) &&
+        coalesce_writeout_file(stbuf->st_dev, stbuf->st_ino)) {
+        res = getattr_call(fds, path, stbuf);
+    }
+    return res;
+}
+
+int mirror_access(const int *fds, const char *path, int mask)
+{
+    struct mirror_call call = {
+        .op = MIRROR_FACCESSAT,
+        .fds = fds,
+        .path = path,
+        .mode = mask,
+    };
+    return mirror_simple(&call);
+}
+
+// Readlink and pread results are compared byte for byte when every replica
+// returned the same length.
+static void verify_data(struct mirror_call *call)
+{
+    if (COMPARE_RESULTS(*call) && call->res[0] != -1) {
+        CHECK_BUFFERS(call->bufs, call->res[0], call->offset);
+    }
+}
+
+int mirror_readlink(const int *fds, const char *path, char *buf, size_t size)
+{
+    struct mirror_call call = {
+        .op = MIRROR_READLINKAT,
+        .fds = fds,
+        .path = path,
+        .size = size - 1,
+    };
+    if (bufpool_get(size, call.bufs) != 0) {
+        return -ENOMEM;
+    }
+    mirror_call_shadow(&call, verify_data);
+
+    if (call.res[0] == -1) {
+        return -call.errnos[0];
+    }
+
+    memcpy(buf, call.bufs[0], call.res[0]);
+    buf[call.res[0]] = '\0';
+
+    return 0;
+}
+
+int mirror_mkdir(const int *fds, const char *path, mode_t mode)
+{
+    struct mirror_call call = {
+        .op = MIRROR_MKDIRAT,
+        .fds = fds,
+        .path = path,
+        .mode = mode,
+    };
+    int res = mirror_simple(&call);
+    if (res == 0) {
+        xattr_created(fds, path);
+    }
+    return res;
+}
+
+int mirror_unlink(const int *fds, const char *path)
+{
+    struct mirror_call call = {
+        .op = MIRROR_UNLINKAT,
+        .fds = fds,
+        .path = path,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_rmdir(const int *fds, const char *path)
+{
+    struct mirror_call call = {
+        .op = MIRROR_UNLINKAT,
+        .fds = fds,
+        .path = path,
+        .flags = AT_REMOVEDIR,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_symlink(const char *from, const int *fds, const char *to)
+{
+    struct mirror_call call = {
+        .op = MIRROR_SYMLINKAT,
+        .fds = fds,
+        .path = to,
+        .path2 = from,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_rename(const int *fds, const char *from, const int *tofds, const char *to)
+{
+    struct mirror_call call = {
+        .op = MIRROR_RENAMEAT,
+        .fds = fds,
+        .path = from,
+        .fds2 = tofds,
+        .path2 = to,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_link(const int *fds, const char *from, const int *tofds, const char *to)
+{
+    struct mirror_call call = {
+        .op = MIRROR_LINKAT,
+        .fds = fds,
+        .path = from,
+        .fds2 = tofds,
+        .path2 = to,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_chmod(const int *fds, const char *path, mode_t mode)
+{
+    struct mirror_call call = {
+        .op = MIRROR_FCHMODAT,
+        .fds = fds,
+        .path = path,
+        .mode = mode,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_chown(const int *fds, const char *path, uid_t uid, gid_t gid)
+{
+    struct mirror_call call = {
+        .op = MIRROR_FCHOWNAT,
+        .fds = fds,
+        .path = path,
+        .uid = uid,
+        .gid = gid,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_utimens(const int *fds, const char *path, const struct timespec ts[2])
+{
+    struct mirror_call call = {
+        .op = MIRROR_UTIMENSAT,
+        .fds = fds,
+        .path = path,
+        .ts = ts,
+        .flags = AT_SYMLINK_NOFOLLOW,
+    };
+    return mirror_simple(&call);
+}
+
+static void verify_open(struct mirror_call *call)
+{
+    for (int i = 1; i < mntpath_count; i++) {
+        CHECK_CONSISTENT_FD(i, call->res[0], call->res[i]);
+        CHECK_EQUAL(i, call->errnos[0], call->errnos[i]);
+    }
+
+    // Nothing takes over replica descriptors when the open failed on the
+    // primary, or failed for the caller after the primary had succeeded.
+    if (call->res[0] == -1 || call->newfds == NULL) {
+        for (int i = 1; i < mntpath_count; i++) {
+            if (call->res[i] != -1) {
+                close(call->res[i]);
+            }
+        }
+    }
+}
+
+int mirror_openat(const int *fds, const char *path, int flags, mode_t mode,
+                  int newfds[MAX_MNTPATHS])
+{
+    struct mirror_call call = {
+        .op = MIRROR_OPENAT,
+        .fds = fds,
+        .path = path,
+        .flags = flags,
+        .mode = mode,
+        .newfds = newfds,
+    };
+    mirror_call_run(&call);
+    verify_open(&call);
+
+    if (divergence_take()) {
+        for (int i = 0; i < mntpath_count; i++) {
+            if (call.res[i] != -1) {
+                close(call.res[i]);
+            }
+        }
+        return -EIO;
+    }
+    if (call.res[0] == -1) {
+        return -call.errnos[0];
+    }
+    if (flags & O_CREAT) {
+        xattr_created(newfds, NULL);
+    }
+    return 0;
+}
+
+// Open on the primary and hand the handle out before the other replicas have
+// opened the file.  Their descriptors land in the handle when their queued
+// openat runs, which is before anything queued later on the handle.
+static int mirror_open_shadow(const int *fds, const char *path, int flags,
+                              mode_t mode, uint64_t *fh)
+{
+    struct mirror_call call = {
+        .op = MIRROR_OPENAT,
+        .fds = fds,
+        .path = path,
+        .flags = flags,
+        .mode = mode,
+    };
+    struct shadow_order order;
+    int res;
+
+    shadow_order_begin(&call, &order);
+    mirror_call_exec(&call, 0);
+    res = call.res[0] == -1 ? -call.errnos[0] : handle_alloc(fh);
+    if (call.res[0] != -1) {
+        if (flags & O_CREAT) {
+            int fd = call.res[0];
+            xattr_created(&fd, NULL);
+        }
+        if (res == 0) {
+            struct mirror_handle *h = handle_get(*fh);
+            h->fds[0] = call.res[0];
+            for (int i = 1; i < mntpath_count; i++) {
+                h->fds[i] = -1;
+            }
+            h->read_bytes = 0;
+            h->wb = NULL;
+            call.newfds = h->fds;
+        } else {
+            close(call.res[0]);
+        }
+    }
+
+    shadow_submit(&call, verify_open);
+    shadow_order_end(&order);
+    // Writing out buffers takes the order lock, so the buffer is registered
+    // only once it is released.
+    if (res == 0) {
+        coalesce_open(handle_get(*fh), flags);
+    }
+    return res;
+}
+
+int mirror_open(const int *fds, const char *path, int flags, mode_t mode,
+                uint64_t *fh)
+{
+    int newfds[MAX_MNTPATHS];
+
+    // With writeback caching the kernel reads pages back to fill partial
+    // writes, even on files opened write-only, and handles O_APPEND itself.
+    if (options.writeback_cache) {
+        if ((flags & O_ACCMODE) == O_WRONLY) {
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        }
+        flags &= ~O_APPEND;
+    }
+
+    if (shadow_enabled()) {
+        return mirror_open_shadow(fds, path, flags, mode, fh);
+    }
+
+    int res = mirror_openat(fds, path, flags, mode, newfds);
+
+    if (res == 0) {
+        res = handle_open(fh, newfds);
+    }
+    if (res == 0) {
+        coalesce_open(handle_get(*fh), flags);
+    }
+    return res;
+}
+
+int mirror_read(const int *fds, char *buf, size_t size, off_t offset)
+{
+    struct mirror_call call = {
+        .op = MIRROR_PREAD,
+        .fds = fds,
+        .size = size,
+        .offset = offset,
+    };
+    if (bufpool_get(size, call.bufs) != 0) {
+        return -ENOMEM;
+    }
+    call.bufs[0] = buf;
+    mirror_call_shadow(&call, verify_data);
+
+    return (call.res[0] == -1) ? -call.errnos[0] : call.res[0];
+}
+
+static void verify_write(struct mirror_call *call)
+{
+    for (int i = 0; i < mntpath_count; i++) {
+        LOG_FUSE_DEBUG("pwrite to file %d returned %zd, errno=%d", i, call->res[i], call->errnos[i]);
+    }
+
+    COMPARE_RESULTS(*call);
+}
+
+int mirror_write(const int *fds, const char *buf, size_t size, off_t offset)
+{
+    struct mirror_call call = {
+        .op = MIRROR_PWRITE,
+        .fds = fds,
+        .wbuf = buf,
+        .size = size,
+        .offset = offset,
+    };
+    mirror_call_shadow(&call, verify_write);
+
+    return (call.res[0] == -1) ? -call.errnos[0] : call.res[0];
+}
+
+int mirror_truncate(const int *fds, const char *path, off_t size)
+{
+    struct mirror_call call = {
+        .op = MIRROR_TRUNCATE,
+        .fds = fds,
+        .path = path,
+        .offset = size,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_ftruncate(const int *fds, off_t size)
+{
+    struct mirror_call call = {
+        .op = MIRROR_FTRUNCATE,
+        .fds = fds,
+        .offset = size,
+    };
+    return mirror_simple(&call);
+}
+
+int mirror_fallocate(const int *fds, int mode, off_t offset, off_t length)
+{
+    struct mirror_call call = {
+        .op = MIRROR_FALLOCATE,
+        .fds = fds,
+        .flags = mode,
+        .offset = offset,
+        .size = length,
+    };
+    return mirror_simple(&call);
+}
+
+ssize_t mirror_copy_file_range(const int *fds_in, off_t offset_in, const int *fds_out,
+                               off_t offset_out, size_t size, int flags)
+{
+    struct mirror_call call = {
+        .op = MIRROR_COPY_FILE_RANGE,
+        .fds = fds_in,
+        .fds2 = fds_out,
+        .flags = flags,
+        .size = size,
+        .offset = offset_in,
+        .offset2 = offset_out,
+    };
+    mirror_call_shadow(&call, verify_results);
+
+    return (call.res[0] == -1) ? -call.errnos[0] : call.res[0];
+}
+
+// Replicas on different file systems may track holes at a different
+// granularity, which shows up here as a divergence.
+off_t mirror_lseek(const int *fds, off_t offset, int whence)
+{
+    struct mirror_call call = {
+        .op = MIRROR_LSEEK,
+        .fds = fds,
+        .flags = whence,
+        .offset = offset,
+    };
+    mirror_call_shadow(&call, verify_results);
+
+    return (call.res[0] == -1) ? -call.errnos[0] : call.res[0];
+}
+
+// The handle holds the descriptors queued calls still use, so it is only
+// freed once every replica has closed its own.
+static void verify_release(struct mirror_call *call)
+{
+    handle_free(call->fh);
+}
+
+int mirror_release(uint64_t fh)
+{
+    int res = coalesce_release(handle_get(fh));
+    struct mirror_call call = {
+        .op = MIRROR_CLOSE,
+        .fds = handle_get(fh)->fds,
+        .fh = fh,
+    };
+    mirror_call_shadow(&call, verify_release);
+    return res;
+}
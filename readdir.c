@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mirrorfs.h"
+
+// Directory listings shared by both front ends.  Every replica directory is
+// read once when it is opened, each listing is sorted by name and the sorted
+// listings are merged against the primary's, so replicas may return entries
+// in any order.  The primary's sorted listing then serves every readdir by
+// index, which is also the offset handed to the kernel.
+
+#define READDIR_BUF_SIZE (32 * 1024)
+
+struct dir_listing {
+    struct mirror_dirent *entries;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_len;
+    size_t names_capacity;
+};
+
+static void listing_free(struct dir_listing *l)
+{
+    free(l->entries);
+    free(l->names);
+    memset(l, 0, sizeof(*l));
+}
+
+static int listing_add(struct dir_listing *l, const struct dirent64 *de)
+{
+    size_t len = strlen(de->d_name) + 1;
+
+    if (l->count == l->capacity) {
+        size_t capacity = l->capacity ? 2 * l->capacity : 64;
+        struct mirror_dirent *entries = realloc(l->entries, capacity * sizeof(*entries));
+        if (entries == NULL) {
+            return -ENOMEM;
+        }
+        l->entries = entries;
+        l->capacity = capacity;
+    }
+    if (l->names_len + len > l->names_capacity) {
+        size_t capacity = l->names_capacity ? 2 * l->names_capacity : 4096;
+        while (capacity < l->names_len + len) {
+            capacity *= 2;
+        }
+        char *names = realloc(l->names, capacity);
+        if (names == NULL) {
+            return -ENOMEM;
+        }
+        l->names = names;
+        l->names_capacity = capacity;
+    }
+
+    struct mirror_dirent *e = &l->entries[l->count++];
+    e->name = l->names_len;
+    e->ino = de->d_ino;
+    e->type = de->d_type;
+    memcpy(l->names + l->names_len, de->d_name, len);
+    l->names_len += len;
+    return 0;
+}
+
+static int listing_cmp(const void *a, const void *b, void *names)
+{
+    const struct mirror_dirent *x = a;
+    const struct mirror_dirent *y = b;
+    return strcmp((const char *)names + x->name, (const char *)names + y->name);
+}
+
+// Read every replica's directory to the end, one getdents64 batch per
+// replica at a time.
+static int dir_read(struct mirror_dir *d, struct dir_listing lists[])
+{
+    struct mirror_call call = {
+        .op = MIRROR_GETDENTS,
+        .fds = d->fds,
+        .size = READDIR_BUF_SIZE,
+    };
+
+    for (int i = 0; i < mntpath_count; i++) {
+        if (lseek(d->fds[i], 0, SEEK_SET) == -1) {
+            return -errno;
+        }
+    }
+    if (bufpool_get(READDIR_BUF_SIZE, call.bufs) != 0) {
+        return -ENOMEM;
+    }
+
+    for (;;) {
+        int more = 0;
+
+        mirror_call_run(&call);
+
+        for (int i = 0; i < mntpath_count; i++) {
+            // Batch sizes legitimately differ between replicas; only the
+            // outcome must agree.
+            CHECK_EQUAL(i, call.errnos[0], call.errnos[i]);
+            if (call.res[i] == -1) {
+                if (i == 0) {
+                    return -call.errnos[0];
+                }
+                continue;
+            }
+            for (ssize_t pos = 0; pos < call.res[i]; ) {
+                const struct dirent64 *de = (const struct dirent64 *)((char *)call.bufs[i] + pos);
+                int res = listing_add(&lists[i], de);
+                if (res != 0) {
+                    return res;
+                }
+                pos += de->d_reclen;
+            }
+            more |= call.res[i] > 0;
+        }
+        if (!more) {
+            return 0;
+        }
+    }
+}
+
+static void report_entry(const char *func, int replica, const char *what,
+                         const char *name)
+{
+    fprintf(stderr, "%s: replica %d %s directory entry: %s\n", func, replica, what, name);
+    struct divergence d = {
+        .replica = replica,
+        .what = what,
+        .name = name,
+    };
+    divergence(func, &d);
+}
+
+// Merge replica i's sorted listing against the primary's.  File types are
+// only compared when both file systems report one.
+static void dir_compare(const struct dir_listing *p, const struct dir_listing *r, int i)
+{
+    size_t j = 0;
+    size_t k = 0;
+
+    while (j < p->count || k < r->count) {
+        const char *pn = j < p->count ? p->names + p->entries[j].name : NULL;
+        const char *rn = k < r->count ? r->names + r->entries[k].name : NULL;
+        int cmp = pn == NULL ? 1 : rn == NULL ? -1 : strcmp(pn, rn);
+
+        if (cmp < 0) {
+            report_entry(__func__, i, "lacks", pn);
+            j++;
+        } else if (cmp > 0) {
+            report_entry(__func__, i, "has extra", rn);
+            k++;
+        } else {
+            unsigned char pt = p->entries[j].type;
+            unsigned char rt = r->entries[k].type;
+            if (pt != DT_UNKNOWN && rt != DT_UNKNOWN && pt != rt) {
+                report_entry(__func__, i, "has a different type for", pn);
+            }
+            j++;
+            k++;
+        }
+    }
+}
+
+static int dir_load(struct mirror_dir *d)
+{
+    struct dir_listing lists[MAX_MNTPATHS];
+    int res;
+
+    memset(lists, 0, sizeof(lists));
+
+    res = dir_read(d, lists);
+    if (res == 0) {
+        for (int i = 0; i < mntpath_count; i++) {
+            qsort_r(lists[i].entries, lists[i].count, sizeof(struct mirror_dirent),
+                    listing_cmp, lists[i].names);
+        }
+        for (int i = 1; i < mntpath_count; i++) {
+            dir_compare(&lists[0], &lists[i], i);
+        }
+
+        free(d->entries);
+        free(d->names);
+        d->entries = lists[0].entries;
+        d->names = lists[0].names;
+        d->count = lists[0].count;
+        d->served = 0;
+        memset(&lists[0], 0, sizeof(lists[0]));
+    }
+    if (divergence_take()) {
+        res = -EIO;
+    }
+
+    for (int i = 0; i < mntpath_count; i++) {
+        listing_free(&lists[i]);
+    }
+    return res;
+}
+
+int mirror_opendir(const int *fds, const char *path, struct mirror_dir **dirp)
+{
+    struct mirror_dir *d = calloc(1, sizeof(*d));
+    if (d == NULL) {
+        return -ENOMEM;
+    }
+
+    int res = mirror_openat(fds, path, O_RDONLY | O_DIRECTORY, 0, d->fds);
+    if (res != 0) {
+        free(d);
+        return res;
+    }
+
+    res = dir_load(d);
+    if (res != 0) {
+        mirror_releasedir(d);
+        return res;
+    }
+
+    *dirp = d;
+    return 0;
+}
+
+int mirror_dir_seek(struct mirror_dir *d, off_t offset)
+{
+    // Reading from the start again, as after rewinddir(), picks up changes
+    // made since the directory was opened.
+    int res = 0;
+
+    if (offset == 0 && d->served) {
+        res = dir_load(d);
+    }
+    d->served = 1;
+    return res;
+}
+
+int mirror_fsyncdir(struct mirror_dir *d, int datasync)
+{
+    d->synced = 1;
+    return mirror_fsync(d->fds, datasync);
+}
+
+void mirror_releasedir(struct mirror_dir *d)
+{
+    // In async mode the replicas' syncs still use the descriptors.
+    if (d->synced && shadow_enabled()) {
+        shadow_drain();
+    }
+    for (int i = 0; i < mntpath_count; i++) {
+        close(d->fds[i]);
+    }
+    free(d->entries);
+    free(d->names);
+    free(d);
+}
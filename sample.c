@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "mirrorfs.h"
+
+// Sampled read verification.  By default every read is fetched from every
+// replica and compared.  With any of the verify_* options set, a read is
+// verified only when one of the configured policies selects it; the others
+// are served from the primary alone.  Writes and namespace operations always
+// go to every replica.
+
+static atomic_ulong read_count;
+static atomic_ulong reads_verified;
+static atomic_ulong bytes_verified;
+static atomic_ulong reads_skipped;
+static atomic_ulong bytes_skipped;
+
+static __thread uint64_t rng_state;
+
+// xorshift64*, seeded per thread; only needs to be cheap and well spread.
+static double random_unit(void)
+{
+    if (rng_state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        rng_state = ((uint64_t)ts.tv_nsec << 32) ^ (uint64_t)pthread_self() ^ ts.tv_sec;
+        rng_state |= 1;
+    }
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1dULL >> 11) * (1.0 / (1ULL << 53));
+}
+
+static int sampling_enabled(void)
+{
+    return options.verify_every > 0 || options.verify_probability > 0 ||
+           options.verify_bytes > 0;
+}
+
+int sample_read(struct mirror_handle *h, size_t size)
+{
+    int verify = !sampling_enabled();
+
+    if (!verify) {
+        if (options.verify_every > 0 &&
+            atomic_fetch_add_explicit(&read_count, 1, memory_order_relaxed) %
+                options.verify_every == 0) {
+            verify = 1;
+        }
+        if (options.verify_probability > 0 &&
+            random_unit() < options.verify_probability) {
+            verify = 1;
+        }
+        // Every read counts against the file's budget, but only reads that
+        // start within it are verified on its account.
+        if (options.verify_bytes > 0 && h != NULL) {
+            uint64_t before = __atomic_fetch_add(&h->read_bytes, size, __ATOMIC_RELAXED);
+            verify |= before < options.verify_bytes;
+        }
+    }
+
+    if (verify) {
+        atomic_fetch_add_explicit(&reads_verified, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytes_verified, size, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&reads_skipped, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytes_skipped, size, memory_order_relaxed);
+    }
+    return verify;
+}
+
+void sample_report(FILE *f)
+{
+    if (!sampling_enabled()) {
+        return;
+    }
+    fprintf(f, "sample: %lu reads verified (%lu bytes), %lu skipped (%lu bytes)\n",
+            atomic_load(&reads_verified), atomic_load(&bytes_verified),
+            atomic_load(&reads_skipped), atomic_load(&bytes_skipped));
+}
@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mirrorfs.h"
+
+// Shadow replicas.  With -o async the calling thread hands a call's other
+// replicas to a background executor and runs it on the primary only, so the
+// kernel gets its answer at the primary's latency.  Each replica has one
+// worker draining a FIFO queue, which applies the replica's calls in the
+// order they were issued, and therefore in order per file.  The last replica
+// to finish a call runs its verification.  Queues are bounded: a caller that
+// finds a replica's queue full waits for it, so a slow replica throttles the
+// mount instead of falling ever further behind.
+//
+// With -o quorum=K the caller additionally waits until K replicas, the
+// primary included, have returned the same result and data, so one slow
+// replica no longer sets the latency of every call while a lagging majority
+// still does.  The primary always counts towards the quorum since its result
+// is the one returned.  The other replicas are handed out first and the
+// primary runs on the calling thread meanwhile; each replica is compared once
+// both it and the primary have finished.  Concurrent calls must not wait for
+// each other, so quorum calls run through the fan-out worker pool rather than
+// the queues.
+// Only once a call has returned may a later one not overtake it: while a
+// returned call is still running on a replica, that replica's later calls go
+// through its queue, whose worker waits for the pool to catch up.
+//
+// Concurrent calls on one file must reach every replica in the order they
+// ran on the primary, or overlapping writes, or a write and a truncate,
+// leave the replicas different.  A lock striped by the primary's inode, as
+// sync.c groups syncs, is held from running a call on the primary until it
+// has been handed to the other replicas, or with a quorum until it returns.
+// Calls that leave the file as it is share the lock.
+
+#define SHADOW_DEFAULT_DEPTH 256
+#define SHADOW_STRIPES 64
+
+struct shadow_call;
+
+struct shadow_task {
+    struct shadow_call *sc;
+    int replica;
+    struct shadow_task *next;
+    // Quorum calls run through the pool.  The flags are guarded by the
+    // replica's queue lock.
+    struct fanout_task fanout;
+    int pooled;
+    int finished;
+    int lagging;              // counted in the queue's lagging
+    atomic_int ran;           // the replica has run the call
+    atomic_int settled;       // counted towards the quorum
+};
+
+// Heap copy of a call, owning everything the caller's copy pointed into
+// except the descriptor arrays, which must outlive the call.
+struct shadow_call {
+    struct mirror_call call;
+    mirror_verify_fn verify;
+    atomic_int pending;
+    atomic_int agreed;        // replicas matching the primary so far
+    int needed;               // matches the caller waits for
+    atomic_int released;      // the caller was woken
+    atomic_int primary_ran;   // the primary's results are in call
+    sem_t *waiter;            // posted once the quorum is reached
+    char *path;
+    char *path2;
+    void *data;               // write source or read destinations
+    struct timespec ts[2];
+    struct statx stxs[MAX_MNTPATHS];
+    struct shadow_task tasks[MAX_MNTPATHS];
+};
+
+struct shadow_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;     // a task was queued, or the queue is stopping
+    pthread_cond_t space;     // depth dropped below the limit
+    pthread_cond_t caught_up; // lagging dropped to zero
+    struct shadow_task *head;
+    struct shadow_task *tail;
+    unsigned depth;
+    unsigned max_depth;
+    unsigned long waits;      // submissions that found the queue full
+    unsigned lagging;         // pooled tasks of calls that have returned
+    int stopping;
+    pthread_t thread;
+};
+
+static struct shadow_queue queues[MAX_MNTPATHS];
+static unsigned queue_limit;
+static int shadow_running;
+static pthread_rwlock_t stripes[SHADOW_STRIPES];
+
+// Calls submitted but not yet verified, for shadow_drain().
+static pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shadow_idle = PTHREAD_COND_INITIALIZER;
+static unsigned long outstanding;
+static unsigned long submitted;
+
+// Replicas besides the primary that must agree before a call returns.
+static int quorum_needed(void)
+{
+    int k = options.quorum < 0 ? mntpath_count / 2 + 1 : options.quorum;
+
+    if (k > mntpath_count) {
+        k = mntpath_count;
+    }
+    return k > 1 ? k - 1 : 0;
+}
+
+int shadow_enabled(void)
+{
+    return shadow_running;
+}
+
+static void shadow_call_free(struct shadow_call *sc)
+{
+    free(sc->path);
+    free(sc->path2);
+    free(sc->data);
+    free(sc);
+}
+
+static void shadow_complete(struct shadow_call *sc)
+{
+    journal_call(&sc->call);
+    sc->verify(&sc->call);
+    // The operation has long returned, so there is nothing left to fail.
+    divergence_take();
+    shadow_call_free(sc);
+
+    pthread_mutex_lock(&shadow_lock);
+    if (--outstanding == 0) {
+        pthread_cond_broadcast(&shadow_idle);
+    }
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+// Wake the caller waiting for sc's quorum, unless that already happened.
+// Replicas still running the call hold back the calls that follow it.
+static void shadow_release(struct shadow_call *sc)
+{
+    if (atomic_exchange(&sc->released, 1) != 0) {
+        return;
+    }
+    for (int i = 1; i < mntpath_count; i++) {
+        struct shadow_task *task = &sc->tasks[i];
+        struct shadow_queue *q = &queues[i];
+        pthread_mutex_lock(&q->lock);
+        if (task->pooled && !task->finished && !task->lagging) {
+            task->lagging = 1;
+            q->lagging++;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    sem_post(sc->waiter);
+}
+
+// Whether replica i returned what the primary did.  Data the verification
+// compares counts too; lists of attribute names are compared in order, so a
+// replica listing them differently merely does not count.
+static int shadow_agrees(const struct mirror_call *call, int i)
+{
+    if (call->res[i] != call->res[0] || call->errnos[i] != call->errnos[0]) {
+        return 0;
+    }
+    if (call->res[0] == -1) {
+        return 1;
+    }
+    switch (call->op) {
+        case MIRROR_STATX:
+            return stats_agree(&call->stxs[0], &call->stxs[i]);
+        case MIRROR_PREAD:
+        case MIRROR_READLINKAT:
+        case MIRROR_GETXATTR:
+        case MIRROR_LISTXATTR:
+            return call->size == 0 || memcmp(call->bufs[0], call->bufs[i], call->res[0]) == 0;
+        default:
+            return 1;
+    }
+}
+
+// Count replica i's result towards the quorum, once.
+static void shadow_settle(struct shadow_call *sc, int i)
+{
+    if (atomic_exchange(&sc->tasks[i].settled, 1) != 0) {
+        return;
+    }
+    if (shadow_agrees(&sc->call, i) &&
+        atomic_fetch_add_explicit(&sc->agreed, 1, memory_order_relaxed) + 1 >= sc->needed) {
+        shadow_release(sc);
+    }
+}
+
+// Replica i, possibly the primary, has run sc.  Only the last replica to
+// finish may touch sc after this.
+static void shadow_finish(struct shadow_call *sc, int i)
+{
+    // Whichever of a replica and the primary finishes last compares them.
+    if (sc->waiter != NULL && i == 0) {
+        atomic_store(&sc->primary_ran, 1);
+        for (int j = 1; j < mntpath_count; j++) {
+            if (atomic_load(&sc->tasks[j].ran)) {
+                shadow_settle(sc, j);
+            }
+        }
+    } else if (sc->waiter != NULL) {
+        atomic_store(&sc->tasks[i].ran, 1);
+        if (atomic_load(&sc->primary_ran)) {
+            shadow_settle(sc, i);
+        }
+    }
+    if (atomic_fetch_sub_explicit(&sc->pending, 1, memory_order_acq_rel) == 1) {
+        // Without a quorum the caller still has to return eventually.
+        if (sc->waiter != NULL) {
+            shadow_release(sc);
+        }
+        if (mntpath_count > 2) {
+            stats_straggler(sc->call.op, i);
+        }
+        shadow_complete(sc);
+    }
+}
+
+// A pooled task has run.
+static void shadow_pool_done(void *arg, int i)
+{
+    struct shadow_call *sc = arg;
+    struct shadow_task *task = &sc->tasks[i];
+    struct shadow_queue *q = &queues[i];
+
+    pthread_mutex_lock(&q->lock);
+    task->finished = 1;
+    if (task->lagging && --q->lagging == 0) {
+        pthread_cond_broadcast(&q->caught_up);
+    }
+    pthread_mutex_unlock(&q->lock);
+    shadow_finish(sc, i);
+}
+
+static void *shadow_worker(void *arg)
+{
+    struct shadow_queue *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->head == NULL && !q->stopping) {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        if (q->head == NULL) {
+            break;
+        }
+        struct shadow_task *task = q->head;
+        while (q->lagging > 0) {
+            pthread_cond_wait(&q->caught_up, &q->lock);
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        // The task stays queued, and counted, until it has run, so that a
+        // full queue really means that many calls are pending.
+        struct shadow_call *sc = task->sc;
+        mirror_call_exec(&sc->call, task->replica);
+
+        pthread_mutex_lock(&q->lock);
+        q->head = task->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        if (q->depth-- == queue_limit) {
+            pthread_cond_broadcast(&q->space);
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        shadow_finish(sc, task->replica);
+
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static void *memdup(const void *p, size_t size)
+{
+    void *copy = malloc(size ? size : 1);
+    if (copy != NULL) {
+        memcpy(copy, p, size);
+    }
+    return copy;
+}
+
+// Copy call and everything it refers to, but not yet the primary's results.
+static struct shadow_call *shadow_call_copy(const struct mirror_call *call,
+                                            mirror_verify_fn verify)
+{
+    struct shadow_call *sc = calloc(1, sizeof(*sc));
+    if (sc == NULL) {
+        return NULL;
+    }
+    sc->call = *call;
+    sc->verify = verify;
+
+    if (call->path != NULL) {
+        sc->path = strdup(call->path);
+        if (sc->path == NULL) {
+            goto fail;
+        }
+        sc->call.path = sc->path;
+    }
+    if (call->path2 != NULL) {
+        sc->path2 = strdup(call->path2);
+        if (sc->path2 == NULL) {
+            goto fail;
+        }
+        sc->call.path2 = sc->path2;
+    }
+    if (call->ts != NULL) {
+        memcpy(sc->ts, call->ts, sizeof(sc->ts));
+        sc->call.ts = sc->ts;
+    }
+    if (call->stxs != NULL) {
+        sc->call.stxs = sc->stxs;
+    }
+
+    switch (call->op) {
+        case MIRROR_PWRITE:
+        case MIRROR_SETXATTR:
+            sc->data = memdup(call->wbuf, call->size);
+            if (sc->data == NULL) {
+                goto fail;
+            }
+            sc->call.wbuf = sc->data;
+            break;
+        case MIRROR_PREAD:
+        case MIRROR_READLINKAT:
+        case MIRROR_GETXATTR:
+        case MIRROR_LISTXATTR:
+            // The primary's data is kept for the comparison, and every other
+            // replica reads into a buffer of its own.
+            sc->data = malloc(mntpath_count * call->size);
+            if (sc->data == NULL) {
+                goto fail;
+            }
+            for (int i = 0; i < mntpath_count; i++) {
+                sc->call.bufs[i] = (char *)sc->data + i * call->size;
+            }
+            break;
+        default:
+            break;
+    }
+    return sc;
+
+fail:
+    shadow_call_free(sc);
+    return NULL;
+}
+
+// Copy the primary's results from call, which has run on it.
+static void shadow_call_primary(struct shadow_call *sc, const struct mirror_call *call)
+{
+    sc->call.res[0] = call->res[0];
+    sc->call.errnos[0] = call->errnos[0];
+    sc->call.nsecs[0] = call->nsecs[0];
+    if (call->stxs != NULL) {
+        sc->stxs[0] = call->stxs[0];
+    }
+    switch (call->op) {
+        case MIRROR_PREAD:
+        case MIRROR_READLINKAT:
+        case MIRROR_GETXATTR:
+        case MIRROR_LISTXATTR:
+            if (call->res[0] > 0) {
+                memcpy(sc->call.bufs[0], call->bufs[0], call->res[0]);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void shadow_enqueue(struct shadow_queue *q, struct shadow_task *task)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->depth >= queue_limit) {
+        q->waits++;
+        do {
+            pthread_cond_wait(&q->space, &q->lock);
+        } while (q->depth >= queue_limit);
+    }
+    task->next = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = task;
+    } else {
+        q->head = task;
+    }
+    q->tail = task;
+    if (++q->depth > q->max_depth) {
+        q->max_depth = q->depth;
+    }
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Run a quorum call's task through the pool, unless the replica is still
+// busy with calls that have returned.  Returns -1 if it has to be queued.
+static int shadow_pool(struct shadow_task *task)
+{
+    struct shadow_call *sc = task->sc;
+    struct shadow_queue *q = &queues[task->replica];
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head != NULL || q->lagging > 0) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    task->pooled = 1;
+    // The other replicas may have agreed before this one was submitted.
+    if (atomic_load(&sc->released)) {
+        task->lagging = 1;
+        q->lagging++;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    task->fanout.call = &sc->call;
+    task->fanout.replica = task->replica;
+    task->fanout.done = shadow_pool_done;
+    task->fanout.arg = sc;
+    if (fanout_queue(&task->fanout) != 0) {
+        pthread_mutex_lock(&q->lock);
+        task->pooled = 0;
+        if (task->lagging) {
+            task->lagging = 0;
+            if (--q->lagging == 0) {
+                pthread_cond_broadcast(&q->caught_up);
+            }
+        }
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    return 0;
+}
+
+// Hand call to the other replicas, then run it on the primary unless it
+// already ran there.
+static void shadow_dispatch(struct mirror_call *call, mirror_verify_fn verify, int ran)
+{
+    if (mntpath_count == 1) {
+        if (!ran) {
+            mirror_call_exec(call, 0);
+        }
+        verify(call);
+        return;
+    }
+
+    struct shadow_call *sc = shadow_call_copy(call, verify);
+    if (sc == NULL) {
+        // Finish the call in place, after everything queued before it.
+        if (!ran) {
+            mirror_call_exec(call, 0);
+        }
+        shadow_drain();
+        for (int i = 1; i < mntpath_count; i++) {
+            mirror_call_exec(call, i);
+        }
+        journal_call(call);
+        verify(call);
+        divergence_take();
+        return;
+    }
+    atomic_init(&sc->pending, ran ? mntpath_count - 1 : mntpath_count);
+    atomic_init(&sc->agreed, 0);
+    atomic_init(&sc->released, 0);
+    atomic_init(&sc->primary_ran, ran);
+    if (ran) {
+        shadow_call_primary(sc, call);
+    }
+
+    sem_t waiter;
+    int needed = quorum_needed();
+    sc->needed = needed;
+    if (needed > 0) {
+        sem_init(&waiter, 0, 0);
+        sc->waiter = &waiter;
+    }
+
+    pthread_mutex_lock(&shadow_lock);
+    outstanding++;
+    submitted++;
+    pthread_mutex_unlock(&shadow_lock);
+
+    for (int i = 1; i < mntpath_count; i++) {
+        struct shadow_task *task = &sc->tasks[i];
+        task->sc = sc;
+        task->replica = i;
+        if (needed > 0 && !options.async && shadow_pool(task) == 0) {
+            continue;
+        }
+        shadow_enqueue(&queues[i], task);
+    }
+
+    // The caller's copy of the call gets the primary's results, and sc a
+    // copy of them, before the primary counts as finished.
+    if (!ran) {
+        mirror_call_exec(call, 0);
+        shadow_call_primary(sc, call);
+        shadow_finish(sc, 0);
+    }
+
+    // sc may already be gone.
+    if (needed > 0) {
+        while (sem_wait(&waiter) == -1 && errno == EINTR) {
+        }
+        sem_destroy(&waiter);
+    }
+}
+
+void shadow_submit(struct mirror_call *call, mirror_verify_fn verify)
+{
+    shadow_dispatch(call, verify, 1);
+}
+
+// The stripe of the file path names relative to dirfd, or of dirfd itself
+// when path is NULL.  Names that do not exist yet take their directory's.
+static int shadow_stripe(int dirfd, const char *path)
+{
+    struct stat st;
+
+    if (path == NULL || fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        if (fstat(dirfd, &st) == -1) {
+            return 0;
+        }
+    }
+    return st.st_ino % SHADOW_STRIPES;
+}
+
+static int shadow_shared(const struct mirror_call *call)
+{
+    switch (call->op) {
+        case MIRROR_STATX:
+        case MIRROR_FACCESSAT:
+        case MIRROR_READLINKAT:
+        case MIRROR_PREAD:
+        case MIRROR_CLOSE:
+        case MIRROR_GETDENTS:
+        case MIRROR_FSYNC:
+        case MIRROR_FLUSH:
+        case MIRROR_LSEEK:
+        case MIRROR_GETXATTR:
+        case MIRROR_LISTXATTR:
+            return 1;
+        case MIRROR_OPENAT:
+            return !(call->flags & (O_CREAT | O_TRUNC));
+        default:
+            return 0;
+    }
+}
+
+void shadow_order_begin(const struct mirror_call *call, struct shadow_order *order)
+{
+    int first = shadow_stripe(call->fds[0], call->path);
+    int second = first;
+
+    switch (call->op) {
+        case MIRROR_RENAMEAT:
+        case MIRROR_LINKAT:
+            second = shadow_stripe(call->fds2[0], call->path2);
+            break;
+        case MIRROR_COPY_FILE_RANGE:
+            second = shadow_stripe(call->fds2[0], NULL);
+            break;
+        default:
+            break;
+    }
+    // Stripes are taken in ascending order.
+    order->stripes[0] = first < second ? first : second;
+    order->stripes[1] = first < second ? second : first;
+    order->count = first == second ? 1 : 2;
+    order->shared = shadow_shared(call);
+    for (int i = 0; i < order->count; i++) {
+        if (order->shared) {
+            pthread_rwlock_rdlock(&stripes[order->stripes[i]]);
+        } else {
+            pthread_rwlock_wrlock(&stripes[order->stripes[i]]);
+        }
+    }
+}
+
+void shadow_order_end(struct shadow_order *order)
+{
+    for (int i = order->count - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&stripes[order->stripes[i]]);
+    }
+}
+
+void mirror_call_shadow(struct mirror_call *call, mirror_verify_fn verify)
+{
+    if (!shadow_running) {
+        mirror_call_run(call);
+        verify(call);
+        if (divergence_take()) {
+            call->res[0] = -1;
+            call->errnos[0] = EIO;
+        }
+        return;
+    }
+
+    struct shadow_order order;
+    shadow_order_begin(call, &order);
+    shadow_dispatch(call, verify, 0);
+    shadow_order_end(&order);
+}
+
+void shadow_drain(void)
+{
+    pthread_mutex_lock(&shadow_lock);
+    while (outstanding > 0) {
+        pthread_cond_wait(&shadow_idle, &shadow_lock);
+    }
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+// Like the fan-out workers these threads must be started after fuse has
+// daemonized.
+int shadow_start(void)
+{
+    if ((!options.async && options.quorum == 0) || mntpath_count < 2) {
+        return 0;
+    }
+
+    // Writers are preferred, so that a stream of reads cannot hold off a
+    // write to the same file.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < SHADOW_STRIPES; i++) {
+        pthread_rwlock_init(&stripes[i], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+
+    queue_limit = options.async_depth ? options.async_depth : SHADOW_DEFAULT_DEPTH;
+    for (int i = 1; i < mntpath_count; i++) {
+        struct shadow_queue *q = &queues[i];
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->ready, NULL);
+        pthread_cond_init(&q->space, NULL);
+        pthread_cond_init(&q->caught_up, NULL);
+        int err = pthread_create(&q->thread, NULL, shadow_worker, q);
+        if (err != 0) {
+            fprintf(stderr, "shadow: could not start worker for replica %d: %s\n",
+                    i, strerror(err));
+            for (int j = 1; j < i; j++) {
+                pthread_mutex_lock(&queues[j].lock);
+                queues[j].stopping = 1;
+                pthread_cond_signal(&queues[j].ready);
+                pthread_mutex_unlock(&queues[j].lock);
+                pthread_join(queues[j].thread, NULL);
+            }
+            return -err;
+        }
+    }
+    shadow_running = 1;
+    return 0;
+}
+
+// Verify everything still queued, then stop the workers.
+void shadow_stop(void)
+{
+    if (!shadow_running) {
+        return;
+    }
+
+    shadow_drain();
+    shadow_running = 0;
+    for (int i = 1; i < mntpath_count; i++) {
+        struct shadow_queue *q = &queues[i];
+        pthread_mutex_lock(&q->lock);
+        q->stopping = 1;
+        pthread_cond_signal(&q->ready);
+        pthread_mutex_unlock(&q->lock);
+        pthread_join(q->thread, NULL);
+    }
+}
+
+// Also called while the file system runs, for the stats file.
+void shadow_report(FILE *f)
+{
+    pthread_mutex_lock(&shadow_lock);
+    unsigned long calls = submitted;
+    pthread_mutex_unlock(&shadow_lock);
+    if (calls == 0) {
+        return;
+    }
+
+    fprintf(f, "shadow: %lu calls verified in the background\n", calls);
+    for (int i = 1; i < mntpath_count; i++) {
+        struct shadow_queue *q = &queues[i];
+        pthread_mutex_lock(&q->lock);
+        fprintf(f, "shadow: replica %d: queue at %u, peaked at %u of %u, full %lu times\n",
+                i, q->depth, q->max_depth, queue_limit, q->waits);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
@@ -0,0 +1,185 @@
+#define FUSE_USE_VERSION 312
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_common.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mirrorfs.h"
+
+// Zero-copy writes.  When the kernel hands write data over in a pipe, each
+// replica but the primary gets a tee() of it in a pipe of its own, and every
+// pipe is then spliced into its replica's file, so the data is never copied
+// through user space.
+
+// Per-thread pipes for replicas 1 and up, grown to hold the largest write.
+struct splice_pipes {
+    int rd[MAX_MNTPATHS];
+    int wr[MAX_MNTPATHS];
+    size_t size;
+};
+
+static pthread_once_t pipes_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pipes_key;
+static __thread struct splice_pipes *thread_pipes;
+
+static void pipes_close(struct splice_pipes *p)
+{
+    for (int i = 1; i < mntpath_count; i++) {
+        if (p->rd[i] != -1) {
+            close(p->rd[i]);
+            close(p->wr[i]);
+        }
+        p->rd[i] = p->wr[i] = -1;
+    }
+    p->size = 0;
+}
+
+static void pipes_free(void *arg)
+{
+    pipes_close(arg);
+    free(arg);
+}
+
+static void pipes_key_create(void)
+{
+    pthread_key_create(&pipes_key, pipes_free);
+}
+
+static struct splice_pipes *pipes_get(size_t size)
+{
+    struct splice_pipes *p = thread_pipes;
+
+    if (p == NULL) {
+        p = malloc(sizeof(*p));
+        if (p == NULL) {
+            return NULL;
+        }
+        memset(p->rd, -1, sizeof(p->rd));
+        memset(p->wr, -1, sizeof(p->wr));
+        p->size = 0;
+        pthread_once(&pipes_once, pipes_key_create);
+        pthread_setspecific(pipes_key, p);
+        thread_pipes = p;
+    }
+    if (size <= p->size) {
+        return p;
+    }
+
+    pipes_close(p);
+    for (int i = 1; i < mntpath_count; i++) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            pipes_close(p);
+            return NULL;
+        }
+        p->rd[i] = fds[0];
+        p->wr[i] = fds[1];
+        if (fcntl(fds[1], F_SETPIPE_SZ, size) < (long)size) {
+            pipes_close(p);
+            return NULL;
+        }
+    }
+    p->size = size;
+    return p;
+}
+
+// Splice size bytes from pipefd, which is consumed, into every replica.
+// Returns -ENOSYS without having consumed anything if the data cannot be
+// duplicated.
+static int mirror_write_pipe(const int *fds, int pipefd, size_t size, off_t offset)
+{
+    struct splice_pipes *p = pipes_get(size);
+    if (p == NULL) {
+        return -ENOSYS;
+    }
+
+    int pipes[MAX_MNTPATHS];
+    pipes[0] = pipefd;
+    for (int i = 1; i < mntpath_count; i++) {
+        ssize_t n = tee(pipefd, p->wr[i], size, 0);
+        if (n != (ssize_t)size) {
+            // Throw away what was duplicated so far.
+            pipes_close(p);
+            return -ENOSYS;
+        }
+        pipes[i] = p->rd[i];
+    }
+
+    struct mirror_call call = {
+        .op = MIRROR_SPLICE,
+        .fds = fds,
+        .pipes = pipes,
+        .size = size,
+        .offset = offset,
+    };
+    mirror_call_run(&call);
+
+    int drained = 1;
+    for (int i = 0; i < mntpath_count; i++) {
+        LOG_FUSE_DEBUG("splice to file %d returned %zd, errno=%d", i, call.res[i], call.errnos[i]);
+        drained &= call.res[i] == (ssize_t)size;
+    }
+    // Short writes leave data behind that the next write must not see.
+    if (!drained) {
+        pipes_close(p);
+    }
+
+    for (int i = 1; i < mntpath_count; i++) {
+        CHECK_EQUAL(i, call.res[0], call.res[i]);
+        CHECK_EQUAL(i, call.errnos[0], call.errnos[i]);
+    }
+
+    if (divergence_take()) {
+        return -EIO;
+    }
+
+    // Files opened with O_APPEND, among others, cannot be spliced into.  The
+    // data is still in pipefd for the caller to copy.
+    if (call.res[0] == -1 && call.errnos[0] == EINVAL) {
+        return -ENOSYS;
+    }
+
+    return (call.res[0] == -1) ? -call.errnos[0] : call.res[0];
+}
+
+int mirror_write_buf(const int *fds, struct fuse_bufvec *buf, off_t offset)
+{
+    size_t size = fuse_buf_size(buf);
+    struct fuse_buf *src = &buf->buf[0];
+
+    if (buf->count == 1 && buf->idx == 0 && buf->off == 0) {
+        // Queued replicas need a copy of the data rather than a pipe.
+        if ((src->flags & (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK)) == FUSE_BUF_IS_FD &&
+            !shadow_enabled()) {
+            int res = mirror_write_pipe(fds, src->fd, size, offset);
+            if (res != -ENOSYS) {
+                // Tell libfuse the pipe was drained so it can reuse it.
+                if (res == (int)size) {
+                    buf->idx = buf->count;
+                }
+                return res;
+            }
+        } else if (!(src->flags & FUSE_BUF_IS_FD)) {
+            return mirror_write(fds, src->mem, size, offset);
+        }
+    }
+
+    // Anything else is copied into scratch memory first.
+    void *bufs[MAX_MNTPATHS];
+    if (bufpool_get(size, bufs) != 0) {
+        return -ENOMEM;
+    }
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = bufs[0];
+    ssize_t n = fuse_buf_copy(&dst, buf, 0);
+    if (n < 0) {
+        return n;
+    }
+    return mirror_write(fds, bufs[0], n, offset);
+}
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mirrorfs.h"
+
+// Latency histograms and counters.  Every thread records into a block of its
+// own, so the hot path is a few relaxed loads and stores with no sharing;
+// blocks are linked into a global list and summed when the stats are read,
+// and folded into the retired totals when their thread exits.
+
+// Log-linear buckets: values below STATS_SUBS nanoseconds get a bucket each,
+// every power of two above is split into STATS_SUBS equal parts, so a bucket
+// is at most a quarter of its value wide.
+#define STATS_SUB_BITS 2
+#define STATS_SUBS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUBS)
+
+struct stats_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_counters {
+    struct stats_hist handlers[STATS_HANDLER_COUNT];
+    struct stats_hist replicas[MIRROR_OP_COUNT][MAX_MNTPATHS];
+    uint64_t errors[MIRROR_OP_COUNT][MAX_MNTPATHS];
+    uint64_t stragglers[MIRROR_OP_COUNT][MAX_MNTPATHS];
+    uint64_t bytes_read[MAX_MNTPATHS];
+    uint64_t bytes_written[MAX_MNTPATHS];
+    uint64_t compares;
+    uint64_t compare_bytes;
+    uint64_t compare_nsecs;
+};
+
+struct stats_thread {
+    struct stats_counters c;
+    struct stats_thread *prev;
+    struct stats_thread *next;
+};
+
+static const char *const handler_names[STATS_HANDLER_COUNT] = {
+    [STATS_LOOKUP] = "lookup",
+    [STATS_GETATTR] = "getattr",
+    [STATS_SETATTR] = "setattr",
+    [STATS_ACCESS] = "access",
+    [STATS_READLINK] = "readlink",
+    [STATS_OPENDIR] = "opendir",
+    [STATS_READDIR] = "readdir",
+    [STATS_RELEASEDIR] = "releasedir",
+    [STATS_MKDIR] = "mkdir",
+    [STATS_UNLINK] = "unlink",
+    [STATS_RMDIR] = "rmdir",
+    [STATS_SYMLINK] = "symlink",
+    [STATS_RENAME] = "rename",
+    [STATS_LINK] = "link",
+    [STATS_CHMOD] = "chmod",
+    [STATS_CHOWN] = "chown",
+    [STATS_TRUNCATE] = "truncate",
+    [STATS_UTIMENS] = "utimens",
+    [STATS_CREATE] = "create",
+    [STATS_OPEN] = "open",
+    [STATS_READ] = "read",
+    [STATS_WRITE] = "write",
+    [STATS_FLUSH] = "flush",
+    [STATS_RELEASE] = "release",
+    [STATS_FSYNC] = "fsync",
+    [STATS_FSYNCDIR] = "fsyncdir",
+    [STATS_FALLOCATE] = "fallocate",
+    [STATS_COPY_FILE_RANGE] = "copy_file_range",
+    [STATS_LSEEK] = "lseek",
+    [STATS_SETXATTR] = "setxattr",
+    [STATS_GETXATTR] = "getxattr",
+    [STATS_LISTXATTR] = "listxattr",
+    [STATS_REMOVEXATTR] = "removexattr",
+};
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static __thread struct stats_thread *thread_stats;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *threads;
+static struct stats_counters retired;
+
+static void counter_add(uint64_t *counter, uint64_t n)
+{
+    // Only the owning thread writes, so a relaxed load/store pair suffices.
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static uint64_t counter_get(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void counters_merge(struct stats_counters *dst, const struct stats_counters *src)
+{
+    const uint64_t *s = (const uint64_t *)src;
+    uint64_t *d = (uint64_t *)dst;
+
+    for (size_t n = 0; n < sizeof(*src) / sizeof(uint64_t); n++) {
+        d[n] += counter_get(&s[n]);
+    }
+}
+
+static void stats_thread_free(void *arg)
+{
+    struct stats_thread *t = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        threads = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    counters_merge(&retired, &t->c);
+    pthread_mutex_unlock(&stats_lock);
+
+    free(t);
+}
+
+static void stats_key_create(void)
+{
+    pthread_key_create(&stats_key, stats_thread_free);
+}
+
+// The calling thread's counters, or NULL if they could not be allocated, in
+// which case its events go uncounted.
+static struct stats_counters *stats_get(void)
+{
+    struct stats_thread *t = thread_stats;
+
+    if (t != NULL) {
+        return &t->c;
+    }
+    t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    pthread_once(&stats_once, stats_key_create);
+    pthread_setspecific(stats_key, t);
+
+    pthread_mutex_lock(&stats_lock);
+    t->next = threads;
+    if (threads != NULL) {
+        threads->prev = t;
+    }
+    threads = t;
+    pthread_mutex_unlock(&stats_lock);
+
+    thread_stats = t;
+    return &t->c;
+}
+
+static unsigned bucket_index(uint64_t v)
+{
+    if (v < STATS_SUBS) {
+        return v;
+    }
+    unsigned e = 63 - __builtin_clzll(v);
+    unsigned sub = (v >> (e - STATS_SUB_BITS)) & (STATS_SUBS - 1);
+    return (e - STATS_SUB_BITS + 1) * STATS_SUBS + sub;
+}
+
+// Largest value that falls into bucket b.
+static uint64_t bucket_limit(unsigned b)
+{
+    if (b < STATS_SUBS) {
+        return b;
+    }
+    unsigned e = b / STATS_SUBS + STATS_SUB_BITS - 1;
+    uint64_t sub = b % STATS_SUBS;
+    return ((STATS_SUBS + sub + 1) << (e - STATS_SUB_BITS)) - 1;
+}
+
+static void hist_add(struct stats_hist *h, uint64_t nsecs)
+{
+    counter_add(&h->count, 1);
+    counter_add(&h->sum, nsecs);
+    counter_add(&h->buckets[bucket_index(nsecs)], 1);
+}
+
+void stats_handler(enum stats_handler handler, uint64_t nsecs)
+{
+    struct stats_counters *c = stats_get();
+    if (c != NULL) {
+        hist_add(&c->handlers[handler], nsecs);
+    }
+}
+
+void stats_exec(const struct mirror_call *call, int i)
+{
+    struct stats_counters *c = stats_get();
+    if (c == NULL) {
+        return;
+    }
+
+    hist_add(&c->replicas[call->op][i], call->nsecs[i]);
+    if (call->res[i] == -1) {
+        counter_add(&c->errors[call->op][i], 1);
+    } else if (call->op == MIRROR_PREAD) {
+        counter_add(&c->bytes_read[i], call->res[i]);
+    } else if (call->op == MIRROR_PWRITE || call->op == MIRROR_SPLICE) {
+        counter_add(&c->bytes_written[i], call->res[i]);
+    }
+}
+
+void stats_call(const struct mirror_call *call)
+{
+    if (mntpath_count < 2) {
+        return;
+    }
+
+    int slowest = 0;
+    for (int i = 1; i < mntpath_count; i++) {
+        if (call->nsecs[i] > call->nsecs[slowest]) {
+            slowest = i;
+        }
+    }
+    stats_straggler(call->op, slowest);
+}
+
+void stats_straggler(enum mirror_op op, int replica)
+{
+    struct stats_counters *c = stats_get();
+    if (c != NULL) {
+        counter_add(&c->stragglers[op][replica], 1);
+    }
+}
+
+void stats_compare(size_t len, uint64_t nsecs)
+{
+    struct stats_counters *c = stats_get();
+    if (c != NULL) {
+        counter_add(&c->compares, 1);
+        counter_add(&c->compare_bytes, len);
+        counter_add(&c->compare_nsecs, nsecs);
+    }
+}
+
+static void hist_print(FILE *f, const char *name, int replica, const struct stats_hist *h,
+                       uint64_t errors)
+{
+    static const double quantiles[] = { 0.50, 0.90, 0.99, 0.999 };
+
+    fprintf(f, "%-12s", name);
+    if (replica >= 0) {
+        fprintf(f, " %7d %10lu", replica, (unsigned long)errors);
+    }
+    fprintf(f, " %12lu %10.1f", (unsigned long)h->count, h->sum / 1e3 / h->count);
+
+    // Percentiles are reported as the upper bound of the bucket they fall in.
+    size_t q = 0;
+    uint64_t seen = 0;
+    uint64_t max = 0;
+    for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+        if (h->buckets[b] == 0) {
+            continue;
+        }
+        seen += h->buckets[b];
+        while (q < sizeof(quantiles) / sizeof(quantiles[0]) &&
+               seen >= quantiles[q] * h->count) {
+            fprintf(f, " %10.1f", bucket_limit(b) / 1e3);
+            q++;
+        }
+        max = bucket_limit(b);
+    }
+    // Buckets may lag the count while the owning thread is mid-update.
+    for (; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        fprintf(f, " %10.1f", max / 1e3);
+    }
+    fprintf(f, " %10.1f\n", max / 1e3);
+}
+
+void stats_report(FILE *f)
+{
+    struct stats_counters *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        fprintf(f, "stats: out of memory\n");
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    counters_merge(c, &retired);
+    for (struct stats_thread *t = threads; t != NULL; t = t->next) {
+        counters_merge(c, &t->c);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    fprintf(f, "# handler latency, microseconds\n");
+    fprintf(f, "%-12s %12s %10s %10s %10s %10s %10s %10s\n", "handler", "count",
+            "mean", "p50", "p90", "p99", "p999", "max");
+    for (int h = 0; h < STATS_HANDLER_COUNT; h++) {
+        if (c->handlers[h].count > 0) {
+            hist_print(f, handler_names[h], -1, &c->handlers[h], 0);
+        }
+    }
+
+    fprintf(f, "\n# replica system call latency, microseconds\n");
+    fprintf(f, "%-12s %7s %10s %12s %10s %10s %10s %10s %10s %10s\n", "call", "replica",
+            "errors", "count", "mean", "p50", "p90", "p99", "p999", "max");
+    for (int op = 0; op < MIRROR_OP_COUNT; op++) {
+        for (int i = 0; i < mntpath_count; i++) {
+            if (c->replicas[op][i].count > 0) {
+                hist_print(f, mirror_op_name(op), i, &c->replicas[op][i], c->errors[op][i]);
+            }
+        }
+    }
+
+    fprintf(f, "\n# replica bytes\n");
+    fprintf(f, "%-7s %16s %16s\n", "replica", "read", "written");
+    for (int i = 0; i < mntpath_count; i++) {
+        fprintf(f, "%-7d %16lu %16lu\n", i, (unsigned long)c->bytes_read[i],
+                (unsigned long)c->bytes_written[i]);
+    }
+
+    fprintf(f, "\n# buffer compares\n");
+    fprintf(f, "compares %lu bytes %lu time_us %.1f\n", (unsigned long)c->compares,
+            (unsigned long)c->compare_bytes, c->compare_nsecs / 1e3);
+
+    // A replica is a straggler for a call when it finished last; the one
+    // that most often does is the one holding the others back.
+    uint64_t total[MAX_MNTPATHS] = {0};
+    uint64_t calls = 0;
+    for (int op = 0; op < MIRROR_OP_COUNT; op++) {
+        for (int i = 0; i < mntpath_count; i++) {
+            total[i] += c->stragglers[op][i];
+            calls += c->stragglers[op][i];
+        }
+    }
+    int rank[MAX_MNTPATHS];
+    for (int i = 0; i < mntpath_count; i++) {
+        int j = i;
+        while (j > 0 && total[rank[j - 1]] < total[i]) {
+            rank[j] = rank[j - 1];
+            j--;
+        }
+        rank[j] = i;
+    }
+
+    int ops[MIRROR_OP_COUNT];
+    int op_count = 0;
+    for (int op = 0; op < MIRROR_OP_COUNT; op++) {
+        for (int i = 0; i < mntpath_count; i++) {
+            if (c->stragglers[op][i] > 0) {
+                ops[op_count++] = op;
+                break;
+            }
+        }
+    }
+
+    fprintf(f, "\n# stragglers, slowest first\n");
+    fprintf(f, "%-7s %12s %7s", "replica", "last", "share");
+    for (int n = 0; n < op_count; n++) {
+        fprintf(f, " %10s", mirror_op_name(ops[n]));
+    }
+    fprintf(f, "\n");
+    for (int r = 0; r < mntpath_count; r++) {
+        int i = rank[r];
+        fprintf(f, "%-7d %12lu %6.1f%%", i, (unsigned long)total[i],
+                calls ? 100.0 * total[i] / calls : 0.0);
+        for (int n = 0; n < op_count; n++) {
+            fprintf(f, " %10lu", (unsigned long)c->stragglers[ops[n]][i]);
+        }
+        fprintf(f, "\n");
+    }
+
+    free(c);
+}
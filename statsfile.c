@@ -0,0 +1,962 @@
+#define FUSE_USE_VERSION 312
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mirrorfs.h"
+
+// The reserved /.mirrorfs directory, which holds a read-only stats file with
+// the latency histograms and counters of stats.c and the other reports.  The
+// file is rendered when it is opened, so every open sees a fresh snapshot
+// and reads never stop the file system.  The directory is not listed in the
+// root and hides a replica directory of the same name.
+//
+// Both front ends are wrapped in a layer that serves the reserved names,
+// refuses to modify them and times every other request as it passes through
+// to the mirrored operations.
+
+#define STATS_DIR "/.mirrorfs"
+#define STATS_DIR_NAME ".mirrorfs"
+#define STATS_FILE_NAME "stats"
+
+// Inode numbers reported for the reserved entries.
+#define STATS_DIR_INO ((ino_t)-2)
+#define STATS_FILE_INO ((ino_t)-3)
+
+enum reserved {
+    RESERVED_NONE,
+    RESERVED_DIR,
+    RESERVED_FILE,
+    RESERVED_OTHER,           // a missing name inside the directory
+};
+
+struct stats_snapshot {
+    char *data;
+    size_t size;
+};
+
+static struct stats_snapshot *snapshot_take(void)
+{
+    struct stats_snapshot *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    FILE *f = open_memstream(&s->data, &s->size);
+    if (f == NULL) {
+        free(s);
+        return NULL;
+    }
+    stats_report(f);
+    fprintf(f, "\n");
+    bufpool_report(f);
+    sample_report(f);
+    coalesce_report(f);
+    sync_report(f);
+    xattr_report(f);
+    shadow_report(f);
+    if (fclose(f) != 0) {
+        free(s->data);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+static void snapshot_free(struct stats_snapshot *s)
+{
+    free(s->data);
+    free(s);
+}
+
+// Bytes of s to return for a read of size at offset, starting at *data.
+static size_t snapshot_slice(const struct stats_snapshot *s, size_t size, off_t offset,
+                             const char **data)
+{
+    *data = s->data;
+    if (offset < 0 || (size_t)offset >= s->size) {
+        return 0;
+    }
+    *data += offset;
+    return s->size - offset < size ? s->size - offset : size;
+}
+
+// The snapshot has no holes.
+static off_t snapshot_seek(const struct stats_snapshot *s, off_t offset, int whence)
+{
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+    if (offset < 0 || (size_t)offset >= s->size) {
+        return -ENXIO;
+    }
+    return whence == SEEK_DATA ? offset : (off_t)s->size;
+}
+
+static void reserved_stat(enum reserved r, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (r == RESERVED_DIR) {
+        st->st_ino = STATS_DIR_INO;
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    } else {
+        st->st_ino = STATS_FILE_INO;
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+    }
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    clock_gettime(CLOCK_REALTIME, &st->st_mtim);
+    st->st_atim = st->st_mtim;
+    st->st_ctim = st->st_mtim;
+}
+
+static int reserved_access(enum reserved r, int mask)
+{
+    if (r == RESERVED_OTHER) {
+        return -ENOENT;
+    }
+    return (mask & W_OK) ? -EACCES : 0;
+}
+
+static int reserved_open(enum reserved r, int flags, struct stats_snapshot **snapshot)
+{
+    if (r == RESERVED_OTHER) {
+        return -ENOENT;
+    }
+    if (r == RESERVED_DIR) {
+        return -EISDIR;
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    *snapshot = snapshot_take();
+    return *snapshot != NULL ? 0 : -ENOMEM;
+}
+
+static const char *const reserved_entries[] = { ".", "..", STATS_FILE_NAME };
+#define RESERVED_ENTRIES (sizeof(reserved_entries) / sizeof(reserved_entries[0]))
+
+// Path-based front end.
+
+static const struct fuse_operations *next_oper;
+static struct fuse_operations statsfile_oper;
+
+static enum reserved reserved_path(const char *path)
+{
+    if (path == NULL || strncmp(path, STATS_DIR, strlen(STATS_DIR)) != 0) {
+        return RESERVED_NONE;
+    }
+    path += strlen(STATS_DIR);
+    if (*path == '\0') {
+        return RESERVED_DIR;
+    }
+    if (*path != '/') {
+        return RESERVED_NONE;
+    }
+    return strcmp(path + 1, STATS_FILE_NAME) == 0 ? RESERVED_FILE : RESERVED_OTHER;
+}
+
+#define TIMED(handler, call) \
+    ({ \
+        uint64_t _start = monotonic_ns(); \
+        __typeof__(call) _res = (call); \
+        stats_handler((handler), monotonic_ns() - _start); \
+        _res; \
+    })
+
+// Requests that modify the path are refused on reserved names.
+#define STATSFILE_MODIFY(op, handler, path, ...) \
+    if (reserved_path(path) != RESERVED_NONE) { \
+        return -EPERM; \
+    } \
+    return TIMED(handler, next_oper->op(__VA_ARGS__))
+
+static int statsfile_getattr(const char *path, struct stat *stbuf,
+                             struct fuse_file_info *fi)
+{
+    enum reserved r = reserved_path(path);
+    if (r != RESERVED_NONE) {
+        if (r == RESERVED_OTHER) {
+            return -ENOENT;
+        }
+        reserved_stat(r, stbuf);
+        return 0;
+    }
+    return TIMED(STATS_GETATTR, next_oper->getattr(path, stbuf, fi));
+}
+
+static int statsfile_access(const char *path, int mask)
+{
+    enum reserved r = reserved_path(path);
+    if (r != RESERVED_NONE) {
+        return reserved_access(r, mask);
+    }
+    return TIMED(STATS_ACCESS, next_oper->access(path, mask));
+}
+
+static int statsfile_readlink(const char *path, char *buf, size_t size)
+{
+    enum reserved r = reserved_path(path);
+    if (r != RESERVED_NONE) {
+        return r == RESERVED_OTHER ? -ENOENT : -EINVAL;
+    }
+    return TIMED(STATS_READLINK, next_oper->readlink(path, buf, size));
+}
+
+static int statsfile_opendir(const char *path, struct fuse_file_info *fi)
+{
+    enum reserved r = reserved_path(path);
+    if (r != RESERVED_NONE) {
+        if (r != RESERVED_DIR) {
+            return r == RESERVED_FILE ? -ENOTDIR : -ENOENT;
+        }
+        fi->fh = 0;
+        return 0;
+    }
+    return TIMED(STATS_OPENDIR, next_oper->opendir(path, fi));
+}
+
+static int statsfile_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                             off_t offset, struct fuse_file_info *fi,
+                             enum fuse_readdir_flags flags)
+{
+    if (reserved_path(path) == RESERVED_DIR) {
+        for (size_t i = offset; i < RESERVED_ENTRIES; i++) {
+            struct stat st;
+            reserved_stat(i < 2 ? RESERVED_DIR : RESERVED_FILE, &st);
+            if (filler(buf, reserved_entries[i], &st, i + 1, 0)) {
+                break;
+            }
+        }
+        return 0;
+    }
+    return TIMED(STATS_READDIR, next_oper->readdir(path, buf, filler, offset, fi, flags));
+}
+
+static int statsfile_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    if (reserved_path(path) == RESERVED_DIR) {
+        return 0;
+    }
+    return TIMED(STATS_RELEASEDIR, next_oper->releasedir(path, fi));
+}
+
+static int statsfile_mkdir(const char *path, mode_t mode)
+{
+    STATSFILE_MODIFY(mkdir, STATS_MKDIR, path, path, mode);
+}
+
+static int statsfile_unlink(const char *path)
+{
+    STATSFILE_MODIFY(unlink, STATS_UNLINK, path, path);
+}
+
+static int statsfile_rmdir(const char *path)
+{
+    STATSFILE_MODIFY(rmdir, STATS_RMDIR, path, path);
+}
+
+static int statsfile_symlink(const char *from, const char *to)
+{
+    STATSFILE_MODIFY(symlink, STATS_SYMLINK, to, from, to);
+}
+
+static int statsfile_rename(const char *from, const char *to, unsigned int flags)
+{
+    if (reserved_path(from) != RESERVED_NONE) {
+        return -EPERM;
+    }
+    STATSFILE_MODIFY(rename, STATS_RENAME, to, from, to, flags);
+}
+
+static int statsfile_link(const char *from, const char *to)
+{
+    if (reserved_path(from) != RESERVED_NONE) {
+        return -EPERM;
+    }
+    STATSFILE_MODIFY(link, STATS_LINK, to, from, to);
+}
+
+static int statsfile_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    STATSFILE_MODIFY(chmod, STATS_CHMOD, path, path, mode, fi);
+}
+
+static int statsfile_chown(const char *path, uid_t uid, gid_t gid,
+                           struct fuse_file_info *fi)
+{
+    STATSFILE_MODIFY(chown, STATS_CHOWN, path, path, uid, gid, fi);
+}
+
+static int statsfile_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    STATSFILE_MODIFY(truncate, STATS_TRUNCATE, path, path, size, fi);
+}
+
+static int statsfile_utimens(const char *path, const struct timespec ts[2],
+                             struct fuse_file_info *fi)
+{
+    STATSFILE_MODIFY(utimens, STATS_UTIMENS, path, path, ts, fi);
+}
+
+static int statsfile_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    STATSFILE_MODIFY(create, STATS_CREATE, path, path, mode, fi);
+}
+
+static int statsfile_open(const char *path, struct fuse_file_info *fi)
+{
+    enum reserved r = reserved_path(path);
+    if (r != RESERVED_NONE) {
+        struct stats_snapshot *s;
+        int res = reserved_open(r, fi->flags, &s);
+        if (res == 0) {
+            // The file has no size of its own; read until the snapshot ends.
+            fi->fh = (uintptr_t)s;
+            fi->direct_io = 1;
+        }
+        return res;
+    }
+    return TIMED(STATS_OPEN, next_oper->open(path, fi));
+}
+
+static int statsfile_read(const char *path, char *buf, size_t size, off_t offset,
+                          struct fuse_file_info *fi)
+{
+    if (reserved_path(path) == RESERVED_FILE && fi != NULL) {
+        const char *data;
+        size_t n = snapshot_slice((struct stats_snapshot *)(uintptr_t)fi->fh, size,
+                                  offset, &data);
+        memcpy(buf, data, n);
+        return n;
+    }
+    return TIMED(STATS_READ, next_oper->read(path, buf, size, offset, fi));
+}
+
+static int statsfile_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                              off_t offset, struct fuse_file_info *fi)
+{
+    if (reserved_path(path) == RESERVED_FILE && fi != NULL) {
+        struct fuse_bufvec *bv = malloc(sizeof(*bv));
+        char *mem = malloc(size ? size : 1);
+        if (bv == NULL || mem == NULL) {
+            free(bv);
+            free(mem);
+            return -ENOMEM;
+        }
+        *bv = FUSE_BUFVEC_INIT(statsfile_read(path, mem, size, offset, fi));
+        bv->buf[0].mem = mem;
+        *bufp = bv;
+        return 0;
+    }
+    return TIMED(STATS_READ, next_oper->read_buf(path, bufp, size, offset, fi));
+}
+
+static int statsfile_write(const char *path, const char *buf, size_t size,
+                           off_t offset, struct fuse_file_info *fi)
+{
+    STATSFILE_MODIFY(write, STATS_WRITE, path, path, buf, size, offset, fi);
+}
+
+static int statsfile_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                               struct fuse_file_info *fi)
+{
+    STATSFILE_MODIFY(write_buf, STATS_WRITE, path, path, buf, offset, fi);
+}
+
+static int statsfile_flush(const char *path, struct fuse_file_info *fi)
+{
+    if (reserved_path(path) != RESERVED_NONE) {
+        return 0;
+    }
+    return TIMED(STATS_FLUSH, next_oper->flush(path, fi));
+}
+
+static int statsfile_release(const char *path, struct fuse_file_info *fi)
+{
+    if (reserved_path(path) == RESERVED_FILE) {
+        snapshot_free((struct stats_snapshot *)(uintptr_t)fi->fh);
+        return 0;
+    }
+    return TIMED(STATS_RELEASE, next_oper->release(path, fi));
+}
+
+static int statsfile_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    if (reserved_path(path) != RESERVED_NONE) {
+        return 0;
+    }
+    return TIMED(STATS_FSYNC, next_oper->fsync(path, isdatasync, fi));
+}
+
+static int statsfile_fsyncdir(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    if (reserved_path(path) != RESERVED_NONE) {
+        return 0;
+    }
+    return TIMED(STATS_FSYNCDIR, next_oper->fsyncdir(path, isdatasync, fi));
+}
+
+static int statsfile_fallocate(const char *path, int mode, off_t offset, off_t length,
+                               struct fuse_file_info *fi)
+{
+    STATSFILE_MODIFY(fallocate, STATS_FALLOCATE, path, path, mode, offset, length, fi);
+}
+
+// Copies out of the stats file are left to the kernel, which falls back to
+// reading and writing.
+static ssize_t statsfile_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                                         off_t offset_in, const char *path_out,
+                                         struct fuse_file_info *fi_out, off_t offset_out,
+                                         size_t size, int flags)
+{
+    if (reserved_path(path_out) != RESERVED_NONE) {
+        return -EPERM;
+    }
+    if (reserved_path(path_in) != RESERVED_NONE) {
+        return -EOPNOTSUPP;
+    }
+    return TIMED(STATS_COPY_FILE_RANGE,
+                 next_oper->copy_file_range(path_in, fi_in, offset_in, path_out, fi_out,
+                                            offset_out, size, flags));
+}
+
+static off_t statsfile_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+    if (reserved_path(path) == RESERVED_FILE && fi != NULL) {
+        return snapshot_seek((struct stats_snapshot *)(uintptr_t)fi->fh, off, whence);
+    }
+    return TIMED(STATS_LSEEK, next_oper->lseek(path, off, whence, fi));
+}
+
+static int statsfile_setxattr(const char *path, const char *name, const char *value,
+                              size_t size, int flags)
+{
+    STATSFILE_MODIFY(setxattr, STATS_SETXATTR, path, path, name, value, size, flags);
+}
+
+// The reserved entries have no extended attributes.
+static int statsfile_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    enum reserved r = reserved_path(path);
+    if (r != RESERVED_NONE) {
+        return r == RESERVED_OTHER ? -ENOENT : -ENODATA;
+    }
+    return TIMED(STATS_GETXATTR, next_oper->getxattr(path, name, value, size));
+}
+
+static int statsfile_listxattr(const char *path, char *list, size_t size)
+{
+    enum reserved r = reserved_path(path);
+    if (r != RESERVED_NONE) {
+        return r == RESERVED_OTHER ? -ENOENT : 0;
+    }
+    return TIMED(STATS_LISTXATTR, next_oper->listxattr(path, list, size));
+}
+
+static int statsfile_removexattr(const char *path, const char *name)
+{
+    STATSFILE_MODIFY(removexattr, STATS_REMOVEXATTR, path, path, name);
+}
+
+#define STATSFILE_WRAP(op) \
+    if (next->op != NULL) { \
+        statsfile_oper.op = statsfile_##op; \
+    }
+
+const struct fuse_operations *statsfile_wrap(const struct fuse_operations *next)
+{
+    next_oper = next;
+
+    statsfile_oper = *next;
+    STATSFILE_WRAP(getattr);
+    STATSFILE_WRAP(access);
+    STATSFILE_WRAP(readlink);
+    STATSFILE_WRAP(opendir);
+    STATSFILE_WRAP(readdir);
+    STATSFILE_WRAP(releasedir);
+    STATSFILE_WRAP(mkdir);
+    STATSFILE_WRAP(unlink);
+    STATSFILE_WRAP(rmdir);
+    STATSFILE_WRAP(symlink);
+    STATSFILE_WRAP(rename);
+    STATSFILE_WRAP(link);
+    STATSFILE_WRAP(chmod);
+    STATSFILE_WRAP(chown);
+    STATSFILE_WRAP(truncate);
+    STATSFILE_WRAP(utimens);
+    STATSFILE_WRAP(create);
+    STATSFILE_WRAP(open);
+    STATSFILE_WRAP(read);
+    STATSFILE_WRAP(read_buf);
+    STATSFILE_WRAP(write);
+    STATSFILE_WRAP(write_buf);
+    STATSFILE_WRAP(flush);
+    STATSFILE_WRAP(release);
+    STATSFILE_WRAP(fsync);
+    STATSFILE_WRAP(fsyncdir);
+    STATSFILE_WRAP(fallocate);
+    STATSFILE_WRAP(copy_file_range);
+    STATSFILE_WRAP(lseek);
+    STATSFILE_WRAP(setxattr);
+    STATSFILE_WRAP(getxattr);
+    STATSFILE_WRAP(listxattr);
+    STATSFILE_WRAP(removexattr);
+    return &statsfile_oper;
+}
+
+// Inode-based front end.  The reserved entries get node IDs of their own
+// that can never be the address of a real inode, and ignore forgets.
+
+static const struct fuse_lowlevel_ops *next_ll_oper;
+static struct fuse_lowlevel_ops statsfile_ll_oper;
+
+static char stats_dir_node;
+static char stats_file_node;
+#define STATS_DIR_NODE ((fuse_ino_t)(uintptr_t)&stats_dir_node)
+#define STATS_FILE_NODE ((fuse_ino_t)(uintptr_t)&stats_file_node)
+
+static enum reserved reserved_ino(fuse_ino_t ino)
+{
+    if (ino == STATS_DIR_NODE) {
+        return RESERVED_DIR;
+    }
+    return ino == STATS_FILE_NODE ? RESERVED_FILE : RESERVED_NONE;
+}
+
+static enum reserved reserved_name(fuse_ino_t parent, const char *name)
+{
+    if (parent == FUSE_ROOT_ID) {
+        return strcmp(name, STATS_DIR_NAME) == 0 ? RESERVED_DIR : RESERVED_NONE;
+    }
+    if (parent == STATS_DIR_NODE) {
+        return strcmp(name, STATS_FILE_NAME) == 0 ? RESERVED_FILE : RESERVED_OTHER;
+    }
+    return RESERVED_NONE;
+}
+
+static void reserved_entry(enum reserved r, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->ino = r == RESERVED_DIR ? STATS_DIR_NODE : STATS_FILE_NODE;
+    reserved_stat(r, &e->attr);
+}
+
+#define TIMED_LL(handler, call) \
+    do { \
+        uint64_t _start = monotonic_ns(); \
+        call; \
+        stats_handler((handler), monotonic_ns() - _start); \
+    } while (0)
+
+// Requests that modify an entry are refused on reserved names.
+#define STATSFILE_LL_MODIFY(reserved, op, handler, ...) \
+    if ((reserved) != RESERVED_NONE) { \
+        fuse_reply_err(req, EPERM); \
+        return; \
+    } \
+    TIMED_LL(handler, next_ll_oper->op(req, __VA_ARGS__))
+
+static void statsfile_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    enum reserved r = reserved_name(parent, name);
+    if (r != RESERVED_NONE) {
+        struct fuse_entry_param e;
+        if (r == RESERVED_OTHER) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        reserved_entry(r, &e);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    TIMED_LL(STATS_LOOKUP, next_ll_oper->lookup(req, parent, name));
+}
+
+static void statsfile_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    if (reserved_ino(ino) != RESERVED_NONE) {
+        fuse_reply_none(req);
+        return;
+    }
+    next_ll_oper->forget(req, ino, nlookup);
+}
+
+static void statsfile_ll_forget_multi(fuse_req_t req, size_t count,
+                                      struct fuse_forget_data *forgets)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (reserved_ino(forgets[i].ino) == RESERVED_NONE) {
+            forgets[kept++] = forgets[i];
+        }
+    }
+    next_ll_oper->forget_multi(req, kept, forgets);
+}
+
+static void statsfile_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    enum reserved r = reserved_ino(ino);
+    if (r != RESERVED_NONE) {
+        struct stat st;
+        reserved_stat(r, &st);
+        fuse_reply_attr(req, &st, 0);
+        return;
+    }
+    TIMED_LL(STATS_GETATTR, next_ll_oper->getattr(req, ino, fi));
+}
+
+static void statsfile_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                                 int to_set, struct fuse_file_info *fi)
+{
+    STATSFILE_LL_MODIFY(reserved_ino(ino), setattr, STATS_SETATTR, ino, attr, to_set, fi);
+}
+
+static void statsfile_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    if (reserved_ino(ino) != RESERVED_NONE) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    TIMED_LL(STATS_READLINK, next_ll_oper->readlink(req, ino));
+}
+
+static void statsfile_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                               mode_t mode)
+{
+    STATSFILE_LL_MODIFY(reserved_name(parent, name), mkdir, STATS_MKDIR, parent, name, mode);
+}
+
+static void statsfile_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                                 const char *name)
+{
+    STATSFILE_LL_MODIFY(reserved_name(parent, name), symlink, STATS_SYMLINK, link, parent,
+                        name);
+}
+
+static void statsfile_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    STATSFILE_LL_MODIFY(reserved_name(parent, name), unlink, STATS_UNLINK, parent, name);
+}
+
+static void statsfile_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    STATSFILE_LL_MODIFY(reserved_name(parent, name), rmdir, STATS_RMDIR, parent, name);
+}
+
+static void statsfile_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                                fuse_ino_t newparent, const char *newname,
+                                unsigned int flags)
+{
+    STATSFILE_LL_MODIFY(reserved_name(parent, name) | reserved_name(newparent, newname),
+                        rename, STATS_RENAME, parent, name, newparent, newname, flags);
+}
+
+static void statsfile_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                              const char *newname)
+{
+    STATSFILE_LL_MODIFY(reserved_ino(ino) | reserved_name(newparent, newname), link,
+                        STATS_LINK, ino, newparent, newname);
+}
+
+static void statsfile_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    enum reserved r = reserved_ino(ino);
+    if (r != RESERVED_NONE) {
+        fuse_reply_err(req, -reserved_access(r, mask));
+        return;
+    }
+    TIMED_LL(STATS_ACCESS, next_ll_oper->access(req, ino, mask));
+}
+
+static void statsfile_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                                mode_t mode, struct fuse_file_info *fi)
+{
+    STATSFILE_LL_MODIFY(reserved_name(parent, name), create, STATS_CREATE, parent, name,
+                        mode, fi);
+}
+
+static void statsfile_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    enum reserved r = reserved_ino(ino);
+    if (r != RESERVED_NONE) {
+        struct stats_snapshot *s;
+        int res = reserved_open(r, fi->flags, &s);
+        if (res != 0) {
+            fuse_reply_err(req, -res);
+            return;
+        }
+        fi->fh = (uintptr_t)s;
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+        return;
+    }
+    TIMED_LL(STATS_OPEN, next_ll_oper->open(req, ino, fi));
+}
+
+static void statsfile_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                              struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) == RESERVED_FILE) {
+        const char *data;
+        size_t n = snapshot_slice((struct stats_snapshot *)(uintptr_t)fi->fh, size,
+                                  offset, &data);
+        fuse_reply_buf(req, data, n);
+        return;
+    }
+    TIMED_LL(STATS_READ, next_ll_oper->read(req, ino, size, offset, fi));
+}
+
+static void statsfile_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                                   off_t off, struct fuse_file_info *fi)
+{
+    STATSFILE_LL_MODIFY(reserved_ino(ino), write_buf, STATS_WRITE, ino, bufv, off, fi);
+}
+
+static void statsfile_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) != RESERVED_NONE) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    TIMED_LL(STATS_FLUSH, next_ll_oper->flush(req, ino, fi));
+}
+
+static void statsfile_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) == RESERVED_FILE) {
+        snapshot_free((struct stats_snapshot *)(uintptr_t)fi->fh);
+        fuse_reply_err(req, 0);
+        return;
+    }
+    TIMED_LL(STATS_RELEASE, next_ll_oper->release(req, ino, fi));
+}
+
+static void statsfile_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                               struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) != RESERVED_NONE) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    TIMED_LL(STATS_FSYNC, next_ll_oper->fsync(req, ino, datasync, fi));
+}
+
+static void statsfile_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                                  struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) != RESERVED_NONE) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    TIMED_LL(STATS_FSYNCDIR, next_ll_oper->fsyncdir(req, ino, datasync, fi));
+}
+
+static void statsfile_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                                   off_t length, struct fuse_file_info *fi)
+{
+    STATSFILE_LL_MODIFY(reserved_ino(ino), fallocate, STATS_FALLOCATE, ino, mode, offset,
+                        length, fi);
+}
+
+static void statsfile_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                                         struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+                                         off_t off_out, struct fuse_file_info *fi_out,
+                                         size_t len, int flags)
+{
+    if (reserved_ino(ino_out) != RESERVED_NONE) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    if (reserved_ino(ino_in) != RESERVED_NONE) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    TIMED_LL(STATS_COPY_FILE_RANGE,
+             next_ll_oper->copy_file_range(req, ino_in, off_in, fi_in, ino_out, off_out,
+                                           fi_out, len, flags));
+}
+
+static void statsfile_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                               struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) == RESERVED_FILE) {
+        off_t res = snapshot_seek((struct stats_snapshot *)(uintptr_t)fi->fh, off, whence);
+        if (res < 0) {
+            fuse_reply_err(req, -res);
+            return;
+        }
+        fuse_reply_lseek(req, res);
+        return;
+    }
+    TIMED_LL(STATS_LSEEK, next_ll_oper->lseek(req, ino, off, whence, fi));
+}
+
+static void statsfile_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                                  const char *value, size_t size, int flags)
+{
+    STATSFILE_LL_MODIFY(reserved_ino(ino), setxattr, STATS_SETXATTR, ino, name, value, size,
+                        flags);
+}
+
+static void statsfile_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                                  size_t size)
+{
+    if (reserved_ino(ino) != RESERVED_NONE) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+    TIMED_LL(STATS_GETXATTR, next_ll_oper->getxattr(req, ino, name, size));
+}
+
+static void statsfile_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    if (reserved_ino(ino) != RESERVED_NONE) {
+        if (size == 0) {
+            fuse_reply_xattr(req, 0);
+        } else {
+            fuse_reply_buf(req, NULL, 0);
+        }
+        return;
+    }
+    TIMED_LL(STATS_LISTXATTR, next_ll_oper->listxattr(req, ino, size));
+}
+
+static void statsfile_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+    STATSFILE_LL_MODIFY(reserved_ino(ino), removexattr, STATS_REMOVEXATTR, ino, name);
+}
+
+static void statsfile_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    enum reserved r = reserved_ino(ino);
+    if (r != RESERVED_NONE) {
+        if (r != RESERVED_DIR) {
+            fuse_reply_err(req, ENOTDIR);
+            return;
+        }
+        fi->fh = 0;
+        fuse_reply_open(req, fi);
+        return;
+    }
+    TIMED_LL(STATS_OPENDIR, next_ll_oper->opendir(req, ino, fi));
+}
+
+// . and .. are listed without attributes, as by the mirrored directories.
+static void reserved_readdir(fuse_req_t req, size_t size, off_t offset, int plus)
+{
+    char buf[256];
+    size_t used = 0;
+
+    if (size > sizeof(buf)) {
+        size = sizeof(buf);
+    }
+    for (size_t i = offset; i < RESERVED_ENTRIES; i++) {
+        struct fuse_entry_param e;
+        size_t len;
+
+        memset(&e, 0, sizeof(e));
+        if (i < 2) {
+            e.attr.st_ino = i == 0 ? STATS_DIR_INO : 1;
+            e.attr.st_mode = S_IFDIR;
+        } else {
+            reserved_entry(RESERVED_FILE, &e);
+        }
+        if (plus) {
+            len = fuse_add_direntry_plus(req, buf + used, size - used,
+                                         reserved_entries[i], &e, i + 1);
+        } else {
+            len = fuse_add_direntry(req, buf + used, size - used, reserved_entries[i],
+                                    &e.attr, i + 1);
+        }
+        if (len > size - used) {
+            break;
+        }
+        used += len;
+    }
+    fuse_reply_buf(req, buf, used);
+}
+
+static void statsfile_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                 struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) == RESERVED_DIR) {
+        reserved_readdir(req, size, offset, 0);
+        return;
+    }
+    TIMED_LL(STATS_READDIR, next_ll_oper->readdir(req, ino, size, offset, fi));
+}
+
+static void statsfile_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                     off_t offset, struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) == RESERVED_DIR) {
+        reserved_readdir(req, size, offset, 1);
+        return;
+    }
+    TIMED_LL(STATS_READDIR, next_ll_oper->readdirplus(req, ino, size, offset, fi));
+}
+
+static void statsfile_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                                    struct fuse_file_info *fi)
+{
+    if (reserved_ino(ino) == RESERVED_DIR) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    TIMED_LL(STATS_RELEASEDIR, next_ll_oper->releasedir(req, ino, fi));
+}
+
+#define STATSFILE_LL_WRAP(op) \
+    if (next->op != NULL) { \
+        statsfile_ll_oper.op = statsfile_ll_##op; \
+    }
+
+const struct fuse_lowlevel_ops *statsfile_ll_wrap(const struct fuse_lowlevel_ops *next)
+{
+    next_ll_oper = next;
+
+    statsfile_ll_oper = *next;
+    STATSFILE_LL_WRAP(lookup);
+    STATSFILE_LL_WRAP(forget);
+    STATSFILE_LL_WRAP(forget_multi);
+    STATSFILE_LL_WRAP(getattr);
+    STATSFILE_LL_WRAP(setattr);
+    STATSFILE_LL_WRAP(readlink);
+    STATSFILE_LL_WRAP(mkdir);
+    STATSFILE_LL_WRAP(symlink);
+    STATSFILE_LL_WRAP(unlink);
+    STATSFILE_LL_WRAP(rmdir);
+    STATSFILE_LL_WRAP(rename);
+    STATSFILE_LL_WRAP(link);
+    STATSFILE_LL_WRAP(access);
+    STATSFILE_LL_WRAP(create);
+    STATSFILE_LL_WRAP(open);
+    STATSFILE_LL_WRAP(read);
+    STATSFILE_LL_WRAP(write_buf);
+    STATSFILE_LL_WRAP(flush);
+    STATSFILE_LL_WRAP(release);
+    STATSFILE_LL_WRAP(fsync);
+    STATSFILE_LL_WRAP(fsyncdir);
+    STATSFILE_LL_WRAP(fallocate);
+    STATSFILE_LL_WRAP(copy_file_range);
+    STATSFILE_LL_WRAP(lseek);
+    STATSFILE_LL_WRAP(setxattr);
+    STATSFILE_LL_WRAP(getxattr);
+    STATSFILE_LL_WRAP(listxattr);
+    STATSFILE_LL_WRAP(removexattr);
+    STATSFILE_LL_WRAP(opendir);
+    STATSFILE_LL_WRAP(readdir);
+    STATSFILE_LL_WRAP(readdirplus);
+    STATSFILE_LL_WRAP(releasedir);
+    return &statsfile_ll_oper;
+}
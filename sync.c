@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mirrorfs.h"
+
+// Durability requests.  fsync, fdatasync and fsyncdir are fanned out to
+// every replica like any other call, with group commit: one sync of a file
+// covers every caller that was already waiting when it started, so callers
+// that arrive while a sync of the same file is running share the next one
+// instead of queueing up a sync each.  The leader of a group may also wait
+// -o fsync_window=USEC for more callers before it starts.  Files are told
+// apart by the primary's device and inode, so syncs through different
+// handles of one file are merged too; fsync and fdatasync are grouped
+// separately.
+
+#define SYNC_BUCKETS 64
+
+struct sync_group {
+    dev_t dev;
+    ino_t ino;
+    int datasync;
+    unsigned users;           // callers holding a reference
+    uint64_t started;         // syncs started
+    uint64_t done;            // syncs finished
+    int running;
+    int res;                  // result of the last finished sync
+    pthread_cond_t cond;
+    struct sync_group *next;
+};
+
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sync_group *buckets[SYNC_BUCKETS];
+
+static atomic_ulong sync_requests;
+static atomic_ulong sync_calls;
+
+// Find or create the group of a file.  Called with sync_lock held.
+static struct sync_group *group_get(dev_t dev, ino_t ino, int datasync)
+{
+    struct sync_group **bucket = &buckets[(ino * 2 + datasync) % SYNC_BUCKETS];
+
+    for (struct sync_group *g = *bucket; g != NULL; g = g->next) {
+        if (g->dev == dev && g->ino == ino && g->datasync == datasync) {
+            g->users++;
+            return g;
+        }
+    }
+    struct sync_group *g = calloc(1, sizeof(*g));
+    if (g == NULL) {
+        return NULL;
+    }
+    g->dev = dev;
+    g->ino = ino;
+    g->datasync = datasync;
+    g->users = 1;
+    pthread_cond_init(&g->cond, NULL);
+    g->next = *bucket;
+    *bucket = g;
+    return g;
+}
+
+// Drop a reference, freeing the group with the last one.  Called with
+// sync_lock held.
+static void group_put(struct sync_group *g)
+{
+    if (--g->users > 0) {
+        return;
+    }
+    struct sync_group **link = &buckets[(g->ino * 2 + g->datasync) % SYNC_BUCKETS];
+    while (*link != g) {
+        link = &(*link)->next;
+    }
+    *link = g->next;
+    pthread_cond_destroy(&g->cond);
+    free(g);
+}
+
+static int sync_call(const int *fds, int datasync)
+{
+    struct mirror_call call = {
+        .op = MIRROR_FSYNC,
+        .fds = fds,
+        .flags = datasync,
+    };
+    atomic_fetch_add_explicit(&sync_calls, 1, memory_order_relaxed);
+    return mirror_simple(&call);
+}
+
+int mirror_fsync(const int *fds, int datasync)
+{
+    struct stat st;
+
+    datasync = datasync != 0;
+    atomic_fetch_add_explicit(&sync_requests, 1, memory_order_relaxed);
+    if (fstat(fds[0], &st) == -1) {
+        return sync_call(fds, datasync);
+    }
+
+    pthread_mutex_lock(&sync_lock);
+    struct sync_group *g = group_get(st.st_dev, st.st_ino, datasync);
+    if (g == NULL) {
+        pthread_mutex_unlock(&sync_lock);
+        return sync_call(fds, datasync);
+    }
+
+    // A sync that is already running may have started before this caller's
+    // writes, so only the next one to start covers them.
+    uint64_t needed = g->started + 1;
+    while (g->done < needed) {
+        if (g->running) {
+            pthread_cond_wait(&g->cond, &sync_lock);
+            continue;
+        }
+        // Callers arriving during the window still find this sync not
+        // started, so it covers them.
+        g->running = 1;
+        if (options.fsync_window > 0) {
+            struct timespec ts = {
+                .tv_sec = options.fsync_window / 1000000,
+                .tv_nsec = options.fsync_window % 1000000 * 1000,
+            };
+            pthread_mutex_unlock(&sync_lock);
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&sync_lock);
+        }
+        g->started++;
+        pthread_mutex_unlock(&sync_lock);
+
+        int res = sync_call(fds, datasync);
+
+        pthread_mutex_lock(&sync_lock);
+        g->res = res;
+        g->done = g->started;
+        g->running = 0;
+        pthread_cond_broadcast(&g->cond);
+    }
+    int res = g->res;
+    group_put(g);
+    pthread_mutex_unlock(&sync_lock);
+    return res;
+}
+
+int mirror_flush(const int *fds)
+{
+    struct mirror_call call = {
+        .op = MIRROR_FLUSH,
+        .fds = fds,
+    };
+    return mirror_simple(&call);
+}
+
+void sync_report(FILE *f)
+{
+    unsigned long requests = atomic_load(&sync_requests);
+
+    if (requests == 0) {
+        return;
+    }
+    fprintf(f, "sync: %lu requests served by %lu syncs\n",
+            requests, atomic_load(&sync_calls));
+}
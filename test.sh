@@ -1,6 +1,6 @@
 #!/bin/bash
 
-which fusermount3 > /dev/null
+which fusermount3 setfattr getfattr > /dev/null
 
 # setup
 mkdir -p mnt a b c
@@ -8,7 +8,7 @@ trap 'rm -rf mnt a b c' EXIT
 
 set -ex
 
-./mirrorfs -f -d a b c mnt &
+./mirrorfs -f -d $MIRRORFS_OPTS a b c mnt &
 mirrorfs_pid=$!
 trap 'fusermount3 -q -u mnt; rm -rf mnt a b c; wait $mirrorfs_pid' EXIT
 
@@ -29,8 +29,15 @@ done
 
 echo "Mount successful"
 
+# Mirrors that -o async or -o quorum update in the background have caught up
+# once a directory listing returns.
+drain() {
+    ls mnt > /dev/null
+}
+
 # test write
 echo foo > mnt/foo
+drain
 test "$(cat a/foo)" == foo
 test "$(cat b/foo)" == foo
 test "$(cat c/foo)" == foo
@@ -43,14 +50,95 @@ test "$(cat mnt/bar)" == bar
 
 # test rename
 mv mnt/foo mnt/bar
+drain
 test $(cat a/bar) == foo
 test $(cat b/bar) == foo
 test $(cat c/bar) == foo
 
 # test metadata
 chmod +x mnt/bar
+drain
 test -x a/bar
 test -x b/bar
 test -x c/bar
 
+# test readdir
+mkdir mnt/dir
+touch mnt/dir/1 mnt/dir/2 mnt/dir/3
+test "$(ls mnt/dir | tr '\n' ' ')" == "1 2 3 "
+
+# test seeking to the end of a file still being written through the same fd
+exec 3<>mnt/coalesce
+printf abcdef >&3
+test "$(tail -c 3 <&3)" == def
+printf ghi >&3
+exec 3>&-
+drain
+test "$(cat a/coalesce)" == abcdefghi
+test "$(cat b/coalesce)" == abcdefghi
+test "$(cat c/coalesce)" == abcdefghi
+
+# test the size by path of a file still being appended to
+exec 3>>mnt/appended
+printf abc >&3
+test $(stat -c %s mnt/appended) == 3
+printf defg >&3
+test $(stat -c %s mnt/appended) == 7
+echo hij >> mnt/appended
+test $(stat -c %s mnt/appended) == 11
+exec 3>&-
+drain
+test "$(cat a/appended)" == abcdefghij
+test "$(cat b/appended)" == abcdefghij
+test "$(cat c/appended)" == abcdefghij
+
+# test truncate, fallocate and copy_file_range
+echo hello > mnt/sized
+truncate -s 4096 mnt/sized
+drain
+test $(stat -c %s a/sized) == 4096
+test $(stat -c %s b/sized) == 4096
+test $(stat -c %s c/sized) == 4096
+fallocate -l 65536 mnt/sized
+drain
+test $(stat -c %s a/sized) == 65536
+test $(stat -c %s b/sized) == 65536
+test $(stat -c %s c/sized) == 65536
+cp --reflink=never mnt/sized mnt/copied
+drain
+cmp a/sized a/copied
+cmp b/sized b/copied
+cmp c/sized c/copied
+
+# test extended attributes
+setfattr -n user.x -v 1 mnt/bar
+drain
+test "$(getfattr --only-values -n user.x a/bar)" == 1
+test "$(getfattr --only-values -n user.x b/bar)" == 1
+test "$(getfattr --only-values -n user.x c/bar)" == 1
+test "$(getfattr --only-values -n user.x mnt/bar)" == 1
+getfattr -d mnt/bar | grep -q '^user.x='
+setfattr -x user.x mnt/bar
+if getfattr -n user.x mnt/bar 2> /dev/null; then exit 1; fi
+if getfattr -n user.x a/bar 2> /dev/null; then exit 1; fi
+
+# test that setting an attribute forgets a cached lookup that found none
+if [ "$(id -u)" == 0 ]; then
+    if getfattr -n security.capability mnt/bar 2> /dev/null; then exit 1; fi
+    setfattr -n security.capability -v 0sAQAAAgAEAAAAAAAAAAAAAAAAAAA= mnt/bar
+    drain
+    getfattr -n security.capability a/bar b/bar c/bar > /dev/null
+    getfattr -n security.capability mnt/bar > /dev/null
+    setfattr -x security.capability mnt/bar
+    if getfattr -n security.capability mnt/bar 2> /dev/null; then exit 1; fi
+fi
+
+# test the stats file
+grep -q '^handler ' mnt/.mirrorfs/stats
+grep -q '^write ' mnt/.mirrorfs/stats
+err=$( { echo x > mnt/.mirrorfs/stats; } 2>&1 ) && exit 1
+echo "$err" | grep -q 'Permission denied\|Operation not permitted'
+err=$(rm -f mnt/.mirrorfs/stats 2>&1) && exit 1
+echo "$err" | grep -q 'Permission denied\|Operation not permitted'
+
 echo All tests passed
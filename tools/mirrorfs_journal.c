@@ -0,0 +1,241 @@
+// Print a journal written by mirrorfs -o journal=FILE as text.
+//
+// usage: mirrorfs_journal [-d] [file]
+//
+// -d prints divergences only, each preceded by the call it was found in.
+// Records of one thread appear in the order they were made; records of
+// different threads are interleaved in the order they were written out.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mirrorfs.h"
+
+static char **op_names;
+static unsigned op_count;
+
+static const char *op_name(unsigned op)
+{
+    return op < op_count ? op_names[op] : "unknown";
+}
+
+static void print_time(uint64_t ns)
+{
+    time_t secs = ns / 1000000000;
+    struct tm tm;
+    char buf[32];
+
+    localtime_r(&secs, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06lu", buf, (unsigned long)(ns % 1000000000) / 1000);
+}
+
+// Strings follow a record's fixed part back to back, each NUL-terminated.
+static const char *next_string(const char **p, uint16_t len)
+{
+    const char *s = len ? *p : NULL;
+    *p += len;
+    return s;
+}
+
+static void print_call(const char *rec)
+{
+    const struct journal_call_record *c = (const void *)rec;
+    const struct journal_result *results = (const void *)(c + 1);
+    const char *p = (const char *)(results + c->replicas);
+    const char *path = next_string(&p, c->path_len);
+    const char *path2 = next_string(&p, c->path2_len);
+
+    print_time(c->hdr.time);
+    printf(" thread %u call %llu %s", c->hdr.thread, (unsigned long long)c->hdr.seq,
+           op_name(c->op));
+    if (path != NULL) {
+        printf(" \"%s\"", path);
+    }
+    if (path2 != NULL) {
+        printf(" \"%s\"", path2);
+    }
+    printf(" flags=0x%x mode=0%o size=%llu offset=%lld\n", c->flags, c->mode,
+           (unsigned long long)c->size, (long long)c->offset);
+    for (unsigned i = 0; i < c->replicas; i++) {
+        printf("    replica %u: %lld", i, (long long)results[i].res);
+        if (results[i].res == -1) {
+            printf(" (%s)", strerror(results[i].err));
+        }
+        printf(" in %.1f us\n", results[i].nsecs / 1e3);
+    }
+}
+
+static void print_divergence(const char *rec)
+{
+    const struct journal_divergence_record *d = (const void *)rec;
+    const char *p = (const char *)(d + 1);
+    const char *func = next_string(&p, d->func_len);
+    const char *what = next_string(&p, d->what_len);
+    const char *name = next_string(&p, d->name_len);
+
+    print_time(d->hdr.time);
+    printf(" thread %u DIVERGENCE in call %llu, %s: replica %d %s",
+           d->hdr.thread, (unsigned long long)d->hdr.seq, func ? func : "?",
+           d->replica, what ? what : "?");
+    if (name != NULL) {
+        printf(" \"%s\"\n", name);
+    } else if (d->length > 0) {
+        printf(" differs at offset %llu for %llu bytes: 0x%02lx != 0x%02lx\n",
+               (unsigned long long)d->offset, (unsigned long long)d->length,
+               (unsigned long)d->primary, (unsigned long)d->value);
+    } else {
+        printf(": %lld != %lld\n", (long long)d->primary, (long long)d->value);
+    }
+}
+
+// With -d, the last call of each thread is held back until it turns out to
+// have diverged.
+struct held_call {
+    uint32_t thread;
+    uint64_t seq;
+    int printed;
+    char *rec;
+    struct held_call *next;
+};
+
+static struct held_call *held;
+
+static struct held_call *held_get(uint32_t thread)
+{
+    for (struct held_call *h = held; h != NULL; h = h->next) {
+        if (h->thread == thread) {
+            return h;
+        }
+    }
+    struct held_call *h = calloc(1, sizeof(*h));
+    if (h == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    h->thread = thread;
+    h->next = held;
+    held = h;
+    return h;
+}
+
+static int read_full(FILE *f, void *buf, size_t len)
+{
+    return fread(buf, 1, len, f) == len;
+}
+
+int main(int argc, char *argv[])
+{
+    int divergences_only = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d")) != -1) {
+        if (opt != 'd') {
+            fprintf(stderr, "usage: %s [-d] [file]\n", argv[0]);
+            return 2;
+        }
+        divergences_only = 1;
+    }
+
+    FILE *f = stdin;
+    if (optind < argc) {
+        f = fopen(argv[optind], "rb");
+        if (f == NULL) {
+            fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+    }
+
+    struct journal_file_header header;
+    if (!read_full(f, &header, sizeof(header)) || header.magic != JOURNAL_MAGIC) {
+        fprintf(stderr, "not a mirrorfs journal\n");
+        return 1;
+    }
+    if (header.version != JOURNAL_VERSION) {
+        fprintf(stderr, "unsupported journal version %u\n", header.version);
+        return 1;
+    }
+
+    char *names = malloc(header.names_size);
+    op_names = calloc(header.op_count, sizeof(char *));
+    if (names == NULL || op_names == NULL || !read_full(f, names, header.names_size)) {
+        fprintf(stderr, "truncated journal header\n");
+        return 1;
+    }
+    for (char *p = names; op_count < header.op_count && p < names + header.names_size; ) {
+        op_names[op_count++] = p;
+        p += strlen(p) + 1;
+    }
+
+    unsigned long calls = 0;
+    unsigned long diverged = 0;
+    unsigned long lost = 0;
+    for (;;) {
+        struct journal_record hdr;
+        if (!read_full(f, &hdr, sizeof(hdr))) {
+            break;
+        }
+        if (hdr.size < sizeof(hdr)) {
+            fprintf(stderr, "corrupt record\n");
+            return 1;
+        }
+        char *rec = malloc(hdr.size);
+        if (rec == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        memcpy(rec, &hdr, sizeof(hdr));
+        if (!read_full(f, rec + sizeof(hdr), hdr.size - sizeof(hdr))) {
+            fprintf(stderr, "truncated record\n");
+            free(rec);
+            break;
+        }
+
+        switch (hdr.type) {
+            case JOURNAL_CALL:
+                calls++;
+                if (divergences_only) {
+                    struct held_call *h = held_get(hdr.thread);
+                    free(h->rec);
+                    h->rec = rec;
+                    h->seq = hdr.seq;
+                    h->printed = 0;
+                    rec = NULL;
+                } else {
+                    print_call(rec);
+                }
+                break;
+            case JOURNAL_DIVERGENCE:
+                diverged++;
+                if (divergences_only) {
+                    struct held_call *h = held_get(hdr.thread);
+                    if (h->rec != NULL && h->seq == hdr.seq && !h->printed) {
+                        print_call(h->rec);
+                        h->printed = 1;
+                    }
+                }
+                print_divergence(rec);
+                break;
+            case JOURNAL_DROPPED:
+                lost += hdr.seq;
+                if (!divergences_only) {
+                    print_time(hdr.time);
+                    printf(" %llu records lost\n", (unsigned long long)hdr.seq);
+                }
+                break;
+            default:
+                // Unknown records are skipped by their size.
+                break;
+        }
+        free(rec);
+    }
+
+    printf("# %lu calls, %lu divergences, %lu records lost\n", calls, diverged, lost);
+    return 0;
+}
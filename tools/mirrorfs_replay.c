@@ -0,0 +1,906 @@
+// Replay a request trace recorded with mirrorfs -o trace=FILE.
+//
+// usage: mirrorfs_replay [-p] [-j] [-v] trace mountpoint
+//        mirrorfs_replay -d [-p] [-j] [-v] trace mntpath1 [mntpath2 ...]
+//
+// Requests are issued as system calls under mountpoint or, with -d, straight
+// to mirrorfs's verified operations on the given mirrors, leaving out the
+// kernel and libfuse.  By default they run back to back in the order they
+// started, from a single thread.  -p keeps the original pacing, -j replays
+// every recorded thread's requests in a thread of its own and -v prints
+// requests whose result differs from the trace.  Written data is a fixed
+// pattern, since traces do not hold file contents.  Prints the throughput and
+// latency percentiles, overall and per operation.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "../mirrorfs.h"
+
+// Globals the verified operations expect from the file system proper.
+int mntfds[MAX_MNTPATHS];
+int mntpath_count;
+struct mirrorfs_options options;
+
+enum req_type {
+    REQ_GETATTR,
+    REQ_ACCESS,
+    REQ_READLINK,
+    REQ_OPENDIR,
+    REQ_READDIR,
+    REQ_RELEASEDIR,
+    REQ_MKDIR,
+    REQ_UNLINK,
+    REQ_RMDIR,
+    REQ_SYMLINK,
+    REQ_RENAME,
+    REQ_LINK,
+    REQ_CHMOD,
+    REQ_CHOWN,
+    REQ_TRUNCATE,
+    REQ_UTIMENS,
+    REQ_CREATE,
+    REQ_OPEN,
+    REQ_READ,
+    REQ_WRITE,
+    REQ_FLUSH,
+    REQ_RELEASE,
+    REQ_FSYNC,
+    REQ_FSYNCDIR,
+    REQ_FALLOCATE,
+    REQ_COPY_FILE_RANGE,
+    REQ_LSEEK,
+    REQ_SETXATTR,
+    REQ_GETXATTR,
+    REQ_LISTXATTR,
+    REQ_REMOVEXATTR,
+    REQ_TYPE_COUNT,
+};
+
+// Argument layout of each request after its name: p is a path, s a string
+// and n a number, stored in order in path/path2 and args[].
+static const struct {
+    const char *name;
+    const char *args;
+} req_types[REQ_TYPE_COUNT] = {
+    [REQ_GETATTR] = { "getattr", "p" },
+    [REQ_ACCESS] = { "access", "pn" },
+    [REQ_READLINK] = { "readlink", "pn" },
+    [REQ_OPENDIR] = { "opendir", "pn" },
+    [REQ_READDIR] = { "readdir", "nnn" },
+    [REQ_RELEASEDIR] = { "releasedir", "n" },
+    [REQ_MKDIR] = { "mkdir", "pn" },
+    [REQ_UNLINK] = { "unlink", "p" },
+    [REQ_RMDIR] = { "rmdir", "p" },
+    [REQ_SYMLINK] = { "symlink", "sp" },
+    [REQ_RENAME] = { "rename", "ppn" },
+    [REQ_LINK] = { "link", "pp" },
+    [REQ_CHMOD] = { "chmod", "pn" },
+    [REQ_CHOWN] = { "chown", "pnn" },
+    [REQ_TRUNCATE] = { "truncate", "pnn" },
+    [REQ_UTIMENS] = { "utimens", "pnnnn" },
+    [REQ_CREATE] = { "create", "pnnn" },
+    [REQ_OPEN] = { "open", "pnn" },
+    [REQ_READ] = { "read", "pnnn" },
+    [REQ_WRITE] = { "write", "pnnn" },
+    [REQ_FLUSH] = { "flush", "n" },
+    [REQ_RELEASE] = { "release", "n" },
+    [REQ_FSYNC] = { "fsync", "nn" },
+    [REQ_FSYNCDIR] = { "fsyncdir", "nn" },
+    [REQ_FALLOCATE] = { "fallocate", "nnnn" },
+    [REQ_COPY_FILE_RANGE] = { "copy_file_range", "nnnnnn" },
+    [REQ_LSEEK] = { "lseek", "nnn" },
+    [REQ_SETXATTR] = { "setxattr", "psnn" },
+    [REQ_GETXATTR] = { "getxattr", "psn" },
+    [REQ_LISTXATTR] = { "listxattr", "pn" },
+    [REQ_REMOVEXATTR] = { "removexattr", "ps" },
+};
+
+struct req {
+    uint64_t start;           // ns since the start of the trace
+    int thread;
+    enum req_type type;
+    char *path;
+    char *path2;
+    long long args[6];
+    long res;                 // recorded result
+    long replayed;            // result of the replay
+    uint64_t nsecs;           // replay latency
+};
+
+static struct req *reqs;
+static size_t req_count;
+
+static int direct;
+static int paced;
+static int verbose;
+static const char *mountpoint;
+static uint64_t replay_start;
+static size_t write_max;
+static char *write_data;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char *unescape(const char *s)
+{
+    char *out = malloc(strlen(s) + 1);
+    char *o = out;
+
+    if (out == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    while (*s != '\0') {
+        unsigned v;
+        if (*s == '%' && sscanf(s + 1, "%2x", &v) == 1) {
+            *o++ = v;
+            s += 3;
+        } else {
+            *o++ = *s++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+static int parse_line(char *line, struct req *r)
+{
+    char *save;
+    char *tok;
+
+    memset(r, 0, sizeof(*r));
+    if ((tok = strtok_r(line, " \n", &save)) == NULL) {
+        return -1;
+    }
+    r->start = strtoull(tok, NULL, 10);
+    if ((tok = strtok_r(NULL, " \n", &save)) == NULL) {
+        return -1;
+    }
+    r->thread = atoi(tok);
+    if ((tok = strtok_r(NULL, " \n", &save)) == NULL) {
+        return -1;
+    }
+    for (r->type = 0; r->type < REQ_TYPE_COUNT; r->type++) {
+        if (strcmp(tok, req_types[r->type].name) == 0) {
+            break;
+        }
+    }
+    if (r->type == REQ_TYPE_COUNT) {
+        return -1;
+    }
+
+    int n = 0;
+    for (const char *a = req_types[r->type].args; *a != '\0'; a++) {
+        if ((tok = strtok_r(NULL, " \n", &save)) == NULL) {
+            return -1;
+        }
+        if (*a == 'n') {
+            r->args[n++] = strtoull(tok, NULL, 0);
+        } else if (r->path == NULL) {
+            r->path = unescape(tok);
+        } else {
+            r->path2 = unescape(tok);
+        }
+    }
+    if ((tok = strtok_r(NULL, " \n", &save)) == NULL || strcmp(tok, "=") != 0 ||
+        (tok = strtok_r(NULL, " \n", &save)) == NULL) {
+        return -1;
+    }
+    r->res = strtol(tok, NULL, 10);
+    return 0;
+}
+
+static int req_cmp(const void *a, const void *b)
+{
+    const struct req *x = a;
+    const struct req *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static void load_trace(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    char *line = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+    unsigned long lineno = 0;
+
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+    while (getline(&line, &len, f) != -1) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (req_count == capacity) {
+            capacity = capacity ? 2 * capacity : 4096;
+            reqs = realloc(reqs, capacity * sizeof(*reqs));
+            if (reqs == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        struct req *r = &reqs[req_count];
+        if (parse_line(line, r) != 0) {
+            fprintf(stderr, "%s:%lu: cannot parse request\n", file, lineno);
+            continue;
+        }
+        if (r->type == REQ_WRITE && (size_t)r->args[1] > write_max) {
+            write_max = r->args[1];
+        }
+        if (r->type == REQ_SETXATTR && (size_t)r->args[0] > write_max) {
+            write_max = r->args[0];
+        }
+        req_count++;
+    }
+    free(line);
+    fclose(f);
+
+    // Lines are written as requests finish; replay them as they started.
+    qsort(reqs, req_count, sizeof(*reqs), req_cmp);
+}
+
+// Recorded file and directory handles, mapped to the replay's own.
+struct handle_map {
+    uint64_t recorded;
+    uintptr_t handle;
+    struct handle_map *next;
+};
+
+#define HANDLE_BUCKETS 4096
+
+static struct handle_map *handle_buckets[HANDLE_BUCKETS];
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void handle_set(uint64_t recorded, uintptr_t handle)
+{
+    struct handle_map *m = malloc(sizeof(*m));
+    if (m == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    m->recorded = recorded;
+    m->handle = handle;
+
+    pthread_mutex_lock(&handle_lock);
+    m->next = handle_buckets[recorded % HANDLE_BUCKETS];
+    handle_buckets[recorded % HANDLE_BUCKETS] = m;
+    pthread_mutex_unlock(&handle_lock);
+}
+
+// Look up a recorded handle, removing it when remove is set.  Returns 0 if
+// the request that created it failed during the replay.
+static int handle_find(uint64_t recorded, uintptr_t *handle, int remove)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&handle_lock);
+    for (struct handle_map **link = &handle_buckets[recorded % HANDLE_BUCKETS];
+         *link != NULL; link = &(*link)->next) {
+        struct handle_map *m = *link;
+        if (m->recorded == recorded) {
+            *handle = m->handle;
+            found = 1;
+            if (remove) {
+                *link = m->next;
+                free(m);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&handle_lock);
+    return found;
+}
+
+// Replay through the kernel.  Paths are made relative to the mount point.
+
+static char *mount_path(const char *path, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s%s", mountpoint, path);
+    return buf;
+}
+
+static long sys_result(long res)
+{
+    return res == -1 ? -errno : res;
+}
+
+static long replay_mount(const struct req *r)
+{
+    char p[PATH_MAX];
+    char p2[PATH_MAX];
+    char target[PATH_MAX];
+    uintptr_t h;
+    long res;
+
+    switch (r->type) {
+        case REQ_GETATTR: {
+            struct stat st;
+            return sys_result(lstat(mount_path(r->path, p, sizeof(p)), &st));
+        }
+        case REQ_ACCESS:
+            return sys_result(access(mount_path(r->path, p, sizeof(p)), r->args[0]));
+        case REQ_READLINK:
+            res = readlink(mount_path(r->path, p, sizeof(p)), target, sizeof(target));
+            return res == -1 ? -errno : 0;
+        case REQ_OPENDIR: {
+            DIR *d = opendir(mount_path(r->path, p, sizeof(p)));
+            if (d == NULL) {
+                return -errno;
+            }
+            handle_set(r->args[0], (uintptr_t)d);
+            return 0;
+        }
+        case REQ_READDIR:
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            // The kernel's batches cannot be reproduced; read the whole
+            // directory once, when listing starts.
+            if (r->args[1] == 0) {
+                rewinddir((DIR *)h);
+                errno = 0;
+                while (readdir((DIR *)h) != NULL) {
+                }
+                return -errno;
+            }
+            return 0;
+        case REQ_RELEASEDIR:
+            if (!handle_find(r->args[0], &h, 1)) {
+                return -EBADF;
+            }
+            return sys_result(closedir((DIR *)h));
+        case REQ_MKDIR:
+            return sys_result(mkdir(mount_path(r->path, p, sizeof(p)), r->args[0]));
+        case REQ_UNLINK:
+            return sys_result(unlink(mount_path(r->path, p, sizeof(p))));
+        case REQ_RMDIR:
+            return sys_result(rmdir(mount_path(r->path, p, sizeof(p))));
+        case REQ_SYMLINK:
+            return sys_result(symlink(r->path, mount_path(r->path2, p, sizeof(p))));
+        case REQ_RENAME:
+            return sys_result(renameat2(AT_FDCWD, mount_path(r->path, p, sizeof(p)),
+                                        AT_FDCWD, mount_path(r->path2, p2, sizeof(p2)),
+                                        r->args[0]));
+        case REQ_LINK:
+            return sys_result(link(mount_path(r->path, p, sizeof(p)),
+                                   mount_path(r->path2, p2, sizeof(p2))));
+        case REQ_CHMOD:
+            return sys_result(chmod(mount_path(r->path, p, sizeof(p)), r->args[0]));
+        case REQ_CHOWN:
+            return sys_result(lchown(mount_path(r->path, p, sizeof(p)), r->args[0], r->args[1]));
+        case REQ_TRUNCATE:
+            if (r->args[0] == -1) {
+                return sys_result(truncate(mount_path(r->path, p, sizeof(p)), r->args[1]));
+            }
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            return sys_result(ftruncate(h, r->args[1]));
+        case REQ_UTIMENS: {
+            struct timespec ts[2] = {
+                { .tv_sec = r->args[0], .tv_nsec = r->args[1] },
+                { .tv_sec = r->args[2], .tv_nsec = r->args[3] },
+            };
+            return sys_result(utimensat(AT_FDCWD, mount_path(r->path, p, sizeof(p)),
+                                        ts, AT_SYMLINK_NOFOLLOW));
+        }
+        case REQ_CREATE:
+        case REQ_OPEN: {
+            int fd = open(mount_path(r->path, p, sizeof(p)), r->args[0],
+                          r->type == REQ_CREATE ? r->args[1] : 0);
+            if (fd == -1) {
+                return -errno;
+            }
+            handle_set(r->args[r->type == REQ_CREATE ? 2 : 1], fd);
+            return 0;
+        }
+        case REQ_READ:
+        case REQ_WRITE: {
+            int fd;
+            int tmp = -1;
+            if (r->args[0] == -1) {
+                tmp = open(mount_path(r->path, p, sizeof(p)),
+                           r->type == REQ_READ ? O_RDONLY : O_WRONLY);
+                if (tmp == -1) {
+                    return -errno;
+                }
+                fd = tmp;
+            } else if (handle_find(r->args[0], &h, 0)) {
+                fd = h;
+            } else {
+                return -EBADF;
+            }
+            if (r->type == REQ_READ) {
+                char *buf = malloc(r->args[1] ? r->args[1] : 1);
+                res = buf ? sys_result(pread(fd, buf, r->args[1], r->args[2])) : -ENOMEM;
+                free(buf);
+            } else {
+                res = sys_result(pwrite(fd, write_data, r->args[1], r->args[2]));
+            }
+            if (tmp != -1) {
+                close(tmp);
+            }
+            return res;
+        }
+        case REQ_FLUSH:
+            // The kernel flushes a file whenever a descriptor of it is closed.
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            return sys_result(close(dup(h)));
+        case REQ_RELEASE:
+            if (!handle_find(r->args[0], &h, 1)) {
+                return -EBADF;
+            }
+            return sys_result(close(h));
+        case REQ_FSYNC:
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            return sys_result(r->args[1] ? fdatasync(h) : fsync(h));
+        case REQ_FSYNCDIR:
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            return sys_result(r->args[1] ? fdatasync(dirfd((DIR *)h)) : fsync(dirfd((DIR *)h)));
+        case REQ_FALLOCATE:
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            return sys_result(fallocate(h, r->args[1], r->args[2], r->args[3]));
+        case REQ_COPY_FILE_RANGE: {
+            uintptr_t out;
+            if (!handle_find(r->args[0], &h, 0) || !handle_find(r->args[2], &out, 0)) {
+                return -EBADF;
+            }
+            loff_t off_in = r->args[1];
+            loff_t off_out = r->args[3];
+            return sys_result(copy_file_range(h, &off_in, out, &off_out, r->args[4], r->args[5]));
+        }
+        case REQ_LSEEK:
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            return sys_result(lseek(h, r->args[1], r->args[2]));
+        case REQ_SETXATTR:
+            return sys_result(lsetxattr(mount_path(r->path, p, sizeof(p)), r->path2,
+                                        write_data, r->args[0], r->args[1]));
+        case REQ_GETXATTR:
+        case REQ_LISTXATTR: {
+            char *buf = malloc(r->args[0] ? r->args[0] : 1);
+            if (buf == NULL) {
+                return -ENOMEM;
+            }
+            mount_path(r->path, p, sizeof(p));
+            res = sys_result(r->type == REQ_GETXATTR ? lgetxattr(p, r->path2, buf, r->args[0])
+                                                     : llistxattr(p, buf, r->args[0]));
+            free(buf);
+            return res;
+        }
+        case REQ_REMOVEXATTR:
+            return sys_result(lremovexattr(mount_path(r->path, p, sizeof(p)), r->path2));
+        default:
+            return -ENOSYS;
+    }
+}
+
+// Replay straight into the verified operations, as the path-based front end
+// calls them.
+
+static const char *rel_path(const char *path)
+{
+    return strcmp(path, "/") == 0 ? "." : path + 1;
+}
+
+static long replay_direct(const struct req *r)
+{
+    uintptr_t h;
+    long res;
+
+    switch (r->type) {
+        case REQ_GETATTR: {
+            struct stat st;
+            return mirror_getattr(mntfds, rel_path(r->path), &st);
+        }
+        case REQ_ACCESS:
+            return mirror_access(mntfds, rel_path(r->path), r->args[0]);
+        case REQ_READLINK: {
+            char buf[PATH_MAX];
+            return mirror_readlink(mntfds, rel_path(r->path), buf,
+                                   r->args[0] < PATH_MAX ? r->args[0] : PATH_MAX);
+        }
+        case REQ_OPENDIR: {
+            struct mirror_dir *d;
+            res = mirror_opendir(mntfds, rel_path(r->path), &d);
+            if (res == 0) {
+                handle_set(r->args[0], (uintptr_t)d);
+            }
+            return res;
+        }
+        case REQ_READDIR: {
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            struct mirror_dir *d = (struct mirror_dir *)h;
+            res = mirror_dir_seek(d, r->args[1]);
+            for (size_t i = r->args[1]; res == 0 && r->args[2] && i < d->count; i++) {
+                const char *name = d->names + d->entries[i].name;
+                struct stat st;
+                if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+                    mirror_getattr(d->fds, name, &st);
+                }
+            }
+            return res;
+        }
+        case REQ_RELEASEDIR:
+            if (!handle_find(r->args[0], &h, 1)) {
+                return -EBADF;
+            }
+            mirror_releasedir((struct mirror_dir *)h);
+            return 0;
+        case REQ_MKDIR:
+            return mirror_mkdir(mntfds, rel_path(r->path), r->args[0]);
+        case REQ_UNLINK:
+            return mirror_unlink(mntfds, rel_path(r->path));
+        case REQ_RMDIR:
+            return mirror_rmdir(mntfds, rel_path(r->path));
+        case REQ_SYMLINK:
+            return mirror_symlink(r->path, mntfds, rel_path(r->path2));
+        case REQ_RENAME:
+            if (r->args[0] != 0) {
+                return -EINVAL;
+            }
+            return mirror_rename(mntfds, rel_path(r->path), mntfds, rel_path(r->path2));
+        case REQ_LINK:
+            return mirror_link(mntfds, rel_path(r->path), mntfds, rel_path(r->path2));
+        case REQ_CHMOD:
+            return mirror_chmod(mntfds, rel_path(r->path), r->args[0]);
+        case REQ_CHOWN:
+            return mirror_chown(mntfds, rel_path(r->path), r->args[0], r->args[1]);
+        case REQ_TRUNCATE:
+            if (r->args[0] == -1) {
+                return mirror_truncate(mntfds, rel_path(r->path), r->args[1]);
+            }
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            coalesce_writeout(handle_get(h));
+            return mirror_ftruncate(handle_get(h)->fds, r->args[1]);
+        case REQ_UTIMENS: {
+            struct timespec ts[2] = {
+                { .tv_sec = r->args[0], .tv_nsec = r->args[1] },
+                { .tv_sec = r->args[2], .tv_nsec = r->args[3] },
+            };
+            return mirror_utimens(mntfds, rel_path(r->path), ts);
+        }
+        case REQ_CREATE:
+        case REQ_OPEN: {
+            uint64_t fh;
+            res = mirror_open(mntfds, rel_path(r->path), r->args[0],
+                              r->type == REQ_CREATE ? r->args[1] : 0, &fh);
+            if (res == 0) {
+                handle_set(r->args[r->type == REQ_CREATE ? 2 : 1], fh);
+            }
+            return res;
+        }
+        case REQ_READ:
+        case REQ_WRITE: {
+            uint64_t fh;
+            int opened = 0;
+            if (r->args[0] == -1) {
+                res = mirror_open(mntfds, rel_path(r->path),
+                                  r->type == REQ_READ ? O_RDONLY : O_WRONLY, 0, &fh);
+                if (res != 0) {
+                    return res;
+                }
+                opened = 1;
+            } else if (handle_find(r->args[0], &h, 0)) {
+                fh = h;
+            } else {
+                return -EBADF;
+            }
+            if (r->type == REQ_READ) {
+                char *buf = malloc(r->args[1] ? r->args[1] : 1);
+                res = buf ? mirror_read(handle_get(fh)->fds, buf, r->args[1], r->args[2]) : -ENOMEM;
+                free(buf);
+            } else {
+                res = mirror_write(handle_get(fh)->fds, write_data, r->args[1], r->args[2]);
+            }
+            if (opened) {
+                mirror_release(fh);
+            }
+            return res;
+        }
+        case REQ_FLUSH: {
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            int flushed = coalesce_flush(handle_get(h));
+            res = mirror_flush(handle_get(h)->fds);
+            return flushed != 0 ? flushed : res;
+        }
+        case REQ_RELEASE:
+            if (!handle_find(r->args[0], &h, 1)) {
+                return -EBADF;
+            }
+            return mirror_release(h);
+        case REQ_FSYNC: {
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            int flushed = coalesce_flush(handle_get(h));
+            res = mirror_fsync(handle_get(h)->fds, r->args[1]);
+            return flushed != 0 ? flushed : res;
+        }
+        case REQ_FSYNCDIR:
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            return mirror_fsyncdir((struct mirror_dir *)h, r->args[1]);
+        case REQ_FALLOCATE:
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            coalesce_writeout(handle_get(h));
+            return mirror_fallocate(handle_get(h)->fds, r->args[1], r->args[2], r->args[3]);
+        case REQ_COPY_FILE_RANGE: {
+            uintptr_t out;
+            if (!handle_find(r->args[0], &h, 0) || !handle_find(r->args[2], &out, 0)) {
+                return -EBADF;
+            }
+            coalesce_writeout(handle_get(h));
+            coalesce_writeout(handle_get(out));
+            return mirror_copy_file_range(handle_get(h)->fds, r->args[1], handle_get(out)->fds,
+                                          r->args[3], r->args[4], r->args[5]);
+        }
+        case REQ_LSEEK:
+            if (!handle_find(r->args[0], &h, 0)) {
+                return -EBADF;
+            }
+            coalesce_writeout(handle_get(h));
+            return mirror_lseek(handle_get(h)->fds, r->args[1], r->args[2]);
+        case REQ_SETXATTR:
+            return mirror_setxattr(mntfds, rel_path(r->path), r->path2, write_data,
+                                   r->args[0], r->args[1]);
+        case REQ_GETXATTR:
+        case REQ_LISTXATTR: {
+            char *buf = malloc(r->args[0] ? r->args[0] : 1);
+            if (buf == NULL) {
+                return -ENOMEM;
+            }
+            res = r->type == REQ_GETXATTR
+                      ? mirror_getxattr(mntfds, rel_path(r->path), r->path2, buf, r->args[0])
+                      : mirror_listxattr(mntfds, rel_path(r->path), buf, r->args[0]);
+            free(buf);
+            return res;
+        }
+        case REQ_REMOVEXATTR:
+            return mirror_removexattr(mntfds, rel_path(r->path), r->path2);
+        default:
+            return -ENOSYS;
+    }
+}
+
+static void replay(struct req *r)
+{
+    if (paced) {
+        uint64_t due = replay_start + (r->start - reqs[0].start);
+        uint64_t now = now_ns();
+        if (due > now) {
+            struct timespec ts = {
+                .tv_sec = (due - now) / 1000000000,
+                .tv_nsec = (due - now) % 1000000000,
+            };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    uint64_t start = now_ns();
+    r->replayed = direct ? replay_direct(r) : replay_mount(r);
+    r->nsecs = now_ns() - start;
+
+    if (verbose && r->replayed != r->res) {
+        fprintf(stderr, "%s %s%s%s: %ld, recorded %ld\n", req_types[r->type].name,
+                r->path ? r->path : "", r->path2 ? " " : "", r->path2 ? r->path2 : "",
+                r->replayed, r->res);
+    }
+}
+
+static void *replay_thread(void *arg)
+{
+    int thread = (intptr_t)arg;
+
+    for (size_t i = 0; i < req_count; i++) {
+        if (reqs[i].thread == thread) {
+            replay(&reqs[i]);
+        }
+    }
+    return NULL;
+}
+
+static void replay_threads(void)
+{
+    int *threads = malloc(req_count * sizeof(int));
+    size_t count = 0;
+
+    if (threads == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < req_count; i++) {
+        size_t j = 0;
+        while (j < count && threads[j] != reqs[i].thread) {
+            j++;
+        }
+        if (j == count) {
+            threads[count++] = reqs[i].thread;
+        }
+    }
+
+    pthread_t *tids = calloc(count, sizeof(pthread_t));
+    if (tids == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (size_t j = 0; j < count; j++) {
+        int err = pthread_create(&tids[j], NULL, replay_thread, (void *)(intptr_t)threads[j]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    for (size_t j = 0; j < count; j++) {
+        pthread_join(tids[j], NULL);
+    }
+    free(tids);
+    free(threads);
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Print latency percentiles of the requests of type, or of all with -1.
+static void report(int type, uint64_t *lat)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < req_count; i++) {
+        if (type == -1 || reqs[i].type == (enum req_type)type) {
+            lat[n++] = reqs[i].nsecs;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    qsort(lat, n, sizeof(*lat), u64_cmp);
+
+    static const double percentiles[] = { 0.50, 0.90, 0.99, 0.999 };
+    printf("%s\t%zu", type == -1 ? "all" : req_types[type].name, n);
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+        printf("\t%.1f", lat[(size_t)(percentiles[p] * (n - 1))] / 1e3);
+    }
+    printf("\t%.1f\n", lat[n - 1] / 1e3);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s [-p] [-j] [-v] trace mountpoint\n"
+                    "       %s -d [-p] [-j] [-v] trace mntpath1 [mntpath2 ...]\n",
+            progname, progname);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int threaded = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dpjv")) != -1) {
+        switch (opt) {
+            case 'd':
+                direct = 1;
+                break;
+            case 'p':
+                paced = 1;
+                break;
+            case 'j':
+                threaded = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || (!direct && argc - optind != 2) ||
+        argc - optind - 1 > MAX_MNTPATHS) {
+        usage(argv[0]);
+    }
+
+    load_trace(argv[optind]);
+    write_data = malloc(write_max ? write_max : 1);
+    if (write_data == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < write_max; i++) {
+        write_data[i] = i * 31 + 7;
+    }
+
+    if (direct) {
+        for (int i = optind + 1; i < argc; i++) {
+            mntfds[mntpath_count] = open(argv[i], O_DIRECTORY);
+            if (mntfds[mntpath_count] == -1) {
+                fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+                return 1;
+            }
+            mntpath_count++;
+        }
+        stat_compare_init(NULL);
+        int res = fanout_start();
+        if (res != 0) {
+            fprintf(stderr, "Could not start fan-out workers, running serially: %s\n",
+                    strerror(-res));
+        }
+    } else {
+        mountpoint = argv[optind + 1];
+    }
+
+    replay_start = now_ns();
+    if (threaded) {
+        replay_threads();
+    } else {
+        for (size_t i = 0; i < req_count; i++) {
+            replay(&reqs[i]);
+        }
+    }
+    double elapsed = (now_ns() - replay_start) / 1e9;
+
+    if (direct) {
+        fanout_stop();
+    }
+
+    size_t differ = 0;
+    for (size_t i = 0; i < req_count; i++) {
+        differ += reqs[i].replayed != reqs[i].res;
+    }
+    printf("# %zu requests in %.3f s, %.0f requests/s, %zu results differ from the trace\n",
+           req_count, elapsed, elapsed > 0 ? req_count / elapsed : 0.0, differ);
+    printf("op\tcount\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\n");
+
+    uint64_t *lat = malloc((req_count ? req_count : 1) * sizeof(*lat));
+    if (lat == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    report(-1, lat);
+    for (int type = 0; type < REQ_TYPE_COUNT; type++) {
+        report(type, lat);
+    }
+    free(lat);
+    return 0;
+}
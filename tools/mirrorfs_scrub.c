@@ -0,0 +1,785 @@
+// Check mirrors for consistency offline, without mounting them.
+//
+// usage: mirrorfs_scrub [-t threads] [-s fields] [-m] [-n] [-u] [-p] mntpath1 mntpath2 ...
+//
+// Walks every mirror in parallel and compares directory listings,
+// attributes, symlink targets and the contents of regular files whose sizes
+// agree against the first mirror, with the same checks mirrorfs applies to
+// the requests it serves.  Differences are printed as they are found.
+//
+// -t sets the number of threads walking the mirrors, by default one per
+// CPU.  Each thread works through a queue of directories and large files of
+// its own and takes work from the others' when it runs out.  -s lists the
+// attributes compared, like -o verify_stat.  -m maps files instead of
+// reading them, -n only compares listings, attributes and symlinks, -u
+// submits each mirror's part of a request at once through io_uring and -p
+// prints progress every second.  The mirrors must not change while they
+// are scrubbed.
+//
+// Prints totals and throughput at the end.  Exits with 0 when the mirrors
+// agree, 1 when they differ and 2 when some objects could not be compared.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../mirrorfs.h"
+
+// Globals the verified operations expect from the file system proper.
+int mntfds[MAX_MNTPATHS];
+int mntpath_count;
+struct mirrorfs_options options;
+
+#define SCRUB_CHUNK (1024 * 1024)     // bytes compared at a time
+#define SCRUB_INLINE SCRUB_CHUNK      // larger files become jobs of their own
+#define LISTING_BUF_SIZE (32 * 1024)
+
+static int use_mmap;
+static int compare_contents = 1;
+
+// A directory to walk or a large file to compare, by its path relative to
+// the mirrors' roots.
+struct job {
+    int dir;
+    char path[];
+};
+
+// Each worker's jobs form a deque.  The owner pushes and pops at the back,
+// so it walks depth first and its queue stays short, while idle workers
+// steal from the front, which holds the shallowest directories and so the
+// largest pieces of work.
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct job **jobs;        // ring buffer
+    size_t front;
+    size_t count;
+    size_t capacity;
+    unsigned seed;
+    atomic_ulong dirs;
+    atomic_ulong files;
+    atomic_ulong others;
+    atomic_ulong bytes;       // compared, per mirror
+} __attribute__((aligned(64)));
+
+static struct worker *workers;
+static unsigned worker_count;
+
+// Jobs queued or running; the walk is over when it drops to zero.
+static atomic_long pending;
+// Bumped by every push, so that idle workers can tell they missed one.
+static atomic_ulong pushes;
+static atomic_int idle;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static atomic_ulong differences;
+static atomic_ulong errors;
+
+static void report(const char *path, int replica, const char *what)
+{
+    fprintf(stderr, "%s: replica %d %s\n", path, replica, what);
+    atomic_fetch_add(&differences, 1);
+}
+
+static void report_values(const char *path, int replica, const char *what,
+                          long primary, long value)
+{
+    fprintf(stderr, "%s: replica %d %s %ld != %ld\n", path, replica, what, primary, value);
+    atomic_fetch_add(&differences, 1);
+}
+
+// Check that every replica's part of call had the primary's outcome.
+// Returns the primary's result, or -1 when the call failed or diverged.
+static ssize_t check_call(const struct mirror_call *call, const char *path)
+{
+    int agree = 1;
+
+    for (int i = 1; i < mntpath_count; i++) {
+        if (call->errnos[i] != call->errnos[0]) {
+            report_values(path, i, mirror_op_name(call->op), call->errnos[0], call->errnos[i]);
+            agree = 0;
+        }
+    }
+    if (call->res[0] == -1) {
+        fprintf(stderr, "%s: %s: %s\n", path, mirror_op_name(call->op),
+                strerror(call->errnos[0]));
+        atomic_fetch_add(&errors, 1);
+        return -1;
+    }
+    return agree ? call->res[0] : -1;
+}
+
+static void close_all(const int *fds)
+{
+    for (int i = 0; i < mntpath_count; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+}
+
+static int open_all(const int *dirfds, const char *name, const char *path, int flags,
+                    int fds[MAX_MNTPATHS])
+{
+    struct mirror_call call = {
+        .op = MIRROR_OPENAT,
+        .fds = dirfds,
+        .path = name,
+        .flags = flags | O_NOFOLLOW | O_CLOEXEC,
+        .newfds = fds,
+    };
+
+    mirror_call_run(&call);
+    if (check_call(&call, path) == -1) {
+        close_all(fds);
+        return -1;
+    }
+    return 0;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    char *path;
+
+    if (strcmp(dir, ".") == 0) {
+        return strdup(name);
+    }
+    if (asprintf(&path, "%s/%s", dir, name) == -1) {
+        return NULL;
+    }
+    return path;
+}
+
+static void push(struct worker *w, int dir, const char *path)
+{
+    size_t len = strlen(path) + 1;
+    struct job *job = malloc(sizeof(*job) + len);
+
+    if (job == NULL) {
+        perror("malloc");
+        exit(2);
+    }
+    job->dir = dir;
+    memcpy(job->path, path, len);
+
+    atomic_fetch_add(&pending, 1);
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->capacity) {
+        size_t capacity = w->capacity ? 2 * w->capacity : 64;
+        struct job **jobs = malloc(capacity * sizeof(*jobs));
+        if (jobs == NULL) {
+            perror("malloc");
+            exit(2);
+        }
+        for (size_t k = 0; k < w->count; k++) {
+            jobs[k] = w->jobs[(w->front + k) % w->capacity];
+        }
+        free(w->jobs);
+        w->jobs = jobs;
+        w->front = 0;
+        w->capacity = capacity;
+    }
+    w->jobs[(w->front + w->count) % w->capacity] = job;
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+
+    atomic_fetch_add(&pushes, 1);
+    if (atomic_load(&idle) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static struct job *pop(struct worker *w)
+{
+    struct job *job = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0) {
+        w->count--;
+        job = w->jobs[(w->front + w->count) % w->capacity];
+    }
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+static struct job *steal(struct worker *w)
+{
+    unsigned start = rand_r(&w->seed);
+
+    for (unsigned k = 0; k < worker_count; k++) {
+        struct worker *victim = &workers[(start + k) % worker_count];
+        struct job *job = NULL;
+
+        if (victim == w) {
+            continue;
+        }
+        pthread_mutex_lock(&victim->lock);
+        if (victim->count > 0) {
+            job = victim->jobs[victim->front];
+            victim->front = (victim->front + 1) % victim->capacity;
+            victim->count--;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (job != NULL) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Compare the first size bytes of the files open in fds.
+static void compare_read(struct worker *w, const int *fds, const char *path, off_t size)
+{
+    for (off_t offset = 0; offset < size; ) {
+        struct mirror_call call = {
+            .op = MIRROR_PREAD,
+            .fds = fds,
+            .size = size - offset < SCRUB_CHUNK ? size - offset : SCRUB_CHUNK,
+            .offset = offset,
+        };
+        struct mismatch m;
+
+        if (bufpool_get(call.size, call.bufs) != 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+            atomic_fetch_add(&errors, 1);
+            return;
+        }
+        mirror_call_run(&call);
+        ssize_t len = check_call(&call, path);
+        if (len <= 0) {
+            return;
+        }
+        for (int i = 1; i < mntpath_count; i++) {
+            if (call.res[i] != len) {
+                report_values(path, i, "read", len, call.res[i]);
+                return;
+            }
+        }
+        if (compare_buffers(call.bufs, mntpath_count, len, &m)) {
+            report_mismatch(path, call.bufs, len, offset, &m);
+            atomic_fetch_add(&differences, 1);
+            return;
+        }
+        atomic_fetch_add_explicit(&w->bytes, len, memory_order_relaxed);
+        offset += len;
+    }
+}
+
+static void compare_mapped(struct worker *w, const int *fds, const char *path, off_t size)
+{
+    void *maps[MAX_MNTPATHS] = { NULL };
+
+    for (int i = 0; i < mntpath_count; i++) {
+        maps[i] = mmap(NULL, size, PROT_READ, MAP_SHARED, fds[i], 0);
+        if (maps[i] == MAP_FAILED) {
+            fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+            atomic_fetch_add(&errors, 1);
+            maps[i] = NULL;
+            goto out;
+        }
+        madvise(maps[i], size, MADV_SEQUENTIAL);
+    }
+
+    for (off_t offset = 0; offset < size; offset += SCRUB_CHUNK) {
+        size_t len = size - offset < SCRUB_CHUNK ? size - offset : SCRUB_CHUNK;
+        void *bufs[MAX_MNTPATHS];
+        struct mismatch m;
+
+        for (int i = 0; i < mntpath_count; i++) {
+            bufs[i] = (char *)maps[i] + offset;
+        }
+        if (compare_buffers(bufs, mntpath_count, len, &m)) {
+            report_mismatch(path, bufs, len, offset, &m);
+            atomic_fetch_add(&differences, 1);
+            break;
+        }
+        atomic_fetch_add_explicit(&w->bytes, len, memory_order_relaxed);
+    }
+
+out:
+    for (int i = 0; i < mntpath_count; i++) {
+        if (maps[i] != NULL) {
+            munmap(maps[i], size);
+        }
+    }
+}
+
+static void scrub_file(struct worker *w, const int *dirfds, const char *name,
+                       const char *path, off_t size)
+{
+    int fds[MAX_MNTPATHS];
+
+    if (open_all(dirfds, name, path, O_RDONLY, fds) != 0) {
+        return;
+    }
+    for (int i = 0; i < mntpath_count; i++) {
+        posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (use_mmap) {
+        compare_mapped(w, fds, path, size);
+    } else {
+        compare_read(w, fds, path, size);
+    }
+    close_all(fds);
+}
+
+static void scrub_symlink(const int *dirfds, const char *name, const char *path)
+{
+    struct mirror_call call = {
+        .op = MIRROR_READLINKAT,
+        .fds = dirfds,
+        .path = name,
+        .size = PATH_MAX,
+    };
+
+    if (bufpool_get(PATH_MAX, call.bufs) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+        atomic_fetch_add(&errors, 1);
+        return;
+    }
+    mirror_call_run(&call);
+    ssize_t len = check_call(&call, path);
+    if (len == -1) {
+        return;
+    }
+    for (int i = 1; i < mntpath_count; i++) {
+        if (call.res[i] != len || memcmp(call.bufs[0], call.bufs[i], len) != 0) {
+            report(path, i, "symlink target differs");
+        }
+    }
+}
+
+// Compare the attributes of one entry found in every replica and hand it on
+// according to its type.
+static void scrub_entry(struct worker *w, const int *dirfds, const char *name,
+                        const char *path)
+{
+    struct statx stxs[MAX_MNTPATHS];
+    struct mirror_call call = {
+        .op = MIRROR_STATX,
+        .fds = dirfds,
+        .path = name,
+        .flags = AT_SYMLINK_NOFOLLOW,
+        .mask = stat_mask | STATX_TYPE | STATX_SIZE,
+        .stxs = stxs,
+    };
+
+    mirror_call_run(&call);
+    if (check_call(&call, path) == -1) {
+        return;
+    }
+    atomic_fetch_add(&differences, compare_stats(stxs, path));
+
+    mode_t type = stxs[0].stx_mode & S_IFMT;
+    int sizes_agree = 1;
+    for (int i = 1; i < mntpath_count; i++) {
+        if ((stxs[i].stx_mode & S_IFMT) != type) {
+            report_values(path, i, "type", type, stxs[i].stx_mode & S_IFMT);
+            return;
+        }
+        sizes_agree &= stxs[i].stx_size == stxs[0].stx_size;
+    }
+
+    switch (type) {
+        case S_IFDIR:
+            push(w, 1, path);
+            break;
+        case S_IFLNK:
+            atomic_fetch_add_explicit(&w->others, 1, memory_order_relaxed);
+            scrub_symlink(dirfds, name, path);
+            break;
+        case S_IFREG:
+            atomic_fetch_add_explicit(&w->files, 1, memory_order_relaxed);
+            if (!compare_contents || !sizes_agree || stxs[0].stx_size == 0) {
+                break;
+            }
+            if (stxs[0].stx_size > SCRUB_INLINE) {
+                push(w, 0, path);
+            } else {
+                scrub_file(w, dirfds, name, path, stxs[0].stx_size);
+            }
+            break;
+        default:
+            atomic_fetch_add_explicit(&w->others, 1, memory_order_relaxed);
+            break;
+    }
+}
+
+// One replica's directory entries, sorted by name.
+struct listing {
+    char *names;
+    size_t len;
+    size_t capacity;
+    size_t *entries;          // offsets of the names
+    size_t count;
+    size_t entries_capacity;
+};
+
+static int listing_add(struct listing *l, const char *name)
+{
+    size_t len = strlen(name) + 1;
+
+    if (l->count == l->entries_capacity) {
+        size_t capacity = l->entries_capacity ? 2 * l->entries_capacity : 64;
+        size_t *entries = realloc(l->entries, capacity * sizeof(*entries));
+        if (entries == NULL) {
+            return -1;
+        }
+        l->entries = entries;
+        l->entries_capacity = capacity;
+    }
+    if (l->len + len > l->capacity) {
+        size_t capacity = l->capacity ? 2 * l->capacity : 4096;
+        while (capacity < l->len + len) {
+            capacity *= 2;
+        }
+        char *names = realloc(l->names, capacity);
+        if (names == NULL) {
+            return -1;
+        }
+        l->names = names;
+        l->capacity = capacity;
+    }
+    l->entries[l->count++] = l->len;
+    memcpy(l->names + l->len, name, len);
+    l->len += len;
+    return 0;
+}
+
+static int listing_cmp(const void *a, const void *b, void *names)
+{
+    return strcmp((const char *)names + *(const size_t *)a,
+                  (const char *)names + *(const size_t *)b);
+}
+
+static const char *listing_name(const struct listing *l, size_t k)
+{
+    return l->names + l->entries[k];
+}
+
+// Read every replica's directory, one getdents64 batch per replica at a time.
+static int read_listings(const int *fds, const char *path, struct listing lists[])
+{
+    struct mirror_call call = {
+        .op = MIRROR_GETDENTS,
+        .fds = fds,
+        .size = LISTING_BUF_SIZE,
+    };
+
+    if (bufpool_get(LISTING_BUF_SIZE, call.bufs) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+        atomic_fetch_add(&errors, 1);
+        return -1;
+    }
+    for (;;) {
+        int more = 0;
+
+        mirror_call_run(&call);
+        if (check_call(&call, path) == -1) {
+            return -1;
+        }
+        for (int i = 0; i < mntpath_count; i++) {
+            for (ssize_t pos = 0; pos < call.res[i]; ) {
+                const struct dirent64 *de = (const struct dirent64 *)((char *)call.bufs[i] + pos);
+                if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
+                    listing_add(&lists[i], de->d_name) != 0) {
+                    fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+                    atomic_fetch_add(&errors, 1);
+                    return -1;
+                }
+                pos += de->d_reclen;
+            }
+            more |= call.res[i] > 0;
+        }
+        if (!more) {
+            break;
+        }
+    }
+    for (int i = 0; i < mntpath_count; i++) {
+        qsort_r(lists[i].entries, lists[i].count, sizeof(size_t), listing_cmp, lists[i].names);
+    }
+    return 0;
+}
+
+// Merge the sorted listings against the primary's, reporting names missing
+// from or only found in a replica, and go on with the names found in all.
+static void scrub_dir(struct worker *w, const char *path)
+{
+    int fds[MAX_MNTPATHS];
+    struct listing lists[MAX_MNTPATHS];
+    size_t pos[MAX_MNTPATHS] = { 0 };
+
+    atomic_fetch_add_explicit(&w->dirs, 1, memory_order_relaxed);
+    if (open_all(mntfds, path, path, O_RDONLY | O_DIRECTORY, fds) != 0) {
+        return;
+    }
+    memset(lists, 0, sizeof(lists));
+    if (read_listings(fds, path, lists) != 0) {
+        goto out;
+    }
+
+    for (size_t k = 0; k < lists[0].count; k++) {
+        const char *name = listing_name(&lists[0], k);
+        char *child = join_path(path, name);
+        int everywhere = 1;
+
+        if (child == NULL) {
+            perror("malloc");
+            exit(2);
+        }
+        for (int i = 1; i < mntpath_count; i++) {
+            int cmp = -1;
+            while (pos[i] < lists[i].count &&
+                   (cmp = strcmp(listing_name(&lists[i], pos[i]), name)) < 0) {
+                char *extra = join_path(path, listing_name(&lists[i], pos[i]));
+                report(extra != NULL ? extra : path, i, "has an extra entry");
+                free(extra);
+                pos[i]++;
+            }
+            if (cmp == 0) {
+                pos[i]++;
+            } else {
+                report(child, i, "is missing the entry");
+                everywhere = 0;
+            }
+        }
+        if (everywhere) {
+            scrub_entry(w, fds, name, child);
+        }
+        free(child);
+    }
+    for (int i = 1; i < mntpath_count; i++) {
+        for (; pos[i] < lists[i].count; pos[i]++) {
+            char *extra = join_path(path, listing_name(&lists[i], pos[i]));
+            report(extra != NULL ? extra : path, i, "has an extra entry");
+            free(extra);
+        }
+    }
+
+out:
+    for (int i = 0; i < mntpath_count; i++) {
+        free(lists[i].names);
+        free(lists[i].entries);
+    }
+    close_all(fds);
+}
+
+static void run_job(struct worker *w, struct job *job)
+{
+    if (job->dir) {
+        scrub_dir(w, job->path);
+        return;
+    }
+
+    struct statx stx;
+    if (statx(mntfds[0], job->path, AT_SYMLINK_NOFOLLOW, STATX_SIZE, &stx) == -1) {
+        fprintf(stderr, "%s: statx: %s\n", job->path, strerror(errno));
+        atomic_fetch_add(&errors, 1);
+        return;
+    }
+    scrub_file(w, mntfds, job->path, job->path, stx.stx_size);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+
+    for (;;) {
+        unsigned long seen = atomic_load(&pushes);
+        struct job *job = pop(w);
+
+        if (job == NULL) {
+            job = steal(w);
+        }
+        if (job != NULL) {
+            run_job(w, job);
+            free(job);
+            if (atomic_fetch_sub(&pending, 1) == 1) {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_broadcast(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            }
+            continue;
+        }
+
+        // Sleep until something is pushed or the walk is over.
+        pthread_mutex_lock(&idle_lock);
+        atomic_fetch_add(&idle, 1);
+        while (atomic_load(&pushes) == seen && atomic_load(&pending) != 0) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        atomic_fetch_sub(&idle, 1);
+        pthread_mutex_unlock(&idle_lock);
+        if (atomic_load(&pending) == 0) {
+            return NULL;
+        }
+    }
+}
+
+struct totals {
+    unsigned long dirs;
+    unsigned long files;
+    unsigned long others;
+    unsigned long bytes;
+};
+
+static struct totals totals(void)
+{
+    struct totals t = { 0 };
+
+    for (unsigned k = 0; k < worker_count; k++) {
+        t.dirs += atomic_load_explicit(&workers[k].dirs, memory_order_relaxed);
+        t.files += atomic_load_explicit(&workers[k].files, memory_order_relaxed);
+        t.others += atomic_load_explicit(&workers[k].others, memory_order_relaxed);
+        t.bytes += atomic_load_explicit(&workers[k].bytes, memory_order_relaxed);
+    }
+    return t;
+}
+
+static double now_s(void)
+{
+    return monotonic_ns() / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-s fields] [-m] [-n] [-u] [-p] "
+            "mntpath1 mntpath2 ...\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *fields = NULL;
+    int progress = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:mnup")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = atol(optarg);
+                break;
+            case 's':
+                fields = optarg;
+                break;
+            case 'm':
+                use_mmap = 1;
+                break;
+            case 'n':
+                compare_contents = 0;
+                break;
+            case 'u':
+                options.uring = 1;
+                break;
+            case 'p':
+                progress = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || argc - optind > MAX_MNTPATHS || threads < 1) {
+        usage(argv[0]);
+    }
+
+    for (int i = optind; i < argc; i++) {
+        mntfds[mntpath_count] = open(argv[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (mntfds[mntpath_count] == -1) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            return 2;
+        }
+        mntpath_count++;
+    }
+    if (stat_compare_init(fields) != 0) {
+        return 2;
+    }
+    // Differences are counted and reported here; the workers issue their
+    // replica calls themselves, or through io_uring with -u.
+    divergence_policy = DIVERGENCE_LOG;
+    options.serial = 1;
+
+    // The roots themselves.
+    struct statx stxs[MAX_MNTPATHS];
+    struct mirror_call call = {
+        .op = MIRROR_STATX,
+        .fds = mntfds,
+        .mask = stat_mask,
+        .stxs = stxs,
+    };
+    mirror_call_run(&call);
+    if (check_call(&call, ".") != -1) {
+        atomic_fetch_add(&differences, compare_stats(stxs, "."));
+    }
+
+    worker_count = threads;
+    workers = calloc(worker_count, sizeof(*workers));
+    if (workers == NULL) {
+        perror("calloc");
+        return 2;
+    }
+    for (unsigned k = 0; k < worker_count; k++) {
+        pthread_mutex_init(&workers[k].lock, NULL);
+        workers[k].seed = k + 1;
+    }
+    push(&workers[0], 1, ".");
+
+    double start = now_s();
+    for (unsigned k = 0; k < worker_count; k++) {
+        int err = pthread_create(&workers[k].thread, NULL, worker_main, &workers[k]);
+        if (err != 0) {
+            fprintf(stderr, "Could not start worker %u: %s\n", k, strerror(err));
+            return 2;
+        }
+    }
+
+    if (progress) {
+        pthread_mutex_lock(&idle_lock);
+        while (atomic_load(&pending) != 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec++;
+            pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+            if (atomic_load(&pending) != 0) {
+                struct totals t = totals();
+                double elapsed = now_s() - start;
+                fprintf(stderr, "scrub: %lu directories, %lu files, %.1f MiB, %.0f files/s, "
+                        "%.1f MiB/s\n", t.dirs, t.files, t.bytes / 1048576.0,
+                        t.files / elapsed, t.bytes / 1048576.0 / elapsed);
+            }
+        }
+        pthread_mutex_unlock(&idle_lock);
+    }
+    for (unsigned k = 0; k < worker_count; k++) {
+        pthread_join(workers[k].thread, NULL);
+    }
+    double elapsed = now_s() - start;
+
+    struct totals t = totals();
+    unsigned long diffs = atomic_load(&differences);
+    unsigned long errs = atomic_load(&errors);
+    printf("%lu directories, %lu files, %lu others, %.1f MiB compared per mirror "
+           "in %.3f s by %u threads\n", t.dirs, t.files, t.others, t.bytes / 1048576.0,
+           elapsed, worker_count);
+    printf("%.0f entries/s, %.1f MiB/s per mirror, %.1f MiB/s read in total\n",
+           elapsed > 0 ? (t.dirs + t.files + t.others) / elapsed : 0.0,
+           elapsed > 0 ? t.bytes / 1048576.0 / elapsed : 0.0,
+           elapsed > 0 ? t.bytes * mntpath_count / 1048576.0 / elapsed : 0.0);
+    printf("%lu differences, %lu errors\n", diffs, errs);
+    return diffs > 0 ? 1 : errs > 0 ? 2 : 0;
+}
@@ -0,0 +1,546 @@
+#define FUSE_USE_VERSION 312
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mirrorfs.h"
+
+// Request traces for the path-based front end.  trace_wrap() puts a layer in
+// front of the file system operations that times every request and writes
+// one line per request once it has been answered:
+//
+//     <start ns> <thread> <operation> <arguments...> = <result>
+//
+// Start times are relative to the start of the trace, so lines of requests
+// that overlapped may appear out of order.  Paths are escaped so that they
+// never contain white space; file contents are not recorded.  Open files and
+// directories are identified by the handle the operation returned, which
+// tools/mirrorfs_replay maps to its own.
+
+#define TRACE_PATH_MAX (3 * 4096 + 1)
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_start;
+
+static struct fuse_operations trace_oper;
+static const struct fuse_operations *next_oper;
+
+static void escape(char *dst, const char *src)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    for (const unsigned char *p = (const unsigned char *)src; *p != '\0'; p++) {
+        if (*p <= ' ' || *p >= 0x7f || *p == '%') {
+            *dst++ = '%';
+            *dst++ = hex[*p >> 4];
+            *dst++ = hex[*p & 0xf];
+        } else {
+            *dst++ = *p;
+        }
+    }
+    *dst = '\0';
+}
+
+__attribute__((format(printf, 3, 4)))
+static void trace_line(uint64_t start, long res, const char *fmt, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace_file, "%llu %d ", (unsigned long long)(start - trace_start), gettid());
+    va_start(ap, fmt);
+    vfprintf(trace_file, fmt, ap);
+    va_end(ap);
+    fprintf(trace_file, " = %ld\n", res);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Trace an operation that takes a path and nothing else of interest.
+#define TRACE_PATH(op, path, call) \
+    ({ \
+        uint64_t _start = monotonic_ns(); \
+        int _res = (call); \
+        char _p[TRACE_PATH_MAX]; \
+        escape(_p, (path)); \
+        trace_line(_start, _res, op " %s", _p); \
+        _res; \
+    })
+
+static uint64_t trace_fh(const struct fuse_file_info *fi)
+{
+    return fi != NULL ? fi->fh : (uint64_t)-1;
+}
+
+static void *trace_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    return next_oper->init(conn, cfg);
+}
+
+static void trace_destroy(void *private_data)
+{
+    if (next_oper->destroy != NULL) {
+        next_oper->destroy(private_data);
+    }
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+static int trace_getattr(const char *path, struct stat *stbuf,
+                         struct fuse_file_info *fi)
+{
+    return TRACE_PATH("getattr", path, next_oper->getattr(path, stbuf, fi));
+}
+
+static int trace_access(const char *path, int mask)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->access(path, mask);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "access %s %d", p, mask);
+    return res;
+}
+
+static int trace_readlink(const char *path, char *buf, size_t size)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->readlink(path, buf, size);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "readlink %s %zu", p, size);
+    return res;
+}
+
+static int trace_opendir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->opendir(path, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "opendir %s %llu", p,
+               (unsigned long long)(res == 0 ? fi->fh : (uint64_t)-1));
+    return res;
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi,
+                         enum fuse_readdir_flags flags)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->readdir(path, buf, filler, offset, fi, flags);
+
+    trace_line(start, res, "readdir %llu %lld %d", (unsigned long long)trace_fh(fi),
+               (long long)offset, (flags & FUSE_READDIR_PLUS) != 0);
+    return res;
+}
+
+static int trace_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    uint64_t fh = trace_fh(fi);
+    int res = next_oper->releasedir(path, fi);
+
+    trace_line(start, res, "releasedir %llu", (unsigned long long)fh);
+    return res;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->mkdir(path, mode);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "mkdir %s 0%o", p, mode);
+    return res;
+}
+
+static int trace_unlink(const char *path)
+{
+    return TRACE_PATH("unlink", path, next_oper->unlink(path));
+}
+
+static int trace_rmdir(const char *path)
+{
+    return TRACE_PATH("rmdir", path, next_oper->rmdir(path));
+}
+
+static int trace_symlink(const char *from, const char *to)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->symlink(from, to);
+    char f[TRACE_PATH_MAX];
+    char t[TRACE_PATH_MAX];
+
+    escape(f, from);
+    escape(t, to);
+    trace_line(start, res, "symlink %s %s", f, t);
+    return res;
+}
+
+static int trace_rename(const char *from, const char *to, unsigned int flags)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->rename(from, to, flags);
+    char f[TRACE_PATH_MAX];
+    char t[TRACE_PATH_MAX];
+
+    escape(f, from);
+    escape(t, to);
+    trace_line(start, res, "rename %s %s %u", f, t, flags);
+    return res;
+}
+
+static int trace_link(const char *from, const char *to)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->link(from, to);
+    char f[TRACE_PATH_MAX];
+    char t[TRACE_PATH_MAX];
+
+    escape(f, from);
+    escape(t, to);
+    trace_line(start, res, "link %s %s", f, t);
+    return res;
+}
+
+static int trace_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->chmod(path, mode, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "chmod %s 0%o", p, mode);
+    return res;
+}
+
+static int trace_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->truncate(path, size, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "truncate %s %llu %lld", p, (unsigned long long)trace_fh(fi),
+               (long long)size);
+    return res;
+}
+
+static int trace_chown(const char *path, uid_t uid, gid_t gid,
+                       struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->chown(path, uid, gid, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "chown %s %d %d", p, (int)uid, (int)gid);
+    return res;
+}
+
+static int trace_utimens(const char *path, const struct timespec ts[2],
+                         struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->utimens(path, ts, fi);
+    char p[TRACE_PATH_MAX];
+
+    // A NULL ts sets both times to now.
+    static const struct timespec now[2] = {
+        { .tv_nsec = UTIME_NOW },
+        { .tv_nsec = UTIME_NOW },
+    };
+    if (ts == NULL) {
+        ts = now;
+    }
+    escape(p, path);
+    trace_line(start, res, "utimens %s %lld %ld %lld %ld", p,
+               (long long)ts[0].tv_sec, ts[0].tv_nsec,
+               (long long)ts[1].tv_sec, ts[1].tv_nsec);
+    return res;
+}
+
+static int trace_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->create(path, mode, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "create %s 0%o 0%o %llu", p, fi->flags, mode,
+               (unsigned long long)(res == 0 ? fi->fh : (uint64_t)-1));
+    return res;
+}
+
+static int trace_open(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->open(path, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "open %s 0%o %llu", p, fi->flags,
+               (unsigned long long)(res == 0 ? fi->fh : (uint64_t)-1));
+    return res;
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->read(path, buf, size, offset, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "read %s %llu %zu %lld", p, (unsigned long long)trace_fh(fi),
+               size, (long long)offset);
+    return res;
+}
+
+static int trace_read_buf(const char *path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->read_buf(path, bufp, size, offset, fi);
+    char p[TRACE_PATH_MAX];
+
+    // Like read, report the number of bytes read.
+    if (res == 0) {
+        res = fuse_buf_size(*bufp);
+    }
+    escape(p, path);
+    trace_line(start, res, "read %s %llu %zu %lld", p, (unsigned long long)trace_fh(fi),
+               size, (long long)offset);
+    return res < 0 ? res : 0;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->write(path, buf, size, offset, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "write %s %llu %zu %lld", p, (unsigned long long)trace_fh(fi),
+               size, (long long)offset);
+    return res;
+}
+
+static int trace_write_buf(const char *path, struct fuse_bufvec *buf,
+                           off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    size_t size = fuse_buf_size(buf);
+    int res = next_oper->write_buf(path, buf, offset, fi);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "write %s %llu %zu %lld", p, (unsigned long long)trace_fh(fi),
+               size, (long long)offset);
+    return res;
+}
+
+static int trace_flush(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->flush(path, fi);
+
+    trace_line(start, res, "flush %llu", (unsigned long long)trace_fh(fi));
+    return res;
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    uint64_t fh = trace_fh(fi);
+    int res = next_oper->release(path, fi);
+
+    trace_line(start, res, "release %llu", (unsigned long long)fh);
+    return res;
+}
+
+static int trace_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->fsync(path, isdatasync, fi);
+
+    trace_line(start, res, "fsync %llu %d", (unsigned long long)trace_fh(fi), isdatasync);
+    return res;
+}
+
+static int trace_fsyncdir(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->fsyncdir(path, isdatasync, fi);
+
+    trace_line(start, res, "fsyncdir %llu %d", (unsigned long long)trace_fh(fi), isdatasync);
+    return res;
+}
+
+static int trace_fallocate(const char *path, int mode, off_t offset, off_t length,
+                           struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->fallocate(path, mode, offset, length, fi);
+
+    trace_line(start, res, "fallocate %llu %d %lld %lld", (unsigned long long)trace_fh(fi),
+               mode, (long long)offset, (long long)length);
+    return res;
+}
+
+static ssize_t trace_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                                     off_t offset_in, const char *path_out,
+                                     struct fuse_file_info *fi_out, off_t offset_out,
+                                     size_t size, int flags)
+{
+    uint64_t start = monotonic_ns();
+    ssize_t res = next_oper->copy_file_range(path_in, fi_in, offset_in, path_out, fi_out,
+                                             offset_out, size, flags);
+
+    trace_line(start, res, "copy_file_range %llu %lld %llu %lld %zu %d",
+               (unsigned long long)trace_fh(fi_in), (long long)offset_in,
+               (unsigned long long)trace_fh(fi_out), (long long)offset_out, size, flags);
+    return res;
+}
+
+static off_t trace_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+    uint64_t start = monotonic_ns();
+    off_t res = next_oper->lseek(path, off, whence, fi);
+
+    trace_line(start, res, "lseek %llu %lld %d", (unsigned long long)trace_fh(fi),
+               (long long)off, whence);
+    return res;
+}
+
+static int trace_setxattr(const char *path, const char *name, const char *value,
+                          size_t size, int flags)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->setxattr(path, name, value, size, flags);
+    char p[TRACE_PATH_MAX];
+    char n[TRACE_PATH_MAX];
+
+    escape(p, path);
+    escape(n, name);
+    trace_line(start, res, "setxattr %s %s %zu %d", p, n, size, flags);
+    return res;
+}
+
+static int trace_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->getxattr(path, name, value, size);
+    char p[TRACE_PATH_MAX];
+    char n[TRACE_PATH_MAX];
+
+    escape(p, path);
+    escape(n, name);
+    trace_line(start, res, "getxattr %s %s %zu", p, n, size);
+    return res;
+}
+
+static int trace_listxattr(const char *path, char *list, size_t size)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->listxattr(path, list, size);
+    char p[TRACE_PATH_MAX];
+
+    escape(p, path);
+    trace_line(start, res, "listxattr %s %zu", p, size);
+    return res;
+}
+
+static int trace_removexattr(const char *path, const char *name)
+{
+    uint64_t start = monotonic_ns();
+    int res = next_oper->removexattr(path, name);
+    char p[TRACE_PATH_MAX];
+    char n[TRACE_PATH_MAX];
+
+    escape(p, path);
+    escape(n, name);
+    trace_line(start, res, "removexattr %s %s", p, n);
+    return res;
+}
+
+// Opened before fuse daemonizes and changes to the root directory, so that
+// relative paths work.
+int trace_open_file(const char *path)
+{
+    trace_file = fopen(path, "we");
+    if (trace_file == NULL) {
+        return -errno;
+    }
+    setvbuf(trace_file, NULL, _IOFBF, 1 << 20);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(trace_file, "# mirrorfs trace 1 started %lld.%09ld\n",
+            (long long)now.tv_sec, now.tv_nsec);
+    trace_start = monotonic_ns();
+    return 0;
+}
+
+#define TRACE_WRAP(op) \
+    if (next->op != NULL) { \
+        trace_oper.op = trace_##op; \
+    }
+
+const struct fuse_operations *trace_wrap(const struct fuse_operations *next)
+{
+    next_oper = next;
+
+    // Operations without a tracer are passed through untraced.
+    trace_oper = *next;
+    trace_oper.destroy = trace_destroy;
+    TRACE_WRAP(init);
+    TRACE_WRAP(getattr);
+    TRACE_WRAP(access);
+    TRACE_WRAP(readlink);
+    TRACE_WRAP(opendir);
+    TRACE_WRAP(readdir);
+    TRACE_WRAP(releasedir);
+    TRACE_WRAP(mkdir);
+    TRACE_WRAP(unlink);
+    TRACE_WRAP(rmdir);
+    TRACE_WRAP(symlink);
+    TRACE_WRAP(rename);
+    TRACE_WRAP(link);
+    TRACE_WRAP(chmod);
+    TRACE_WRAP(chown);
+    TRACE_WRAP(truncate);
+    TRACE_WRAP(utimens);
+    TRACE_WRAP(create);
+    TRACE_WRAP(open);
+    TRACE_WRAP(read);
+    TRACE_WRAP(read_buf);
+    TRACE_WRAP(write);
+    TRACE_WRAP(write_buf);
+    TRACE_WRAP(flush);
+    TRACE_WRAP(release);
+    TRACE_WRAP(fsync);
+    TRACE_WRAP(fsyncdir);
+    TRACE_WRAP(fallocate);
+    TRACE_WRAP(copy_file_range);
+    TRACE_WRAP(lseek);
+    TRACE_WRAP(setxattr);
+    TRACE_WRAP(getxattr);
+    TRACE_WRAP(listxattr);
+    TRACE_WRAP(removexattr);
+    return &trace_oper;
+}
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mirrorfs.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+// Each FUSE thread submits through its own ring so that a whole fan-out is
+// one io_uring_submit_and_wait() without any cross-thread locking.
+#define URING_ENTRIES (2 * MAX_MNTPATHS)
+
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t uring_key;
+static int uring_ops[MIRROR_OP_COUNT];   // opcode per mirror_op, 0 if unsupported
+static __thread struct io_uring *thread_ring;
+static __thread int thread_ring_failed;
+
+static void uring_free_ring(void *ring)
+{
+    io_uring_queue_exit(ring);
+    free(ring);
+}
+
+// Record which mirror_ops the running kernel can service so that anything
+// else keeps using the syscall path.
+static void uring_probe(void)
+{
+    struct io_uring ring;
+    struct io_uring_probe *probe;
+    static const struct {
+        enum mirror_op op;
+        int opcode;
+    } map[] = {
+        { MIRROR_STATX, IORING_OP_STATX },
+        { MIRROR_OPENAT, IORING_OP_OPENAT },
+        { MIRROR_UNLINKAT, IORING_OP_UNLINKAT },
+        { MIRROR_MKDIRAT, IORING_OP_MKDIRAT },
+        { MIRROR_RENAMEAT, IORING_OP_RENAMEAT },
+        { MIRROR_LINKAT, IORING_OP_LINKAT },
+        { MIRROR_SYMLINKAT, IORING_OP_SYMLINKAT },
+        { MIRROR_PREAD, IORING_OP_READ },
+        { MIRROR_PWRITE, IORING_OP_WRITE },
+        { MIRROR_CLOSE, IORING_OP_CLOSE },
+        { MIRROR_FSYNC, IORING_OP_FSYNC },
+    };
+
+    pthread_key_create(&uring_key, uring_free_ring);
+
+    if (io_uring_queue_init(URING_ENTRIES, &ring, 0) != 0) {
+        return;
+    }
+    probe = io_uring_get_probe_ring(&ring);
+    if (probe != NULL) {
+        for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+            if (io_uring_opcode_supported(probe, map[i].opcode)) {
+                uring_ops[map[i].op] = map[i].opcode;
+            }
+        }
+        io_uring_free_probe(probe);
+    }
+    io_uring_queue_exit(&ring);
+}
+
+static struct io_uring *uring_get_ring(void)
+{
+    if (thread_ring != NULL || thread_ring_failed) {
+        return thread_ring;
+    }
+
+    struct io_uring *ring = malloc(sizeof(*ring));
+    if (ring == NULL || io_uring_queue_init(URING_ENTRIES, ring, 0) != 0) {
+        free(ring);
+        thread_ring_failed = 1;
+        return NULL;
+    }
+    pthread_setspecific(uring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+// Wait for one completion and record it in call.  Returns 0, or the errno
+// of io_uring_wait_cqe().
+static int uring_reap(struct mirror_call *call, struct io_uring *ring, uint64_t start,
+                      unsigned *done)
+{
+    struct io_uring_cqe *cqe;
+    int res;
+
+    while ((res = io_uring_wait_cqe(ring, &cqe)) == -EINTR) {
+    }
+    if (res < 0) {
+        fprintf(stderr, "%s: io_uring_wait_cqe: %s\n", __func__, strerror(-res));
+        return -res;
+    }
+    int i = (uintptr_t)io_uring_cqe_get_data(cqe);
+    if (cqe->res < 0) {
+        call->res[i] = -1;
+        call->errnos[i] = -cqe->res;
+    } else {
+        call->res[i] = (call->op == MIRROR_STATX) ? 0 : cqe->res;
+        call->errnos[i] = 0;
+    }
+    call->nsecs[i] = monotonic_ns() - start;
+    stats_exec(call, i);
+    if (call->op == MIRROR_OPENAT && call->newfds != NULL) {
+        call->newfds[i] = call->res[i];
+    }
+    io_uring_cqe_seen(ring, cqe);
+    *done |= 1u << i;
+    return 0;
+}
+
+int mirror_call_run_uring(struct mirror_call *call)
+{
+    pthread_once(&uring_once, uring_probe);
+    if (uring_ops[call->op] == 0) {
+        return -ENOSYS;
+    }
+    // Only a stat can act on a bare descriptor without a /proc path.
+    if (call->path == NULL && call->op != MIRROR_STATX &&
+        call->op != MIRROR_PREAD && call->op != MIRROR_PWRITE &&
+        call->op != MIRROR_CLOSE && call->op != MIRROR_FSYNC) {
+        return -ENOSYS;
+    }
+    struct io_uring *ring = uring_get_ring();
+    if (ring == NULL) {
+        return -ENOSYS;
+    }
+
+    for (int i = 0; i < mntpath_count; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+        switch (call->op) {
+            case MIRROR_STATX: {
+                int flags = call->path ? call->flags : call->flags | AT_EMPTY_PATH;
+                memset(&call->stxs[i], 0, sizeof(struct statx));
+                io_uring_prep_statx(sqe, call->fds[i], call->path ? call->path : "",
+                                    i == 0 ? flags : flags | call->flags2,
+                                    i == 0 ? call->mask | STATX_BASIC_STATS : call->mask,
+                                    &call->stxs[i]);
+                break;
+            }
+            case MIRROR_OPENAT:
+                io_uring_prep_openat(sqe, call->fds[i], call->path, call->flags, call->mode);
+                break;
+            case MIRROR_UNLINKAT:
+                io_uring_prep_unlinkat(sqe, call->fds[i], call->path, call->flags);
+                break;
+            case MIRROR_MKDIRAT:
+                io_uring_prep_mkdirat(sqe, call->fds[i], call->path, call->mode);
+                break;
+            case MIRROR_RENAMEAT:
+                io_uring_prep_renameat(sqe, call->fds[i], call->path,
+                                       call->fds2[i], call->path2, 0);
+                break;
+            case MIRROR_LINKAT:
+                io_uring_prep_linkat(sqe, call->fds[i], call->path,
+                                     call->fds2[i], call->path2, call->flags);
+                break;
+            case MIRROR_SYMLINKAT:
+                io_uring_prep_symlinkat(sqe, call->path2, call->fds[i], call->path);
+                break;
+            case MIRROR_PREAD:
+                io_uring_prep_read(sqe, call->fds[i], call->bufs[i], call->size, call->offset);
+                break;
+            case MIRROR_PWRITE:
+                io_uring_prep_write(sqe, call->fds[i], call->wbuf, call->size, call->offset);
+                break;
+            case MIRROR_CLOSE:
+                io_uring_prep_close(sqe, call->fds[i]);
+                break;
+            case MIRROR_FSYNC:
+                io_uring_prep_fsync(sqe, call->fds[i], call->flags ? IORING_FSYNC_DATASYNC : 0);
+                break;
+            default:
+                abort();
+        }
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+    }
+
+    // The entries are already queued on the ring, so there is no falling back
+    // from here on: a later submit would issue them a second time.
+    uint64_t start = monotonic_ns();
+    unsigned done = 0;
+    int submitted = 0;
+    int reaped = 0;
+    int err = 0;
+    while (submitted < mntpath_count && err == 0) {
+        int res = io_uring_submit_and_wait(ring, mntpath_count - submitted);
+        if (res == -EINTR) {
+            continue;
+        }
+        if (res > 0) {
+            submitted += res;
+            continue;
+        }
+        // Nothing went in.  Completions free up room in the kernel, so wait
+        // for one of ours before trying again; with none in flight, give up.
+        if ((res == 0 || res == -EAGAIN || res == -EBUSY) && reaped < submitted) {
+            err = uring_reap(call, ring, start, &done);
+            if (err == 0) {
+                reaped++;
+            }
+            continue;
+        }
+        err = res == 0 ? EAGAIN : -res;
+        fprintf(stderr, "%s: io_uring_submit_and_wait: %s\n", __func__, strerror(err));
+    }
+    while (reaped < submitted) {
+        int res = uring_reap(call, ring, start, &done);
+        if (res != 0) {
+            err = res;
+            break;
+        }
+        reaped++;
+    }
+    if (err == 0) {
+        return 0;
+    }
+
+    // Fail the mirrors that did not complete, and stop using a ring that may
+    // still hold their entries.
+    for (int i = 0; i < mntpath_count; i++) {
+        if (done & (1u << i)) {
+            continue;
+        }
+        call->res[i] = -1;
+        call->errnos[i] = err;
+        call->nsecs[i] = monotonic_ns() - start;
+        if (call->op == MIRROR_OPENAT && call->newfds != NULL) {
+            call->newfds[i] = -1;
+        }
+    }
+    pthread_setspecific(uring_key, NULL);
+    uring_free_ring(ring);
+    thread_ring = NULL;
+    thread_ring_failed = 1;
+    return 0;
+}
+
+#else
+
+int mirror_call_run_uring(struct mirror_call *call)
+{
+    return -ENOSYS;
+}
+
+#endif
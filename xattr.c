@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "mirrorfs.h"
+
+// Extended attributes, fanned out to every replica like any other call.
+// Values are compared byte for byte and name lists regardless of order.
+//
+// The kernel looks up security.capability before every write to a file, to
+// know whether the write has to drop it, and POSIX ACLs on permission checks,
+// and nearly always finds nothing.  So that these lookups do not cost a
+// call on every replica, an object on which every replica lacks one of
+// these attributes is remembered in a small table keyed by the primary's
+// device and inode, and later lookups are answered from a stat of the
+// primary alone.  Setting an attribute forgets the object, as does creating
+// one, since a new object may reuse a forgotten inode number and inherit
+// default ACLs.  Attributes added behind mirrorfs's back go unnoticed until
+// the object drops out of the table; -o no_xattr_cache turns it off.
+
+#define XATTR_CACHE_SLOTS 4096
+#define XATTR_CACHE_LOCKS 64
+
+static const char *const cached_names[] = {
+    "security.capability",
+    "system.posix_acl_access",
+    "system.posix_acl_default",
+};
+
+#define CACHED_NAME_COUNT (sizeof(cached_names) / sizeof(cached_names[0]))
+
+// One object per slot; a new object simply takes the slot over.
+struct xattr_slot {
+    dev_t dev;
+    ino_t ino;
+    unsigned absent;          // bit per cached name every replica lacks
+    unsigned forgets;         // so that lookups racing a set are not remembered
+};
+
+static struct xattr_slot slots[XATTR_CACHE_SLOTS];
+static pthread_mutex_t slot_locks[XATTR_CACHE_LOCKS] = {
+    [0 ... XATTR_CACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+static atomic_int cache_used;
+
+static atomic_ulong cache_hits;
+static atomic_ulong cache_misses;
+
+static int cached_name(const char *name)
+{
+    if (options.no_xattr_cache) {
+        return -1;
+    }
+    for (size_t n = 0; n < CACHED_NAME_COUNT; n++) {
+        if (strcmp(name, cached_names[n]) == 0) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+// The primary's identity of the object at path, or of fds[0] for NULL.
+static int object_id(const int *fds, const char *path, dev_t *dev, ino_t *ino)
+{
+    struct statx stx;
+
+    if (statx(fds[0], path != NULL ? path : "",
+              path != NULL ? AT_SYMLINK_NOFOLLOW : AT_EMPTY_PATH, STATX_INO, &stx) == -1) {
+        return -1;
+    }
+    *dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    *ino = stx.stx_ino;
+    return 0;
+}
+
+static size_t slot_index(dev_t dev, ino_t ino)
+{
+    return (ino ^ (dev * 0x9e3779b97f4a7c15ULL)) & (XATTR_CACHE_SLOTS - 1);
+}
+
+// Whether the object is known to lack the attribute.  Otherwise *forgets
+// is set for cache_set_absent().
+static int cache_absent(dev_t dev, ino_t ino, int bit, unsigned *forgets)
+{
+    size_t k = slot_index(dev, ino);
+    pthread_mutex_t *lock = &slot_locks[k % XATTR_CACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+    int absent = slots[k].dev == dev && slots[k].ino == ino &&
+                 (slots[k].absent & (1u << bit)) != 0;
+    *forgets = slots[k].forgets;
+    pthread_mutex_unlock(lock);
+    return absent;
+}
+
+// Remember that the object lacks the attribute, unless the slot was
+// forgotten since the lookup began.
+static void cache_set_absent(dev_t dev, ino_t ino, int bit, unsigned forgets)
+{
+    size_t k = slot_index(dev, ino);
+    pthread_mutex_t *lock = &slot_locks[k % XATTR_CACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+    if (slots[k].forgets != forgets) {
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    if (slots[k].dev != dev || slots[k].ino != ino) {
+        slots[k].dev = dev;
+        slots[k].ino = ino;
+        slots[k].absent = 0;
+    }
+    slots[k].absent |= 1u << bit;
+    pthread_mutex_unlock(lock);
+    atomic_store(&cache_used, 1);
+}
+
+static void cache_forget(dev_t dev, ino_t ino)
+{
+    size_t k = slot_index(dev, ino);
+    pthread_mutex_t *lock = &slot_locks[k % XATTR_CACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+    if (slots[k].dev == dev && slots[k].ino == ino) {
+        slots[k].absent = 0;
+    }
+    slots[k].forgets++;
+    pthread_mutex_unlock(lock);
+}
+
+void xattr_created(const int *fds, const char *path)
+{
+    dev_t dev;
+    ino_t ino;
+
+    // Nothing to forget until something has been remembered.
+    if (atomic_load(&cache_used) && object_id(fds, path, &dev, &ino) == 0) {
+        cache_forget(dev, ino);
+    }
+}
+
+static void verify_value(struct mirror_call *call)
+{
+    for (int i = 1; i < mntpath_count; i++) {
+        CHECK_EQUAL(i, call->res[0], call->res[i]);
+        CHECK_EQUAL(i, call->errnos[0], call->errnos[i]);
+    }
+    if (call->size > 0 && call->res[0] > 0) {
+        for (int i = 1; i < mntpath_count; i++) {
+            if (call->res[i] != call->res[0]) {
+                return;
+            }
+        }
+        CHECK_BUFFERS(call->bufs, call->res[0], 0);
+    }
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Split a list of NUL-terminated names and sort it.  Returns the number of
+// names, or -1 if names could not be allocated.
+static ssize_t sorted_names(const char *list, size_t len, const char ***names)
+{
+    size_t count = 0;
+
+    for (size_t pos = 0; pos < len; pos += strlen(list + pos) + 1) {
+        count++;
+    }
+    *names = malloc((count ? count : 1) * sizeof(**names));
+    if (*names == NULL) {
+        return -1;
+    }
+    count = 0;
+    for (size_t pos = 0; pos < len; pos += strlen(list + pos) + 1) {
+        (*names)[count++] = list + pos;
+    }
+    qsort(*names, count, sizeof(**names), name_cmp);
+    return count;
+}
+
+// Replicas may list names in any order.  The first name missing from a
+// replica's list, or only found there, is reported.
+static void verify_list(struct mirror_call *call)
+{
+    const char **primary;
+    ssize_t count;
+
+    for (int i = 1; i < mntpath_count; i++) {
+        CHECK_EQUAL(i, call->res[0], call->res[i]);
+        CHECK_EQUAL(i, call->errnos[0], call->errnos[i]);
+    }
+    if (call->size == 0 || call->res[0] <= 0) {
+        return;
+    }
+    count = sorted_names(call->bufs[0], call->res[0], &primary);
+    if (count == -1) {
+        return;
+    }
+    for (int i = 1; i < mntpath_count; i++) {
+        const char **names;
+        ssize_t n;
+
+        if (call->res[i] != call->res[0] ||
+            (n = sorted_names(call->bufs[i], call->res[i], &names)) == -1) {
+            continue;
+        }
+        for (ssize_t p = 0, r = 0; p < count || r < n; ) {
+            int cmp = p == count ? 1 : r == n ? -1 : strcmp(primary[p], names[r]);
+            if (cmp == 0) {
+                p++;
+                r++;
+                continue;
+            }
+            const char *name = cmp < 0 ? primary[p] : names[r];
+            const char *what = cmp < 0 ? "missing" : "extra";
+            fprintf(stderr, "%s: replica %d %s attribute: %s\n", __func__, i, what, name);
+            struct divergence d = {
+                .replica = i,
+                .what = what,
+                .name = name,
+            };
+            divergence(__func__, &d);
+            break;
+        }
+        free(names);
+    }
+    free(primary);
+}
+
+ssize_t mirror_getxattr(const int *fds, const char *path, const char *name,
+                        char *value, size_t size)
+{
+    struct mirror_call call = {
+        .op = MIRROR_GETXATTR,
+        .fds = fds,
+        .path = path,
+        .path2 = name,
+        .size = size,
+    };
+    int bit = cached_name(name);
+    dev_t dev;
+    ino_t ino;
+    unsigned forgets;
+
+    if (bit != -1 && object_id(fds, path, &dev, &ino) == -1) {
+        bit = -1;
+    }
+    if (bit != -1) {
+        if (cache_absent(dev, ino, bit, &forgets)) {
+            atomic_fetch_add_explicit(&cache_hits, 1, memory_order_relaxed);
+            return -ENODATA;
+        }
+        atomic_fetch_add_explicit(&cache_misses, 1, memory_order_relaxed);
+    }
+
+    if (size > 0 && bufpool_get(size, call.bufs) != 0) {
+        return -ENOMEM;
+    }
+    mirror_call_shadow(&call, verify_value);
+
+    if (call.res[0] == -1) {
+        if (bit != -1 && call.errnos[0] == ENODATA) {
+            cache_set_absent(dev, ino, bit, forgets);
+        }
+        return -call.errnos[0];
+    }
+    if (size > 0) {
+        memcpy(value, call.bufs[0], call.res[0]);
+    }
+    return call.res[0];
+}
+
+int mirror_setxattr(const int *fds, const char *path, const char *name,
+                    const char *value, size_t size, int flags)
+{
+    struct mirror_call call = {
+        .op = MIRROR_SETXATTR,
+        .fds = fds,
+        .path = path,
+        .path2 = name,
+        .wbuf = value,
+        .size = size,
+        .flags = flags,
+    };
+    dev_t dev;
+    ino_t ino;
+
+    // Forgotten whatever the outcome, since replicas may have diverged.
+    int res = mirror_simple(&call);
+    if (cached_name(name) != -1 && object_id(fds, path, &dev, &ino) == 0) {
+        cache_forget(dev, ino);
+    }
+    return res;
+}
+
+ssize_t mirror_listxattr(const int *fds, const char *path, char *list, size_t size)
+{
+    struct mirror_call call = {
+        .op = MIRROR_LISTXATTR,
+        .fds = fds,
+        .path = path,
+        .size = size,
+    };
+
+    if (size > 0 && bufpool_get(size, call.bufs) != 0) {
+        return -ENOMEM;
+    }
+    mirror_call_shadow(&call, verify_list);
+
+    if (call.res[0] == -1) {
+        return -call.errnos[0];
+    }
+    if (size > 0) {
+        memcpy(list, call.bufs[0], call.res[0]);
+    }
+    return call.res[0];
+}
+
+// Removing an attribute only makes remembered absences truer.
+int mirror_removexattr(const int *fds, const char *path, const char *name)
+{
+    struct mirror_call call = {
+        .op = MIRROR_REMOVEXATTR,
+        .fds = fds,
+        .path = path,
+        .path2 = name,
+    };
+    return mirror_simple(&call);
+}
+
+void xattr_report(FILE *f)
+{
+    unsigned long hits = atomic_load(&cache_hits);
+    unsigned long misses = atomic_load(&cache_misses);
+
+    if (hits + misses == 0) {
+        return;
+    }
+    fprintf(f, "xattr: %lu of %lu security attribute lookups answered from the cache\n",
+            hits, hits + misses);
+}